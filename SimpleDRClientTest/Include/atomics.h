@@ -0,0 +1,52 @@
+#ifndef _ATOMICS_EXALGO_H
+#define _ATOMICS_EXALGO_H
+
+#include "dr_api.h"
+
+/* atomic updates and ordering for state shared between threads without a lock -
+
+the counters are updated by every thread building or running code, and the lock free readers
+(module lists, the active words) need the stores that set up an object to be visible before the
+store that publishes it. volatile alone only gives that under MSVC's default /volatile:ms, so the
+ordering is spelled out with these. The barriers are compiler barriers on MSVC - x86 does not
+reorder stores with stores or loads with loads - and FULL_BARRIER also orders a store before a
+later load.
+*/
+
+#ifdef _MSC_VER
+
+#include <intrin.h>
+
+#define ATOMIC_ADD32(ptr, val)			((uint)_InterlockedExchangeAdd((volatile long *)(ptr), (long)(val)))
+#define ATOMIC_INC32(ptr)				((uint)_InterlockedIncrement((volatile long *)(ptr)))
+/* returns the old value; the store happened if it equals expected */
+#define ATOMIC_CAS32(ptr, expected, val)	((uint)_InterlockedCompareExchange((volatile long *)(ptr), (long)(val), (long)(expected)))
+
+#define RELEASE_BARRIER()	_ReadWriteBarrier()
+#define ACQUIRE_BARRIER()	_ReadWriteBarrier()
+#define FULL_BARRIER()		MemoryBarrier()
+
+static __inline void atomic_add64(volatile uint64 * ptr, uint64 val){
+	uint64 old;
+	do {
+		old = *ptr;
+	} while ((uint64)_InterlockedCompareExchange64((volatile __int64 *)ptr, (__int64)(old + val), (__int64)old) != old);
+}
+
+#else
+
+#define ATOMIC_ADD32(ptr, val)			__atomic_fetch_add((ptr), (val), __ATOMIC_SEQ_CST)
+#define ATOMIC_INC32(ptr)				__atomic_add_fetch((ptr), 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS32(ptr, expected, val)	__sync_val_compare_and_swap((ptr), (expected), (val))
+
+#define RELEASE_BARRIER()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define ACQUIRE_BARRIER()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define FULL_BARRIER()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline void atomic_add64(volatile uint64 * ptr, uint64 val){
+	__atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+#endif
@@ -2,10 +2,11 @@
 #define _CPUID_EXALGO_H
 
 #include "dr_api.h"
+#include "options.h"
 
 
 void cpuid_init(client_id_t id, const char * name,
-				const char * arguments);
+				const option_group_t * options);
 void cpuid_exit_event(void);
 dr_emit_flags_t cpuid_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
 				instr_t *instr, bool for_trace, bool translating,
@@ -12,6 +12,7 @@
 #define FILTER_NEG_MODULE	5
 #define FILTER_NONE			6
 #define FILTER_NUDGE		7
+#define FILTER_THREAD		8	/* filter programs only - the thread being traced */
 
 typedef unsigned char uchar;
 
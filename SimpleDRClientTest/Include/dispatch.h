@@ -0,0 +1,101 @@
+#ifndef _DISPATCH_EXALGO_H
+#define _DISPATCH_EXALGO_H
+
+#include "dr_api.h"
+#include "defines.h"
+#include "moduleinfo.h"
+
+/* the dispatcher in main.c registers a single set of bb callbacks with drmgr and calls the
+   callbacks of every enabled pass from them. The block is analyzed once (module lookup, offset,
+   first/last app instr) and the result is handed to the passes through this structure */
+
+/* typedefs */
+
+struct _filter_program_t;
+
+/* per block information - shared by all the passes; only valid while the block is being built */
+typedef struct _bb_context_t {
+
+	void * tag;
+	instr_t * first;			/* first application instruction */
+	instr_t * last;				/* last application instruction */
+	uint num_instrs;			/* number of application instructions */
+
+	app_pc start_pc;			/* app pc of the first application instruction */
+	app_pc module_start;		/* NULL if the block is not inside a module (generated code) */
+	app_pc module_end;			/* end of that module - trace blocks may run past it */
+	uint module_id;				/* interned name id - see module_registry.h */
+	const char * module_name;	/* interned name - valid until the process exits */
+	uint offset;				/* offset of start_pc from the module start */
+
+	void * user_data;			/* what the pass's own analysis callback returned in user_data */
+	bool filtered;				/* PRODUCT_BB_FILTER - the block passes the pass's own filter */
+	struct _filter_program_t * program;	/* the pass's filter program (utilities.h) - NULL if it filters with filter_mode */
+	uint filter_mode;			/* the pass's filter mode when the block was analysed - nudges may change it meanwhile */
+
+} bb_context_t;
+
+/* nudges understood by the dispatcher - the nudge argument is
+   op | (pass index << 8) | (filter mode << 16), the pass index being the position of the pass among
+   the enabled passes in the order they run: the order of the pass groups (config file first), with
+   producers moved ahead of their consumers. The index of each pass is printed to the debug output and
+   the DR log at startup. A filter mode using the filter list (bb, module, range) is refused for a pass
+   which was started without a filter file */
+#define NUDGE_PASS_DISABLE		1	/* stop instrumenting with the pass */
+#define NUDGE_PASS_ENABLE		2	/* resume instrumenting with the pass */
+#define NUDGE_PASS_FILTER_MODE	3	/* change the pass's filter mode */
+#define NUDGE_INSTRUMENT_ON		4	/* FILTER_NUDGE passes start instrumenting */
+#define NUDGE_INSTRUMENT_OFF	5	/* FILTER_NUDGE passes stop instrumenting */
+#define NUDGE_PASS_SNAPSHOT		6	/* the pass writes a snapshot of what it collected so far (profile) */
+
+#define NUDGE_ARG(op, pass, mode)	((uint64)(op) | ((uint64)(pass) << 8) | ((uint64)(mode) << 16))
+#define NUDGE_GET_OP(arg)			((uint)((arg) & 0xff))
+#define NUDGE_GET_PASS(arg)			((uint)(((arg) >> 8) & 0xff))
+#define NUDGE_GET_MODE(arg)			((uint)(((arg) >> 16) & 0xff))
+
+/* per thread active word - the dynamic terms of filter programs (utilities.h). Each bit is kept up
+   to date for every thread (dispatch_set_active) and the code of a pass filtering on some of them is
+   guarded by an inline check of the thread's word, so the decision is made at runtime and the block
+   is instrumented once for all threads */
+#define ACTIVE_FUNCTION		0x1		/* thread is inside a filtered function (funcwrap); set when no pass produces it */
+#define ACTIVE_THREAD		0x2		/* thread is the one being traced (funcwrap); set when no pass produces it */
+#define ACTIVE_NUDGE		0x4		/* NUDGE_INSTRUMENT_ON / OFF */
+#define NUM_ACTIVE_BITS		3
+
+/* sets or clears bits of the active word of the thread, or of every thread if drcontext is NULL;
+   only the latter takes a lock */
+void dispatch_set_active(void * drcontext, uint bits, bool set);
+
+/* the filter of a pass which can change it at runtime - head and a pointer to the mode it filters with */
+typedef void(*get_filter_func_t) (module_t ** list, uint ** mode);
+
+/* products - results one pass computes and other passes use. A pass declares what it produces and
+   consumes (bit masks of PRODUCT_MASK) in the pass table; the dispatcher orders consumers after
+   producers and hands out each product through dispatch_product, with a default when no enabled
+   pass produces it */
+#define PRODUCT_BB_FILTER			0	/* block is in the pass's filter set - computed once per block by the dispatcher into bb_context_t->filtered and remembered per tag */
+#define PRODUCT_CURRENT_FUNCTION	1	/* offset of the thread's current function in its module (functrace); default 0 */
+#define PRODUCT_FUNCTION_FILTER		2	/* thread is inside a filtered function (funcwrap); default true */
+#define PRODUCT_THREAD_FILTER		3	/* thread is the one being traced (funcwrap); default true */
+#define NUM_PRODUCTS				4
+
+#define PRODUCT_MASK(product)		(1 << (product))
+
+typedef uint(*product_func_t) (void * drcontext);
+
+/* the value is kept per thread and the producer is only asked again after it reported a change */
+uint dispatch_product(void * drcontext, uint product);
+/* the producer's value changed for the thread, or for every thread if drcontext is NULL */
+void dispatch_product_changed(void * drcontext, uint product);
+/* the same for the thread from inlined code - base holds the thread context (thread_context_insert_load);
+   a single store, flags are not touched */
+void dispatch_insert_product_changed(void * drcontext, instrlist_t * bb, instr_t * where, reg_id_t base, uint product);
+
+/*
+pass callbacks keep the drmgr signatures -
+analysis_bb gets a user_data slot of its own
+instrumentation_bb gets the bb_context_t * of the block as user_data, with bb_context_t->user_data
+set to whatever the same pass's analysis_bb returned
+*/
+
+#endif
@@ -2,11 +2,12 @@
 #define _FUNCTRACE_EXALGO_H
 
 #include "dr_api.h"
+#include "options.h"
 
 /* typdefs */
 typedef struct _function_t {
 
-	uint start_addr;
+	uint start_addr;	/* offset in the function's module, as in the bb records; 0 outside modules */
 	uint end_addr;
 	bool is_recursive;
 
@@ -20,7 +21,7 @@ uint get_current_function_all(void * drcontext);
 
 /* for the entire process */
 void functrace_init(client_id_t id, const char * name,
-	const char * arguments);
+	const option_group_t * options);
 void functrace_exit_event(void);
 
 /* for basic blocks */
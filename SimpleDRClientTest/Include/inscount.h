@@ -2,10 +2,15 @@
 #define _INSCOUNT_EXALGO_H
 
 #include "dr_api.h"
+#include "options.h"
+#include "moduleinfo.h"
 
  /*instrumentation routines*/
-void inscount_init(client_id_t id, const char * name, const char * arguments);
+void inscount_init(client_id_t id, const char * name, const option_group_t * options);
 void inscount_exit_event(void);
+void inscount_lazy_init(void);
+void inscount_lazy_exit(void);
+void inscount_get_filter(module_t ** list, uint ** mode);
 dr_emit_flags_t inscount_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
                 instr_t *instr, bool for_trace, bool translating,
                 void *user_data);
@@ -2,12 +2,17 @@
  #define _INSTRACE_EXALGO_H
 
 #include "dr_api.h"
+#include "options.h"
+#include "moduleinfo.h"
 #include "defines.h"
 
  /*instrumentation routines*/
 void instrace_init(client_id_t id, const char * name,
-				const char * arguments);
+				const option_group_t * options);
 void instrace_exit_event(void);
+void instrace_lazy_init(void);
+void instrace_lazy_exit(void);
+void instrace_get_filter(module_t ** list, uint ** mode);
 dr_emit_flags_t instrace_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
 				instr_t *instr, bool for_trace, bool translating,
 				void *user_data);
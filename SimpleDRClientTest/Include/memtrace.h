@@ -2,11 +2,16 @@
 #define _MEMTRACE_EXALGO_H
 
 #include "dr_api.h"
+#include "options.h"
+#include "moduleinfo.h"
  
  /*instrumentation routines*/
 void memtrace_init(client_id_t id, const char * name,
-				const char * arguments);
+				const option_group_t * options);
 void memtrace_exit_event(void);
+void memtrace_lazy_init(void);
+void memtrace_lazy_exit(void);
+void memtrace_get_filter(module_t ** list, uint ** mode);
 dr_emit_flags_t memtrace_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
                 instr_t *instr, bool for_trace, bool translating,
                 void *user_data);
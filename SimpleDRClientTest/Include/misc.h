@@ -3,6 +3,7 @@
 
 #include "defines.h"
 #include "dr_api.h"
+#include "options.h"
 
 /* typdefs */
 
@@ -10,8 +11,10 @@
 
 /* for the entire process */
 void misc_init(client_id_t id, const char * name,
-	const char * arguments);
+	const option_group_t * options);
 void misc_exit_event(void);
+void misc_lazy_init(void);
+void misc_lazy_exit(void);
 
 /* for basic blocks */
 dr_emit_flags_t misc_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
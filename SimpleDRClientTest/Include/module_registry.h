@@ -0,0 +1,39 @@
+#ifndef _MODULE_REGISTRY_EXALGO_H
+#define _MODULE_REGISTRY_EXALGO_H
+
+#include "dr_api.h"
+
+/* registry of the loaded modules -
+
+kept up to date from the module load / unload events. The modules are kept in an array sorted by
+load address so a pc is resolved to its module with a binary search - no module_data_t copy and no
+string compares (dr_lookup_module allocates on every call). Module names are interned: every
+distinct name gets a small id and one copy of the string which lives until the registry is torn
+down, so names can be compared by id and handed to clean calls without copying.
+*/
+
+#define MAX_MODULE_NAMES	4096	/* distinct interned names */
+#define MAX_LOADED_MODULES	1024	/* modules loaded at the same time */
+
+typedef struct _loaded_module_t {
+
+	app_pc start;
+	app_pc end;
+	uint name_id;
+	const char * name;		/* interned full path */
+
+} loaded_module_t;
+
+void module_registry_init();
+void module_registry_exit();
+
+/* copies the module containing pc to module; false if pc is not inside a loaded module */
+bool module_registry_lookup(app_pc pc, loaded_module_t * module);
+
+/* interned names - ids are stable and never reused */
+uint module_registry_intern(const char * name);
+/* the id of an already interned name - false if the name was never interned */
+bool module_registry_find(const char * name, uint * name_id);
+const char * module_registry_name(uint name_id);
+
+#endif
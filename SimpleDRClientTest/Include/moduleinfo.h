@@ -3,38 +3,63 @@
 
 #include "dr_api.h"
 #include "functrace.h"
+#include "writer.h"
 #include "moduleinfo.h"
 
-#define MAX_TARGETS	100
-#define MAX_BBS_PER_MODULE 30000
+#define EDGE_INLINE		1		/* edges stored inside an edge list before it overflows to the arena */
+#define EDGE_FIRST_OVERFLOW	4	/* size of the first overflow array; every later one doubles */
+
+#define BB_FIRST_CHUNK	16		/* bbs in the first chunk of a module; every later chunk doubles */
+#define MAX_BB_CHUNKS	24		/* up to BB_FIRST_CHUNK << (MAX_BB_CHUNKS - 1) bbs per module */
+
+#define BLOOM_MIN_BBS		256	/* modules read from a file with fewer bbs get no bloom filter */
+#define BLOOM_BITS_PER_BB	16	/* two probes - about 1.4% false positives at full capacity */
 
 /* containers for bb storage - not optimized */
 
 /*
 
 conventions used -
-bbs[0].start_addr will contain the length of valid bbs populated for this module
-from_bbs[0].start_addr will contain the length of valid from bbs for this bb
-to_bbs[0].bb_addr will contain the length of valid to bbs for this bb
-called_from[0].bb_addr will contain the length of call targets which called this bb
+the bbs of a module are reached through md_get_bb_count / md_get_bb (add order) or md_get_sorted_bb;
+they are stored in chunks from an arena and never move, so bbinfo_t pointers stay valid
+from_bbs, to_bbs, called_from and called_to are edge lists - the first EDGE_INLINE edges live in the
+bbinfo_t itself and the rest in an overflow array from the same arena as the bbs; they are only
+touched through md_record_edge / md_get_edge_count / md_get_edge and have no size limit
+
+every module keeps an open addressing hash index (offset -> position of the bb) so that bb lookups
+do not scan the list; it is kept up to date by the md_ functions, so bbs should only be added
+through them. Large modules read from a file also get a bloom filter in front of the index (or of the
+mapped offsets), so md_contains_bb answers most misses with two bit tests
+
+binary files are mapped and, unless extra_info is asked for, used in place - the modules keep
+pointers to the sorted offsets in the file and only build bbinfo_t records (materialize) when
+md_lookup_bb / md_get_bb / md_get_sorted_bb or an add needs them. The add order of the bbs (which
+range filters depend on) survives the round trip through a binary file
+
+module names are interned (module_registry.h); the head of a list caches the lookup result per
+name id so that md_lookup_module_id does no string compares after the first lookup of a module.
+Names and prefix patterns are compiled when a module is linked in, so md_lookup_module and
+md_get_module_position do not walk the list either; they must be given the head of a list
+
+lookups need no lock while a single writer adds to the list (see moduleinfo.c), so clean calls can
+look bbs up without the pass's mutex; writers to one list must still be serialized
 */
 
 /* if you change bbinfo struct then you need to change functions add_pc_to_list + delete_list */
 
-//from which bbs was this called
-typedef struct _call_bb_info_t {
-	char * module;
-	uint start_addr;
+//an edge to or from another bb of the same module
+typedef struct _edge_t {
+	uint addr;				/* offset of the other bb */
+	uint call_point_addr;	/* offset of the call instruction - called_from / called_to only */
 	uint freq;
-} call_bb_info_t;
+} edge_t;
 
-//if the bb is a call target
-typedef struct _call_target_info_t {
-	char * module;
-	uint bb_addr;
-	uint call_point_addr;
-	uint freq;
-} call_target_info_t;
+typedef struct _edge_list_t {
+	uint count;
+	uint capacity;			/* of more */
+	edge_t * more;			/* edges from EDGE_INLINE on - NULL until the list overflows */
+	edge_t first[EDGE_INLINE];
+} edge_list_t;
 
 
 //basic structure to carry bb information
@@ -48,11 +73,11 @@ typedef struct _bbinfo_t {
 	uint is_ret;
 	uint is_call_target;
 
-	call_bb_info_t * from_bbs;
-	call_bb_info_t * to_bbs;
+	edge_list_t from_bbs;
+	edge_list_t to_bbs;
 
-	call_target_info_t * called_from;
-	call_target_info_t * called_to;
+	edge_list_t called_from;
+	edge_list_t called_to;
 
 	function_t * func;
 
@@ -65,11 +90,28 @@ typedef struct _bbinfo_t {
 
 //module information
 typedef struct _module_t {
-	struct _module_t * next;
+	struct _module_t * volatile next;
 	char * module;
 	uint64 start_addr;
-	bbinfo_t * bbs;
-	uint size_bbs;
+	volatile uint num_bbs;
+	bbinfo_t * bb_chunks[MAX_BB_CHUNKS];	/* NULL until the chunk is needed */
+	bbinfo_t ** sorted_bbs;	/* md_sort_bb_list_in_module order - NULL if not sorted */
+	uint num_sorted;
+	struct _bb_index_t * volatile bb_index;	/* offset -> position hash index (moduleinfo.c) */
+	struct _bb_bloom_t * volatile bloom;	/* md_contains_bb prefilter (moduleinfo.c) - NULL if none */
+	uint name_id;			/* interned module name */
+	int prefix_length;		/* characters before the '*' of a prefix pattern; -1 for a full name */
+	uint position;			/* in the list - the head is 0 */
+	ptr_uint_t * id_cache;	/* head only - name id -> module (see md_lookup_module_id) */
+	struct _module_t ** by_name;	/* head only - name id -> first module with exactly that name */
+	struct _pattern_node_t * volatile patterns;	/* head only - compiled prefix patterns (moduleinfo.c) */
+	volatile uint list_gen;	/* head only - bumped whenever a module is linked in */
+	const uint * volatile mapped_bbs;	/* sorted offsets in a mapped binary file - NULL once materialized */
+	const uint * mapped_order;	/* the same offsets in the order they were added - NULL if that is the sorted order */
+	const uint * volatile ranges;	/* md_in_range lookup array (moduleinfo.c) - NULL until first used */
+	uint num_mapped;
+	void * map;				/* head only - binary file the modules point into */
+	size_t map_size;
 } module_t;
 
 
@@ -78,21 +120,57 @@ typedef struct _module_t {
 module_t * md_initialize();
 
 /* add a module to the list */
-bool md_add_module(module_t * head, char * name, uint length_list_bbs);
+/* expected_bbs sizes the lookup index of a new module (0 if not known); modules grow as needed */
+bool md_add_module(module_t * head, const char * name, uint expected_bbs);
 /* add an element */
-bbinfo_t * md_add_bb_to_module(module_t * head, char * name, unsigned int addr, unsigned int length_list_bbs, bool extra_info);
+bbinfo_t * md_add_bb_to_module(module_t * head, const char * name, unsigned int addr, unsigned int expected_bbs, bool extra_info);
 
 /* look up the module */
-module_t * md_lookup_module (module_t * head,char * name);
+module_t * md_lookup_module (module_t * head, const char * name);
+/* same by interned name id - cached per list */
+module_t * md_lookup_module_id (module_t * head, uint name_id);
 /* check for the presence of an element */
-bbinfo_t * md_lookup_bb_in_module (module_t * head, char * name, unsigned int addr);
+bbinfo_t * md_lookup_bb_in_module (module_t * head, const char * name, unsigned int addr);
+/* same for an already looked up module */
+bbinfo_t * md_lookup_bb (module_t * module, unsigned int addr);
+/* md_lookup_bb (module, addr) != NULL without building bbinfo_t records for a mapped module */
+bool md_contains_bb (module_t * module, unsigned int addr);
+
+/* bbs taken as consecutive (start, end) pairs - true if addr is inside one of the ranges, ends
+   included. Binary search over the merged ranges, built on first use */
+bool md_in_range (module_t * module, unsigned int addr);
+
+/* walking the bbs of a module */
+uint md_get_bb_count (module_t * module);
+bbinfo_t * md_get_bb (module_t * module, uint index);			/* add order */
+uint md_get_bb_addr (module_t * module, uint index);			/* start_addr of md_get_bb, same for mapped modules */
+bbinfo_t * md_get_sorted_bb (module_t * module, uint index);	/* md_sort_bb_list_in_module order */
+/* edges - md_record_edge bumps the frequency of the edge to addr or appends it with frequency 1 */
+edge_t * md_record_edge (edge_list_t * list, uint addr, uint call_point_addr);
+uint md_get_edge_count (edge_list_t * list);
+edge_t * md_get_edge (edge_list_t * list, uint index);
 /* gets the module position with respect to the module head */
-int md_get_module_position(module_t * head, char * name);
+int md_get_module_position(module_t * head, const char * name);
 
-/* parse the file and fill the linked list */
+/* parse the file and fill the linked list - binary files (md_print_binary_to_file) are loaded
+   without parsing */
 void md_read_from_file (module_t * head, file_t file, bool extra_info);
 /* print the addresses according to the protocol */
 void md_print_to_file (module_t * head, file_t file, bool extra_info);
+/* print the addresses only, in the protocol md_read_from_file parses */
+void md_print_filter_to_file (module_t * head, file_t file);
+/* versioned binary format - sorted offsets per module, with extra_info the bb records and edges;
+   sorts the lists */
+void md_print_binary_to_file (module_t * head, file_t file, bool extra_info);
+/* appends the bb records and edges counted since the last snapshot to a snapshot log, in the binary
+   format, and zeroes the counts of the list; sorts the lists. A memory writer lets the caller
+   serialize under its lock and write the log after releasing it */
+void md_print_snapshot_to_writer (module_t * head, writer_t * writer);
+/* adds up every snapshot of a snapshot log into the list; an incomplete last snapshot (the process
+   died while writing it) is skipped. Returns the number of snapshots read */
+uint md_read_snapshots_from_file (module_t * head, file_t file);
+/* true for a binary file; extra_info tells if it carries bb records and edges. Reads the header */
+bool md_file_is_binary (file_t file, bool * extra_info);
 
 /* deletes the linked list */
 void md_delete_list (module_t * head, bool extra_info);
@@ -0,0 +1,54 @@
+#ifndef _OPTIONS_EXALGO_H
+#define _OPTIONS_EXALGO_H
+
+#include "dr_api.h"
+
+/* client options -
+
+the option string is tokenized once at startup into an immutable table which lives in a single
+arena (one allocation for the group table, the value table and the token text).
+"-<name> <value> <value> ..." is a group; a token starts a new group only if it begins with '-'
+followed by a non digit, so '-' inside paths and negative numbers are values. Values can be
+quoted with "" to carry spaces. An unquoted "key=value" value with a lower case key is a named
+value and does not take a positional index. '#' starts a comment up to the end of the line (for
+config files).
+*/
+
+/* typedefs */
+typedef struct _named_option_t {
+
+	const char * key;
+	const char * value;
+
+} named_option_t;
+
+typedef struct _option_group_t {
+
+	const char * name;				/* group name without the leading '-' */
+	uint num_values;
+	const char * const * values;
+	uint num_named;
+	const named_option_t * named;
+
+} option_group_t;
+
+/* building and tearing down the option table */
+bool options_init(const char * args);
+void options_exit();
+
+/* walking the table */
+uint options_group_count();
+const option_group_t * options_get_group(uint index);
+const option_group_t * options_find_group(const char * name); /* first group with the name or NULL */
+
+/* typed getters - positional values of a group; return false if the value is missing or malformed */
+uint option_count(const option_group_t * group);
+const char * option_get_string(const option_group_t * group, uint index); /* NULL if missing */
+bool option_get_uint(const option_group_t * group, uint index, uint * value);
+bool option_get_bool(const option_group_t * group, uint index, bool * value);
+
+/* typed getters - named values of a group */
+const char * option_get_named_string(const option_group_t * group, const char * key); /* NULL if missing */
+bool option_get_named_uint(const option_group_t * group, const char * key, uint * value);
+
+#endif
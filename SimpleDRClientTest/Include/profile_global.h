@@ -2,12 +2,18 @@
 #define _BBINFO_EXALGO_H
 
 #include "dr_api.h"
+#include "options.h"
+#include "moduleinfo.h"
 
 
 /*instrumentation routines*/
 void bbinfo_init(client_id_t id, const char * name,
-				const char * arguments);
+				const option_group_t * options);
 void bbinfo_exit_event(void);
+void bbinfo_lazy_init(void);
+void bbinfo_lazy_exit(void);
+void bbinfo_snapshot(void);
+void bbinfo_get_filter(module_t ** list, uint ** mode);
 dr_emit_flags_t bbinfo_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
 				instr_t *instr_current, bool for_trace, bool translating,
 				void *user_data);
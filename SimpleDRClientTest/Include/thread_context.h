@@ -0,0 +1,33 @@
+#ifndef _THREAD_CONTEXT_EXALGO_H
+#define _THREAD_CONTEXT_EXALGO_H
+
+#include "dr_api.h"
+
+/* per thread context shared by all the passes -
+
+one cache line aligned block is allocated per thread by the framework and every pass gets a slot
+at a fixed offset in it. Passes register their slot size in their init function (before any thread
+starts) and keep the returned offset. The block is zeroed, allocated before the passes' thread init
+callbacks and freed after their thread exit callbacks.
+
+Inserted code loads the block base with a single segment relative load (thread_context_insert_load)
+and addresses any pass state as [reg + slot offset + field offset].
+*/
+
+#define THREAD_CONTEXT_ALIGNMENT	64		/* cache line */
+#define THREAD_SLOT_ALIGNMENT		16
+
+void thread_context_init();
+void thread_context_exit();
+
+/* returns the offset of the new slot in the block */
+uint thread_context_register(size_t size);
+
+/* the block of a thread and a slot in it */
+void * thread_context_get(void * drcontext);
+void * thread_context_get_slot(void * drcontext, uint offset);
+
+/* loads the base of the current thread's block into reg */
+void thread_context_insert_load(void * drcontext, instrlist_t * ilist, instr_t * where, reg_id_t reg);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "defines.h"
 #include "moduleinfo.h"
+#include "dispatch.h"
 //#include "dr_defines.h"
 
 /* these are externs which are defined in main.c and can be used in any instrumentation pass */
@@ -20,6 +21,62 @@ bool filter_module_level_from_list (module_t * head, instr_t * instr);
 bool filter_range_from_list (module_t * head, instr_t * instr); /* can be used for function calls */
 bool filter_from_list(module_t * head, instr_t * instr, uint mode); /* can be used for clients who do not need to do extra processing after filter for each differently */
 bool filter_from_module_name(module_t * head, char * name, uint mode);
+/* filtering using the block context computed by the dispatcher - avoids the module lookups. The
+   FILTER_FUNCTION and FILTER_NUDGE parts of a decision are left to the dispatcher's guard (filter_dynamic_bits) */
+bool filter_bb_from_context(module_t * head, bb_context_t * ctx, uint mode);
+bool filter_instr_from_context(module_t * head, bb_context_t * ctx, instr_t * instr, uint mode);
+/* the decision for a block only depends on the block's module and offset - it can be remembered */
+bool filter_is_static(uint mode);
+/* ACTIVE_ bits (dispatch.h) the mode checks when the block runs - 0 if it is decided when built */
+uint filter_dynamic_bits(uint mode);
+/* every instruction of a block gets the block's decision (the bb and range lists hold instruction offsets) */
+bool filter_is_block_level(uint mode);
+
+/* filter programs -
+a conjunction of filter terms given as "filter=<term>+<term>+..." in a pass group, each term
+"<name>[:<filter file>]" with name one of bb, module, range, negmodule, none (static terms - decided
+for the block when it is built; without a file they use the pass's filter file) and function,
+thread, nudge (dynamic terms - ACTIVE_ bits checked inline when the block runs), e.g.
+	filter=module:C:\filters\mods.log+range:C:\filters\funcs.log+thread
+*/
+#define MAX_FILTER_TERMS	8
+
+typedef struct _filter_term_t {
+
+	uint mode;			/* FILTER_ mode of the term */
+	module_t * head;	/* list of a static term */
+	bool owned;			/* head was loaded for the term (filter_load) rather than being the pass's */
+
+} filter_term_t;
+
+typedef struct _filter_program_t {
+
+	uint num_terms;
+	filter_term_t terms[MAX_FILTER_TERMS];
+	uint dynamic;		/* ACTIVE_ bits which all have to be set when the block runs */
+	bool instr_level;	/* a bb or range term - the instructions of a block are decided one by one */
+
+} filter_program_t;
+
+/* false (with a message) for a malformed expression; head is the pass's own filter list */
+bool filter_program_compile(filter_program_t * program, const char * expr, module_t * head);
+void filter_program_release(filter_program_t * program);
+/* the static terms for the block described by ctx */
+bool filter_program_bb(filter_program_t * program, bb_context_t * ctx);
+/* the static terms for an instruction of the block - bb and range terms use the instruction's offset */
+bool filter_program_instr(filter_program_t * program, bb_context_t * ctx, instr_t * instr);
+
+/* filter sets shared between passes - each filter file is parsed once; FILTER_NONE gives an empty set.
+   Not locked - callers hold the dispatcher's init_mutex (pass lazy init, filter program compile) */
+module_t * filter_load(const char * filename, uint mode);
+void filter_release(module_t * head);
+/* the set was read from a filter file - false for the empty set of FILTER_NONE */
+bool filter_has_file(module_t * head);
+/* converts a bb file from the text protocol to the binary format and back (see moduleinfo.h) */
+bool filter_convert(const char * in_filename, const char * out_filename);
+/* adds up the snapshots of a profile snapshot log (md_print_snapshot_to_writer) into a profile file,
+   written in the text protocol or, with binary, in the binary format */
+bool profile_merge(const char * log_filename, const char * out_filename, bool binary);
 
 /* other utility functions */
 bool get_offset_from_module(app_pc instr_addr, uint * offset);
@@ -0,0 +1,44 @@
+#ifndef _WRITER_EXALGO_H
+#define _WRITER_EXALGO_H
+
+#include "dr_api.h"
+
+/* buffered output -
+
+text is formatted straight into a large buffer which goes to the file with a single dr_write_file
+when it fills up, instead of one write per dr_fprintf. A writer belongs to one thread; it does not
+own the file, which the caller opens and closes. Output to INVALID_FILE is dropped, and after a
+failed write (disk full) the rest is dropped with one message on stderr.
+
+A memory writer has no file - its buffer grows instead, and writer_write_to_file writes it out
+later. Output built under a lock goes to the file after the lock is released.
+*/
+
+#define WRITER_DEFAULT_SIZE	(1024 * 1024)
+#define WRITER_MAX_RECORD	1024	/* longest output of a single writer_printf */
+
+typedef struct _writer_t {
+
+	file_t file;
+	char * buf;
+	size_t size;
+	size_t used;
+	bool failed;		/* a write failed - nothing more goes to the file */
+	bool in_memory;		/* writer_create_memory - the buffer grows instead of being flushed */
+
+} writer_t;
+
+/* size 0 - WRITER_DEFAULT_SIZE */
+writer_t * writer_create(file_t file, size_t size);
+/* size 0 - WRITER_DEFAULT_SIZE to start with */
+writer_t * writer_create_memory(size_t size);
+/* flushes and frees the writer; the file stays open. A memory writer drops what it holds */
+void writer_destroy(writer_t * writer);
+
+void writer_printf(writer_t * writer, const char * fmt, ...);
+void writer_write(writer_t * writer, const void * data, size_t size);
+void writer_flush(writer_t * writer);
+/* memory writer - writes what it holds to the file and empties it */
+void writer_write_to_file(writer_t * writer, file_t file);
+
+#endif
@@ -24,7 +24,7 @@ static file_t logfile;
 static char ins_pass_name[MAX_STRING_LENGTH];
 
 void cpuid_init(client_id_t id, const char * name,
-	const char * arguments){
+	const option_group_t * options){
 
 	char logfilename[MAX_STRING_LENGTH];
 
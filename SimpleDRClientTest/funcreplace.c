@@ -1,6 +1,7 @@
 #include "dr_api.h"
 #include "include/moduleinfo.h"
 #include "include/utilities.h"
+#include "include/thread_context.h"
 #include "drwrap.h"
 #include <drmgr.h>
 #include "obj/halide_funcs.h"
@@ -25,7 +26,7 @@ thread_func_t thread_exit;
 static void pre_func_cb(void * wrapcxt, OUT void ** user_data);
 
 typedef struct _client_arg_t{
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
 } client_arg_t;
 
@@ -34,9 +35,9 @@ typedef struct {
 	file_t  outfile;
 } per_thread_t;
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * head;
-static int tls_index;
+static uint tls_slot;
 
 static file_t logfile;
 static char ins_pass_name[MAX_STRING_LENGTH];
@@ -52,12 +53,14 @@ int amount_val = 0;
 
 
 
-static bool parse_commandline_args(const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
+	if (option_count(options) < 2){
+		return false;
+	}
 
-	if (dr_sscanf(args, "%s %d", &client_arg->filter_filename,
-		&client_arg->filter_mode) != 2){
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
 		return false;
 	}
 
@@ -66,40 +69,44 @@ static bool parse_commandline_args(const char * args) {
 
 
 /* callbacks for the entire process */
-void funcreplace_init(client_id_t id, const char * name, const char * arguments)
+void funcreplace_init(client_id_t id, const char * name, const option_group_t * options)
 {
 
 	char logfilename[MAX_STRING_LENGTH];
-	file_t in_file;
 
 	drmgr_init();
 	drwrap_init();
-	tls_index = drmgr_register_tls_field();
-	DR_ASSERT(parse_commandline_args(arguments) == true);
-	head = md_initialize();
-
-	if (client_arg->filter_mode != FILTER_NONE){
-		in_file = dr_open_file(client_arg->filter_filename, DR_FILE_READ);
-		md_read_from_file(head, in_file, false);
-		dr_close_file(in_file);
-	}
+	tls_slot = thread_context_register(sizeof(per_thread_t));
+	DR_ASSERT(parse_commandline_args(options) == true);
 
 	if (log_mode){
 		populate_conv_filename(logfilename, logdir, name, NULL);
 		logfile = dr_open_file(logfilename, DR_FILE_WRITE_OVERWRITE);
 	}
 	strncpy(ins_pass_name, name, MAX_STRING_LENGTH);
+
+}
+
+/* filter and the shared clean call code - at the first module load or block */
+void funcreplace_lazy_init(void)
+{
+
+	head = filter_load(client_arg.filter_filename, client_arg.filter_mode);
 	code_cache_init();
 
 }
 
-void funcreplace_exit_event(void)
+void funcreplace_lazy_exit(void)
 {
 
-	md_delete_list(head, false);
+	filter_release(head);
 	code_cache_exit();
-	dr_global_free(client_arg, sizeof(client_arg_t));
-	drmgr_unregister_tls_field(tls_index);
+
+}
+
+void funcreplace_exit_event(void)
+{
+
 	if (log_mode){
 		dr_close_file(logfile);
 	}
@@ -113,16 +120,14 @@ void funcreplace_thread_init(void *drcontext){
 	per_thread_t * data;
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
-	data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
-	drmgr_set_tls_field(drcontext, tls_index, data);
+	data = thread_context_get_slot(drcontext, tls_slot);
 
 }
 
 void
 funcreplace_thread_exit(void *drcontext){
 	per_thread_t * data;
-	data = drmgr_get_tls_field(drcontext, tls_index);
-	dr_thread_free(drcontext, data, sizeof(per_thread_t));
+	data = thread_context_get_slot(drcontext, tls_slot);
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
 }
@@ -345,18 +350,18 @@ void funcreplace_module_load(void * drcontext, module_data_t * module, bool load
 	DEBUG_PRINT("module load - %s\n", module->full_path);
 
 	if (md != NULL){
-		for (int i = 1; i <= md->bbs[0].start_addr; i++){
-			address = md->bbs[i].start_addr + module->start;
-			if (md->bbs[i].start_addr == 21420880){
+		for (i = 0; i < md_get_bb_count(md); i++){
+			address = md_get_bb_addr(md, i) + module->start;
+			if (md_get_bb_addr(md, i) == 21420880){
 				drwrap_wrap(address, pre_func_cb, NULL);
 			}
-			else if (md->bbs[i].start_addr == 9645248){
+			else if (md_get_bb_addr(md, i) == 9645248){
 				drwrap_wrap(address, pre_func_cb_3, NULL);
 			}
 			else{
 				drwrap_wrap(address, pre_func_cb_2, NULL);
 			}
-			DEBUG_PRINT("replaced - %x\n", md->bbs[i].start_addr);
+			DEBUG_PRINT("replaced - %x\n", md_get_bb_addr(md, i));
 
 			//DEBUG_PRINT("replacing function %x of %s with %x\n", address, module->full_path, pre_func_cb);
 			//drwrap_replace(address, (app_pc)clean_call_halide, true);
@@ -0,0 +1,352 @@
+#include "include/functrace.h"
+#include <string.h>
+#include <stddef.h> /* for offsetof */
+#include "dr_api.h"
+#include "drmgr.h"
+#include "drutil.h"
+#include "include/utilities.h"
+#include "include/defines.h"
+#include "include/thread_context.h"
+#include "include/module_registry.h"
+
+/* functrace - shadow call stack per thread
+
+every call pushes its target and every return pops it, so the top of the stack is the start address
+of the function the thread is executing (get_current_function_all - as an offset in its module,
+used by profile through the current function product, which the push and pop mark as changed for the dispatcher's per thread
+copy). The push and pop are inlined; the lea + jecxz trick is used for the
+bounds checks so eflags are not touched. Only a full stack leaves the inlined code (clean call to
+grow the stack). A return with an empty stack (frames entered before the client attached) is
+ignored inline. Tail calls, longjmp and exceptions are not tracked.
+
+arguments - [initial stack entries]
+*/
+
+#define DEFAULT_STACK_ENTRIES	1024
+
+/* thread private shadow stack - in the shared thread context */
+typedef struct {
+
+	app_pc * stack_ptr;			/* next free entry */
+	/* negated bounds for the lea + jecxz checks */
+	ptr_int_t stack_end;		/* -(end of the stack) */
+	ptr_int_t stack_underflow;	/* -(entry below the base) */
+	app_pc * stack_base;
+	uint capacity;				/* in entries - only grows, so it bounds the max call depth */
+	function_t current;
+	file_t logfile;
+
+} per_thread_t;
+
+typedef struct _client_arg_t{
+	uint stack_entries;
+} client_arg_t;
+
+static client_arg_t client_arg;
+static uint tls_slot;
+
+static file_t logfile;
+static char ins_pass_name[MAX_STRING_LENGTH];
+
+static bool parse_commandline_args(const option_group_t * options);
+static void set_stack(per_thread_t * data, app_pc * base, uint capacity, uint depth);
+static void clean_call_grow_stack();
+static void insert_push(void * drcontext, instrlist_t * bb, instr_t * where);
+static void insert_pop(void * drcontext, instrlist_t * bb, instr_t * where);
+
+
+static bool parse_commandline_args(const option_group_t * options) {
+
+	client_arg.stack_entries = DEFAULT_STACK_ENTRIES;
+
+	if (option_count(options) >= 1 && !option_get_uint(options, 0, &client_arg.stack_entries)){
+		return false;
+	}
+
+	return client_arg.stack_entries > 0;
+}
+
+/* callbacks for the entire process */
+void functrace_init(client_id_t id, const char * name, const option_group_t * options)
+{
+
+	char logfilename[MAX_STRING_LENGTH];
+
+	drmgr_init();
+	drutil_init();
+	tls_slot = thread_context_register(sizeof(per_thread_t));
+	DR_ASSERT(parse_commandline_args(options) == true);
+
+	if (log_mode){
+		populate_conv_filename(logfilename, logdir, name, NULL);
+		logfile = dr_open_file(logfilename, DR_FILE_WRITE_OVERWRITE);
+	}
+	strncpy(ins_pass_name, name, MAX_STRING_LENGTH);
+
+}
+
+void functrace_exit_event(void)
+{
+
+	if (log_mode){
+		dr_close_file(logfile);
+	}
+	drutil_exit();
+	drmgr_exit();
+
+}
+
+/* callbacks for threads */
+void functrace_thread_init(void *drcontext){
+
+	per_thread_t * data;
+
+	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
+
+	data = thread_context_get_slot(drcontext, tls_slot);
+	set_stack(data, (app_pc *)dr_thread_alloc(drcontext, client_arg.stack_entries * sizeof(app_pc)),
+		client_arg.stack_entries, 0);
+
+}
+
+void functrace_thread_exit(void *drcontext){
+
+	per_thread_t * data;
+
+	data = thread_context_get_slot(drcontext, tls_slot);
+	LOG_PRINT(logfile, "thread %d - call depth %u - stack entries %u\n", dr_get_thread_id(drcontext),
+		(uint)(data->stack_ptr - data->stack_base), data->capacity);
+	dr_thread_free(drcontext, data->stack_base, data->capacity * sizeof(app_pc));
+
+	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
+
+}
+
+/* current function of the thread */
+uint get_current_function_all(void * drcontext){
+
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
+	loaded_module_t module;
+
+	if (data->stack_ptr == data->stack_base){
+		return 0;
+	}
+
+	/* the stack keeps full addresses - only the product is narrowed, to an offset like the bb records */
+	if (!module_registry_lookup(data->stack_ptr[-1], &module)){
+		return 0;
+	}
+
+	return (uint)(data->stack_ptr[-1] - module.start);
+
+}
+
+/* same with the recursion information - walks the stack */
+function_t * get_current_function(void * drcontext){
+
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
+	app_pc * entry;
+
+	data->current.start_addr = get_current_function_all(drcontext);
+	data->current.end_addr = 0;		/* not known from the calls */
+	data->current.is_recursive = false;
+
+	for (entry = data->stack_base; entry < data->stack_ptr - 1; entry++){
+		if (*entry == data->stack_ptr[-1]){
+			data->current.is_recursive = true;
+			break;
+		}
+	}
+
+	return &data->current;
+
+}
+
+/* callbacks for basic blocks */
+dr_emit_flags_t
+functrace_bb_app2app(void *drcontext, void *tag, instrlist_t *bb,
+bool for_trace, bool translating){
+
+	return DR_EMIT_DEFAULT;
+
+}
+
+dr_emit_flags_t
+functrace_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
+bool for_trace, bool translating,
+OUT void **user_data){
+
+	return DR_EMIT_DEFAULT;
+
+}
+
+/* calls and returns end the block, so this is done at most once per block */
+dr_emit_flags_t
+functrace_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
+instr_t *instr, bool for_trace, bool translating,
+void *user_data)
+{
+
+	if (!instr_ok_to_mangle(instr)){
+		return DR_EMIT_DEFAULT;
+	}
+
+	if (instr_is_call_direct(instr) || instr_is_call_indirect(instr)){
+		insert_push(drcontext, bb, instr);
+	}
+	else if (instr_is_return(instr)){
+		insert_pop(drcontext, bb, instr);
+	}
+
+	return DR_EMIT_DEFAULT;
+
+}
+
+/* helpers */
+
+static void set_stack(per_thread_t * data, app_pc * base, uint capacity, uint depth){
+
+	data->stack_base = base;
+	data->capacity = capacity;
+	data->stack_ptr = base + depth;
+	data->stack_end = -(ptr_int_t)(base + capacity);
+	data->stack_underflow = -(ptr_int_t)(base - 1);
+
+}
+
+/* slow path - the push filled the stack; double it */
+static void clean_call_grow_stack(){
+
+	void * drcontext = dr_get_current_drcontext();
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
+	app_pc * stack;
+
+	stack = (app_pc *)dr_thread_alloc(drcontext, 2 * data->capacity * sizeof(app_pc));
+	memcpy(stack, data->stack_base, data->capacity * sizeof(app_pc));
+	dr_thread_free(drcontext, data->stack_base, data->capacity * sizeof(app_pc));
+	set_stack(data, stack, 2 * data->capacity, data->capacity);
+
+	DEBUG_PRINT("%s - thread %d call stack grown to %u entries\n", ins_pass_name, dr_get_thread_id(drcontext), data->capacity);
+
+}
+
+/*
+	*stack_ptr++ = call target
+	if (stack_ptr == stack_end)
+		grow the stack
+*/
+static void insert_push(void * drcontext, instrlist_t * bb, instr_t * where){
+
+	reg_id_t reg1 = DR_REG_XBX;
+	reg_id_t reg2 = DR_REG_XCX; /* reg2 must be ECX or RCX for jecxz */
+	opnd_t target = instr_get_target(where);
+	instr_t * grow;
+	instr_t * done;
+	instr_t * first;
+	instr_t * second;
+
+	dr_save_reg(drcontext, bb, where, reg1, SPILL_SLOT_2);
+	dr_save_reg(drcontext, bb, where, reg2, SPILL_SLOT_3);
+
+	/* call target into reg1 - computed before the registers are changed */
+	if (opnd_is_pc(target)){
+		instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)opnd_get_pc(target), opnd_create_reg(reg1),
+			bb, where, &first, &second);
+		instr_set_ok_to_mangle(first, false/*meta*/);
+		if (second != NULL)
+			instr_set_ok_to_mangle(second, false/*meta*/);
+	}
+	else if (opnd_is_reg(target)){
+		instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg1), target));
+	}
+	else{
+		DR_ASSERT(opnd_is_memory_reference(target));
+		drutil_insert_get_mem_addr(drcontext, bb, where, target, reg1, reg2);
+		instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg1),
+			OPND_CREATE_MEMPTR(reg1, 0)));
+	}
+
+	/* *stack_ptr = target; stack_ptr++ */
+	thread_context_insert_load(drcontext, bb, where, reg2);
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg2),
+		OPND_CREATE_MEMPTR(reg2, tls_slot + offsetof(per_thread_t, stack_ptr))));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEMPTR(reg2, 0),
+		opnd_create_reg(reg1)));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(reg2),
+		opnd_create_base_disp(reg2, DR_REG_NULL, 0, sizeof(app_pc), OPSZ_lea)));
+	thread_context_insert_load(drcontext, bb, where, reg1);
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_ptr)), opnd_create_reg(reg2)));
+	dispatch_insert_product_changed(drcontext, bb, where, reg1, PRODUCT_CURRENT_FUNCTION);
+
+	/* lea [stack_ptr - stack_end] => reg2 */
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg1),
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_end))));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(reg2),
+		opnd_create_base_disp(reg1, reg2, 1, 0, OPSZ_lea)));
+
+	/* jecxz grow; jmp done */
+	grow = INSTR_CREATE_label(drcontext);
+	done = INSTR_CREATE_label(drcontext);
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_jecxz(drcontext, opnd_create_instr(grow)));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(done)));
+
+	instrlist_meta_preinsert(bb, where, grow);
+	dr_insert_clean_call(drcontext, bb, where, (void *)clean_call_grow_stack, false, 0);
+	instrlist_meta_preinsert(bb, where, done);
+
+	dr_restore_reg(drcontext, bb, where, reg1, SPILL_SLOT_2);
+	dr_restore_reg(drcontext, bb, where, reg2, SPILL_SLOT_3);
+
+}
+
+/*
+	stack_ptr--
+	if (stack_ptr == stack_base - 1)
+		stack_ptr = stack_base
+*/
+static void insert_pop(void * drcontext, instrlist_t * bb, instr_t * where){
+
+	reg_id_t reg1 = DR_REG_XBX;
+	reg_id_t reg2 = DR_REG_XCX; /* reg2 must be ECX or RCX for jecxz */
+	instr_t * underflow;
+	instr_t * done;
+
+	dr_save_reg(drcontext, bb, where, reg1, SPILL_SLOT_2);
+	dr_save_reg(drcontext, bb, where, reg2, SPILL_SLOT_3);
+
+	/* stack_ptr-- */
+	thread_context_insert_load(drcontext, bb, where, reg1);
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg2),
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_ptr))));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(reg2),
+		opnd_create_base_disp(reg2, DR_REG_NULL, 0, -(int)sizeof(app_pc), OPSZ_lea)));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_ptr)), opnd_create_reg(reg2)));
+	dispatch_insert_product_changed(drcontext, bb, where, reg1, PRODUCT_CURRENT_FUNCTION);
+
+	/* lea [stack_ptr - (stack_base - 1)] => reg2 */
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg1),
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_underflow))));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(reg2),
+		opnd_create_base_disp(reg1, reg2, 1, 0, OPSZ_lea)));
+
+	/* jecxz underflow; jmp done */
+	underflow = INSTR_CREATE_label(drcontext);
+	done = INSTR_CREATE_label(drcontext);
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_jecxz(drcontext, opnd_create_instr(underflow)));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(done)));
+
+	/* empty stack - put stack_ptr back to the base */
+	instrlist_meta_preinsert(bb, where, underflow);
+	thread_context_insert_load(drcontext, bb, where, reg1);
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg2),
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_base))));
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+		OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, stack_ptr)), opnd_create_reg(reg2)));
+	instrlist_meta_preinsert(bb, where, done);
+
+	dr_restore_reg(drcontext, bb, where, reg1, SPILL_SLOT_2);
+	dr_restore_reg(drcontext, bb, where, reg2, SPILL_SLOT_3);
+
+}
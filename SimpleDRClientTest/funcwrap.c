@@ -4,6 +4,8 @@
 #include "drwrap.h"
 #include "drmgr.h"
 #include "include/utilities.h"
+#include "include/thread_context.h"
+#include "include/atomics.h"
 
 
 /* for each client following functions may be implemented
@@ -22,7 +24,7 @@ thread_func_t thread_exit;
 */
 
 typedef struct _client_arg_t{
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 } client_arg_t;
 
 typedef struct {
@@ -31,53 +33,41 @@ typedef struct {
 	file_t logfile;
 } per_thread_t;
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * head;
-static int tls_index;
+static uint tls_slot;
 static bool file_registered = false;
-static uint wrap_thread_id = 0;
-static bool dumped = 0;
+static volatile uint wrap_thread_id = 0;	/* claimed once, by the first thread in the function */
 
 static file_t logfile;
 static char ins_pass_name[MAX_STRING_LENGTH];
 
 
-static bool parse_commandline_args(const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
-
-	if (dr_sscanf(args, "%s", &client_arg->filter_filename) != 1){
+	if (option_count(options) < 1){
 		return false;
 	}
 
+	client_arg.filter_filename = option_get_string(options, 0);
+
 	return true;
 }
 
 
 /* callbacks for the entire process */
-void funcwrap_init(client_id_t id, const char * name, const char * arguments)
+void funcwrap_init(client_id_t id, const char * name, const option_group_t * options)
 {
 
-	file_t in_file;
 	char logfilename[MAX_STRING_LENGTH];
 
 	drmgr_init();
 	drwrap_init();
-	tls_index = drmgr_register_tls_field();
+	tls_slot = thread_context_register(sizeof(per_thread_t));
 
-	DR_ASSERT(parse_commandline_args(arguments) == true);
-	head = md_initialize();
-	if (!dr_file_exists(client_arg->filter_filename)){
-		file_registered = false;
-	}
+	DR_ASSERT(parse_commandline_args(options) == true);
 	/* we expect the filter file to be of the form for function filtering */
-	else{
-		file_registered = true;
-		in_file = dr_open_file(client_arg->filter_filename, DR_FILE_READ);
-		DR_ASSERT(in_file != INVALID_FILE);
-		md_read_from_file(head, in_file, false);
-		dr_close_file(in_file);
-	}
+	file_registered = dr_file_exists(client_arg.filter_filename);
 
 	if (log_mode){
 		populate_conv_filename(logfilename, logdir, name, NULL);
@@ -88,12 +78,20 @@ void funcwrap_init(client_id_t id, const char * name, const char * arguments)
 
 }
 
+/* the function filter is read at the first module load or block */
+void funcwrap_lazy_init(void)
+{
+	head = filter_load(client_arg.filter_filename, file_registered ? FILTER_FUNCTION : FILTER_NONE);
+}
+
+void funcwrap_lazy_exit(void)
+{
+	filter_release(head);
+}
+
 void funcwrap_exit_event(void)
 {
 
-	md_delete_list(head, false);
-	dr_global_free(client_arg, sizeof(client_arg_t));
-	drmgr_unregister_tls_field(tls_index);
 	if (log_mode){
 		dr_close_file(logfile);
 	}
@@ -111,7 +109,7 @@ void funcwrap_thread_init(void *drcontext){
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
-	data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
+	data = thread_context_get_slot(drcontext, tls_slot);
 	if (log_mode){
 		dr_snprintf(thread_id, MAX_STRING_LENGTH, "%d", dr_get_thread_id(drcontext));
 		populate_conv_filename(logfilename, logdir, ins_pass_name, thread_id);
@@ -122,7 +120,8 @@ void funcwrap_thread_init(void *drcontext){
 
 	data->filter_func = false;
 	data->nesting = 0;
-	drmgr_set_tls_field(drcontext, tls_index, data);
+	/* without a function list every function is filtered in */
+	dispatch_set_active(drcontext, ACTIVE_FUNCTION, !file_registered);
 
 	DEBUG_PRINT("%s - initializing thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
@@ -131,11 +130,10 @@ void funcwrap_thread_init(void *drcontext){
 void
 funcwrap_thread_exit(void *drcontext){
 	per_thread_t * data;
-	data = drmgr_get_tls_field(drcontext, tls_index);
+	data = thread_context_get_slot(drcontext, tls_slot);
 	if (log_mode){
 		dr_close_file(data->logfile);
 	}
-	dr_thread_free(drcontext, data, sizeof(per_thread_t));
 
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
@@ -143,7 +141,7 @@ funcwrap_thread_exit(void *drcontext){
 
 bool should_filter_func(){
 
-	per_thread_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+	per_thread_t * data = thread_context_get_slot(dr_get_current_drcontext(), tls_slot);
 
 	if (!file_registered){
 		return true;
@@ -157,94 +155,42 @@ bool should_filter_thread(uint thread_id){
 	return (wrap_thread_id == thread_id);
 }
 
-static void clean_call(uint pc){
-
-	//DEBUG_PRINT("funcwrap - entered the pre-call clean call\n");
-
-	dr_mcontext_t mc = { sizeof(mc), DR_MC_ALL };
-	dr_get_mcontext(dr_get_current_drcontext(), &mc);
-	mc.pc = pc;
-	if (dumped == 0){
-		dumped = 1;
-		dr_flush_region(0, ~((ptr_uint_t)0));
-		dr_redirect_execution(&mc);
-	}
-
-	//DEBUG_PRINT("funcwrap - entered the pre-call done\n");
-
-
-
-
+/* products for the other passes - see dispatch.h */
+uint funcwrap_function_filter(void * drcontext){
+	return should_filter_func();
 }
 
-dr_emit_flags_t
-funcwrap_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
-instr_t *instr, bool for_trace, bool translating,
-void *user_data)
-{
-
-	instr_t * first = instrlist_first(bb);
-	app_pc pc = instr_get_app_pc(first);
-	module_data_t * module_data;
-	per_thread_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
-	module_t * md;
-	app_pc offset;
-
-
-	if (instr != first || data->nesting != 0){
-		return DR_EMIT_DEFAULT;
-	}
-
-	module_data = dr_lookup_module(pc);
-	data = drmgr_get_tls_field(drcontext, tls_index);
-
-
-	if (module_data != NULL){
-		md = md_lookup_module(head, module_data->full_path);
-		if (md != NULL){
-			offset = pc - module_data->start;
-
-			for (int i = 1; i <= md->bbs[0].start_addr; i++){
-				if (offset == md->bbs[i].start_addr){
-					DEBUG_PRINT("bb instrumenting function\n");
-					data->filter_func = true;
-					dr_insert_clean_call(drcontext, bb, instr, clean_call, false, 1, OPND_CREATE_INTPTR(instr_get_app_pc(instr)));
-					wrap_thread_id = dr_get_thread_id(drcontext);
-					DEBUG_PRINT("done bb instrumenting function\n");
-
-				}
-			}
-		}
-	}
-
-
-
-	/*if (data->filter_func){
-		instrlist_disassemble(drcontext, instr_get_app_pc(instrlist_first(bb)), bb, logfile);
-	}*/
-
-	dr_free_module_data(module_data);
-
-
-	return DR_EMIT_DEFAULT;
-
+uint funcwrap_thread_filter(void * drcontext){
+	return should_filter_thread(dr_get_thread_id(drcontext));
 }
 
+/* the filtered function is tracked when it runs - the dispatcher's guards check the active bits, so
+   no block has to be rebuilt on entry or exit. The first thread to enter it is the traced thread */
 static void pre_func_cb(void * wrapcxt, OUT void ** user_data){
 	DEBUG_PRINT("funcwrap - pre_func_cb\n");
-	per_thread_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+	void * drcontext = dr_get_current_drcontext();
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
 	data->filter_func = true;
 	data->nesting++;
+	dispatch_set_active(drcontext, ACTIVE_FUNCTION, true);
+	dispatch_product_changed(drcontext, PRODUCT_FUNCTION_FILTER);
+	/* threads entering together race for the claim - only the winner's thread filter changes */
+	if (wrap_thread_id == 0 && ATOMIC_CAS32(&wrap_thread_id, 0, dr_get_thread_id(drcontext)) == 0){
+		dispatch_set_active(drcontext, ACTIVE_THREAD, true);
+		dispatch_product_changed(drcontext, PRODUCT_THREAD_FILTER);
+	}
 }
 
 static void post_func_cb(void * wrapcxt, void ** user_data){
 	DEBUG_PRINT("funcwrap - post_func_cb\n");
-	per_thread_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+	per_thread_t * data = thread_context_get_slot(dr_get_current_drcontext(), tls_slot);
 	data->nesting--;
 	//dr_unlink_flush_region(0, ~((ptr_uint_t)0));
 	DR_ASSERT(data->nesting >= 0);
 	if (data->nesting == 0){
 		data->filter_func = false;
+		dispatch_set_active(dr_get_current_drcontext(), ACTIVE_FUNCTION, false);
+		dispatch_product_changed(dr_get_current_drcontext(), PRODUCT_FUNCTION_FILTER);
 	}
 	DEBUG_PRINT("funcwrap - post_func_cb done \n");
 
@@ -260,8 +206,8 @@ void funcwrap_module_load(void * drcontext, module_data_t * module, bool loaded)
 	app_pc address;
 
 	if (md != NULL){
-		for (int i = 1; i <= md->bbs[0].start_addr; i++){
-			address = md->bbs[i].start_addr + module->start;
+		for (i = 0; i < md_get_bb_count(md); i++){
+			address = md_get_bb_addr(md, i) + module->start;
 			DEBUG_PRINT("funcwrap: %s module %x function wrapping\n", md->module, address);
 			drwrap_wrap(address, pre_func_cb, post_func_cb);
 		}
@@ -15,14 +15,14 @@
 
 #define NULL_TERMINATE(buf) buf[(sizeof(buf)/sizeof(buf[0])) - 1] = '\0'
 
-static bool parse_commandline_args (const char * args);
+static bool parse_commandline_args(const option_group_t * options);
 
 typedef struct _client_arg_t{
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
 } client_arg_t;
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * head;
 
 /* we only have a global count */
@@ -37,42 +37,30 @@ static char ins_pass_name[MAX_STRING_LENGTH];
 
 static void inscount(uint num_instrs) { global_count += num_instrs; }
 
-static bool parse_commandline_args (const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
 
-
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
-
-
-	if(dr_sscanf(args,"%s %d",&client_arg->filter_filename,
-						   &client_arg->filter_mode)!=2){
+	if (option_count(options) < 2){
 		return false;
 	}
 
-
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
+		return false;
+	}
 
 	return true;
 }
 
-void inscount_init(client_id_t id, const char * name,  const char * arguments)
+void inscount_init(client_id_t id, const char * name,  const option_group_t * options)
 {
 
-	file_t in_file;
 	char logfilename[MAX_STRING_LENGTH];
 
 	drmgr_init();
 
 	global_count = 0;
 
-	DR_ASSERT(parse_commandline_args(arguments) == true);
-	head = md_initialize();
-
-
-	if(client_arg->filter_mode != FILTER_NONE){
-		in_file = dr_open_file(client_arg->filter_filename,DR_FILE_READ);
-		DR_ASSERT(in_file != INVALID_FILE);
-		md_read_from_file(head,in_file,false);
-		dr_close_file(in_file);
-	}
+	DR_ASSERT(parse_commandline_args(options) == true);
 
 	if (log_mode){
 		populate_conv_filename(logfilename, logdir, name, NULL);
@@ -84,6 +72,25 @@ void inscount_init(client_id_t id, const char * name,  const char * arguments)
 
 }
 
+/* filter used by the pass - the dispatcher changes the mode on nudges */
+void inscount_get_filter(module_t ** list, uint ** mode){
+
+	*list = head;
+	*mode = &client_arg.filter_mode;
+
+}
+
+/* the filter is read when the first block is seen */
+void inscount_lazy_init(void)
+{
+	head = filter_load(client_arg.filter_filename, client_arg.filter_mode);
+}
+
+void inscount_lazy_exit(void)
+{
+	filter_release(head);
+}
+
 void inscount_exit_event(void)
 {
 #ifdef SHOW_RESULTS
@@ -97,9 +104,6 @@ void inscount_exit_event(void)
 	DISPLAY_STRING(msg);
 #endif /* SHOW_RESULTS */
 
-	md_delete_list(head,false);
-	dr_global_free(client_arg, sizeof(client_arg_t));
-
 	if (log_mode){
 		dr_close_file(logfile);
 	}
@@ -123,22 +127,20 @@ inscount_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
 				void *user_data)
 {
 
-	instr_t *first = instrlist_first(bb);
+	bb_context_t * ctx = (bb_context_t *)user_data;
 	uint num_instrs = 0;
 
-	if(instr != first)
+	if(instr != ctx->first)
 		return DR_EMIT_DEFAULT;
 
-	if(filter_from_list(head,instr,client_arg->filter_mode)){
-		for(instr = first ; instr!=NULL ; instr = instr_get_next(instr)){
-			num_instrs++;
-		}
+	if(ctx->filtered){
+		num_instrs = ctx->num_instrs;
 		bbcount++;
 	}
 
 
 	if(num_instrs > 0){
-		dr_insert_clean_call(drcontext, bb, instrlist_first(bb),
+		dr_insert_clean_call(drcontext, bb, ctx->first,
 							(void *)inscount, false /* save fpstate */, 1,
 							OPND_CREATE_INT32(num_instrs));
 	}
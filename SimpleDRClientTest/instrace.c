@@ -5,9 +5,10 @@
 #include "drmgr.h"
 #include "drutil.h"
 #include "include/utilities.h"
+#include "include/module_registry.h"
 #include "include/debug.h"
 #include "include/output.h"
-#include "include/funcwrap.h"
+#include "include/thread_context.h"
 
 /****************************defines*********************************/
 
@@ -95,12 +96,12 @@ typedef struct {
 /* client arguments processing */
 typedef struct _client_arg_t {
 
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
-	char output_folder[MAX_STRING_LENGTH];
+	const char * output_folder;
 	uint static_info_size;
 	uint instrace_mode;
-	char extra_info[MAX_STRING_LENGTH];
+	const char * extra_info;
 
 } client_arg_t;
 
@@ -110,9 +111,9 @@ static client_id_t client_id;
 static app_pc code_cache;
 static void  *mutex;    /* for multithread support */
 static uint64 num_refs; /* total number of dynamic instructions */
-static int tls_index;
+static uint tls_slot;
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * head;
 static bool opcodes_visited[OPCODE_COUNT];
 static file_t logfile;
@@ -125,12 +126,12 @@ static module_t * instrace_head;
 /* instrumentation functions */
 static instr_t * static_info_instrumentation(void * drcontext, instr_t* instr);
 static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, instr_t *where,
-	instr_t * static_info);
+	instr_t * static_info, bb_context_t * ctx);
 static void code_cache_init(void);
 static void code_cache_exit(void);
 
 /* utility functions */
-static bool parse_commandline_args(const char * args);
+static bool parse_commandline_args(const option_group_t * options);
 
 /* clean calls */
 //needed instrumentation
@@ -151,26 +152,31 @@ void operand_trace(instr_t * instr, void * drcontext);
 
 /****************** main instrumentation functions ******************/
 
-static bool parse_commandline_args (const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
-	if(dr_sscanf(args,"%s %d %s %d %d %s",
-									   &client_arg->filter_filename,
-									   &client_arg->filter_mode,
-									   &client_arg->output_folder,
-									   &client_arg->static_info_size,
-									   &client_arg->instrace_mode,
-									   &client_arg->extra_info)!=6){
+	if (option_count(options) < 6){
+		return false;
+	}
+
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
+		return false;
+	}
+	client_arg.output_folder = option_get_string(options, 2);
+	if (!option_get_uint(options, 3, &client_arg.static_info_size)){
+		return false;
+	}
+	if (!option_get_uint(options, 4, &client_arg.instrace_mode)){
 		return false;
 	}
+	client_arg.extra_info = option_get_string(options, 5);
 
 	return true;
 }
 
-void instrace_init(client_id_t id, const char * name, const char * arguments)
+void instrace_init(client_id_t id, const char * name, const option_group_t * options)
 {
 
-	file_t in_file;
 	file_t out_file;
 	int i;
 	char logfilename[MAX_STRING_LENGTH];
@@ -179,23 +185,12 @@ void instrace_init(client_id_t id, const char * name, const char * arguments)
 	drutil_init();
 	client_id = id;
 
-	DR_ASSERT(parse_commandline_args(arguments)==true);
+	DR_ASSERT(parse_commandline_args(options)==true);
 
-	head = md_initialize();
 	instrace_head = md_initialize();
 
-	if(client_arg->filter_mode != FILTER_NONE){
-		in_file = dr_open_file(client_arg->filter_filename,DR_FILE_READ);
-		dr_printf("%s\n", client_arg->filter_filename);
-		DR_ASSERT(in_file != INVALID_FILE);
-		md_read_from_file(head,in_file,false);
-		dr_close_file(in_file);
-	}
-
 	mutex = dr_mutex_create();
-	tls_index = drmgr_register_tls_field();
-	DR_ASSERT(tls_index != -1);
-	code_cache_init();
+	tls_slot = thread_context_register(sizeof(per_thread_t));
 
 	if (log_mode){
 		populate_conv_filename(logfilename, logdir, name, NULL);
@@ -210,6 +205,31 @@ void instrace_init(client_id_t id, const char * name, const char * arguments)
 
 
 
+}
+
+/* filter used by the pass - the dispatcher changes the mode on nudges */
+void instrace_get_filter(module_t ** list, uint ** mode){
+
+	*list = head;
+	*mode = &client_arg.filter_mode;
+
+}
+
+/* filter and the shared clean call code - set up when the first block is seen */
+void instrace_lazy_init(void)
+{
+
+	head = filter_load(client_arg.filter_filename, client_arg.filter_mode);
+	code_cache_init();
+
+}
+
+void instrace_lazy_exit(void)
+{
+
+	filter_release(head);
+	code_cache_exit();
+
 }
 
 void instrace_exit_event()
@@ -219,7 +239,7 @@ void instrace_exit_event()
 
 	DEBUG_PRINT("%s - total amount of instructions - %d\n",ins_pass_name, num_refs);
 
-	if (client_arg->instrace_mode == OPCODE_TRACE){
+	if (client_arg.instrace_mode == OPCODE_TRACE){
 		dr_printf("opcodes that were covered in this part of the code - \n");
 		for (i = OP_FIRST; i <= OP_LAST; i++){
 			if (opcodes_visited[i]){
@@ -229,11 +249,7 @@ void instrace_exit_event()
 		dr_printf("\n");
 	}
 
-	md_delete_list(head, false);
 	md_delete_list(instrace_head, false);
-	dr_global_free(client_arg,sizeof(client_arg_t));
-	code_cache_exit();
-	drmgr_unregister_tls_field(tls_index);
 	dr_mutex_destroy(mutex);
 	if (log_mode){
 		dr_close_file(logfile);
@@ -259,9 +275,8 @@ void instrace_thread_init(void *drcontext)
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
-	/* allocate thread private data */
-	data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
-	drmgr_set_tls_field(drcontext, tls_index, data);
+	/* thread private data lives in the shared thread context */
+	data = thread_context_get_slot(drcontext, tls_slot);
 	data->buf_base = dr_thread_alloc(drcontext, INSTR_BUF_SIZE);
 	data->buf_ptr  = data->buf_base;
 	/* set buf_end to be negative of address of buffer end for the lea later */
@@ -280,16 +295,16 @@ void instrace_thread_init(void *drcontext)
 	}
 
 	/* instrace types */
-	if (client_arg->instrace_mode == OPERAND_TRACE){
+	if (client_arg.instrace_mode == OPERAND_TRACE){
 		mode = "opnd";
 	}
-	else if (client_arg->instrace_mode == OPCODE_TRACE){
+	else if (client_arg.instrace_mode == OPCODE_TRACE){
 		mode = "opcode";
 	}
-	else if (client_arg->instrace_mode == DISASSEMBLY_TRACE){
+	else if (client_arg.instrace_mode == DISASSEMBLY_TRACE){
 		mode = "disasm";
 	}
-	else if (client_arg->instrace_mode == INS_DISASM_TRACE){
+	else if (client_arg.instrace_mode == INS_DISASM_TRACE){
 		mode = "asm_instr";
 	}
 	else{
@@ -298,16 +313,16 @@ void instrace_thread_init(void *drcontext)
 
 
 
-	dr_snprintf(extra_info, MAX_STRING_LENGTH, "%s_%s_%s", client_arg->extra_info, mode, thread_id);
+	dr_snprintf(extra_info, MAX_STRING_LENGTH, "%s_%s_%s", client_arg.extra_info, mode, thread_id);
 
-	populate_conv_filename(outfilename, client_arg->output_folder, ins_pass_name, extra_info);
+	populate_conv_filename(outfilename, client_arg.output_folder, ins_pass_name, extra_info);
 	data->outfile = dr_open_file(outfilename, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
 	DR_ASSERT(data->outfile != INVALID_FILE);
 
 	DEBUG_PRINT("%s - thread id : %d, new thread logging at - %s\n",ins_pass_name, dr_get_thread_id(drcontext),logfilename);
 
-	data->static_array = (instr_t **)dr_thread_alloc(drcontext,sizeof(instr_t *)*client_arg->static_info_size);
-	data->static_array_size = client_arg->static_info_size;
+	data->static_array = (instr_t **)dr_thread_alloc(drcontext,sizeof(instr_t *)*client_arg.static_info_size);
+	data->static_array_size = client_arg.static_info_size;
 	data->static_ptr = 0;
 
 	data->output_array = (output_t *)dr_thread_alloc(drcontext,OUTPUT_BUF_SIZE);
@@ -338,11 +353,11 @@ instrace_thread_exit(void *drcontext)
 	per_thread_t *data;
 	int i;
 
-	if (client_arg->instrace_mode == INS_TRACE){
+	if (client_arg.instrace_mode == INS_TRACE){
 		ins_trace(drcontext);
 	}
 
-	data = drmgr_get_tls_field(drcontext, tls_index);
+	data = thread_context_get_slot(drcontext, tls_slot);
 	dr_mutex_lock(mutex);
 	num_refs += data->num_refs;
 	dr_mutex_unlock(mutex);
@@ -361,8 +376,7 @@ instrace_thread_exit(void *drcontext)
 		instr_destroy(dr_get_current_drcontext(),data->static_array[i]);
 	}
 
-	dr_thread_free(drcontext, data->static_array, sizeof(instr_t *)*client_arg->static_info_size);
-	dr_thread_free(drcontext, data, sizeof(per_thread_t));
+	dr_thread_free(drcontext, data->static_array, sizeof(instr_t *)*client_arg.static_info_size);
 
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
@@ -403,20 +417,33 @@ instrace_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
 	  2. call the static info filler function to get a slot at the global instruction array
 	  3. send the data appropriately to instrumentation function
 	*/
+	bb_context_t * ctx = (bb_context_t *)user_data;
 	instr_t * instr_info;
-	module_data_t * md;
 	uint offset = 0;
 	per_thread_t * data;
+	bool filtered;
 
 
-	/* these are for the use of the caller - instrlist_first(bb) */
-	if(filter_from_list(head,instr,client_arg->filter_mode) && should_filter_thread(dr_get_thread_id(drcontext))){
+	/* the dispatcher decided for the whole block unless the list holds instruction offsets; a filter
+	   program also covers the thread, through the dispatcher's guard, and its bb and range terms are
+	   decided per instruction as in the plain modes */
+	if (ctx->program != NULL){
+		filtered = ctx->program->instr_level ? filter_program_instr(ctx->program, ctx, instr) : ctx->filtered;
+	}
+	else if (filter_is_block_level(ctx->filter_mode)){
+		filtered = ctx->filtered && dispatch_product(drcontext, PRODUCT_THREAD_FILTER);
+	}
+	else{
+		filtered = filter_instr_from_context(head, ctx, instr, ctx->filter_mode) && dispatch_product(drcontext, PRODUCT_THREAD_FILTER);
+	}
+
+	if(filtered){
 			//dr_printf("entering static instrumentation\n");
 			instr_info = static_info_instrumentation(drcontext, instr);
 			if(instr_info != NULL){
 				//can only be entered in the DISASSEMBLY_TRACE or INS_TRACE
-				DR_ASSERT(client_arg->instrace_mode == INS_TRACE || client_arg->instrace_mode == DISASSEMBLY_TRACE);
-				dynamic_info_instrumentation(drcontext, bb, instr, instr_info);
+				DR_ASSERT(client_arg.instrace_mode == INS_TRACE || client_arg.instrace_mode == DISASSEMBLY_TRACE);
+				dynamic_info_instrumentation(drcontext, bb, instr, instr_info, ctx);
 			}
 			//instrlist_disassemble(drcontext, tag, bb, logfile);
 	}
@@ -440,7 +467,7 @@ static instr_t * static_info_instrumentation(void * drcontext, instr_t* instr){
 	*/
 
 	/* main variables */
-	per_thread_t * data = drmgr_get_tls_field(drcontext,tls_index);
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
 
 	/* helper variables */
 	int opcode;
@@ -453,12 +480,12 @@ static instr_t * static_info_instrumentation(void * drcontext, instr_t* instr){
 
 	opcode = instr_get_opcode(instr);
 
-	if (client_arg->instrace_mode == OPCODE_TRACE){
+	if (client_arg.instrace_mode == OPCODE_TRACE){
 		opcodes_visited[opcode] = true;
 		return NULL;
 	}
 
-	if ( (client_arg->instrace_mode == OPERAND_TRACE) || (client_arg->instrace_mode == INS_DISASM_TRACE) ){
+	if ( (client_arg.instrace_mode == OPERAND_TRACE) || (client_arg.instrace_mode == INS_DISASM_TRACE) ){
 		operand_trace(instr, drcontext);
 		return NULL;
 	}
@@ -481,7 +508,7 @@ static instr_t * static_info_instrumentation(void * drcontext, instr_t* instr){
 /* dynamic information generation */
 
 static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, instr_t *where,
-			   instr_t * static_info)
+			   instr_t * static_info, bb_context_t * ctx)
 {
 
 
@@ -514,15 +541,14 @@ static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, in
 	per_thread_t *data;
 	uint pc;
 	uint i;
+	loaded_module_t module;
 
-	module_data_t * module_data;
-
-	if (client_arg->instrace_mode == DISASSEMBLY_TRACE){
+	if (client_arg.instrace_mode == DISASSEMBLY_TRACE){
 		dr_insert_clean_call(drcontext, ilist, where, clean_call_disassembly_trace, false, 0);
 		return;
 	}
 
-	data = drmgr_get_tls_field(drcontext, tls_index);
+	data = thread_context_get_slot(drcontext, tls_slot);
 
 	/* Steal the register for memory reference address *
 	 * We can optimize away the unnecessary register save and restore
@@ -534,11 +560,11 @@ static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, in
 	dr_save_reg(drcontext, ilist, where, reg3, SPILL_SLOT_4);
 
 
-	drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
+	thread_context_insert_load(drcontext, ilist, where, reg2);
 
 	/* Load data->buf_ptr into reg2 */
 	opnd1 = opnd_create_reg(reg2);
-	opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
+	opnd2 = OPND_CREATE_MEMPTR(reg2, tls_slot + offsetof(per_thread_t, buf_ptr));
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
@@ -618,10 +644,10 @@ static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, in
 
 
 
-	drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
+	thread_context_insert_load(drcontext, ilist, where, reg2);
 	/* Load data->buf_ptr into reg2 */
 	opnd1 = opnd_create_reg(reg2);
-	opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
+	opnd2 = OPND_CREATE_MEMPTR(reg2, tls_slot + offsetof(per_thread_t, buf_ptr));
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
@@ -637,12 +663,14 @@ static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, in
 
 	/* load the app_pc */
 	opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(instr_trace_t, pc));
-	module_data = dr_lookup_module(instr_get_app_pc(where));
 
 	//dynamically generated code - module information not available - then just store 0 at the pc slot of the instr_trace data
-	if (module_data != NULL){
-		pc = instr_get_app_pc(where) - module_data->start;
-		dr_free_module_data(module_data);
+	/* trace blocks may run past the module of their first instruction */
+	if (instr_get_app_pc(where) >= ctx->module_start && instr_get_app_pc(where) < ctx->module_end){
+		pc = instr_get_app_pc(where) - ctx->module_start;
+	}
+	else if (module_registry_lookup(instr_get_app_pc(where), &module)){
+		pc = instr_get_app_pc(where) - module.start;
 	}
 	else{
 		pc = 0;
@@ -662,8 +690,8 @@ static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, in
 	instrlist_meta_preinsert(ilist, where, instr);
 
 	/* Update the data->buf_ptr */
-	drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
-	opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_ptr));
+	thread_context_insert_load(drcontext, ilist, where, reg1);
+	opnd1 = OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, buf_ptr));
 	opnd2 = opnd_create_reg(reg2);
 	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
@@ -674,7 +702,7 @@ static void dynamic_info_instrumentation(void *drcontext, instrlist_t *ilist, in
 	 */
 	/* lea [reg2 - buf_end] => reg2 */
 	opnd1 = opnd_create_reg(reg1);
-	opnd2 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_end));
+	opnd2 = OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, buf_end));
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 	opnd1 = opnd_create_reg(reg2);
@@ -741,15 +769,16 @@ static void operand_trace(instr_t * instr, void * drcontext){
 	int i;
 	char stringop[MAX_STRING_LENGTH];
 	int pc = 0;
-	per_thread_t * data = drmgr_get_tls_field(drcontext, tls_index);
-	module_data_t * module_data = dr_lookup_module(instr_get_app_pc(instr));
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
+	loaded_module_t module;
+	bool in_module = module_registry_lookup(instr_get_app_pc(instr), &module);
 
-	if (module_data != NULL){
-		pc = instr_get_app_pc(instr) - module_data->start;
+	if (in_module){
+		pc = instr_get_app_pc(instr) - module.start;
 	}
 	instr_disassemble_to_buffer(drcontext, instr, stringop, MAX_STRING_LENGTH);
 
-	if (client_arg->instrace_mode == OPERAND_TRACE){
+	if (client_arg.instrace_mode == OPERAND_TRACE){
 
 		dr_fprintf(data->outfile, "%s\n", stringop);
 
@@ -775,16 +804,16 @@ static void operand_trace(instr_t * instr, void * drcontext){
 			}
 		}
 
-		if (module_data != NULL){
+		if (in_module){
 			dr_fprintf(data->outfile, "app_pc-%d\n", pc);
 		}
 	}
-	else if (client_arg->instrace_mode == INS_DISASM_TRACE){
-		if (module_data != NULL){
-			if (md_get_module_position(instrace_head, module_data->full_path) == -1){
-				md_add_module(instrace_head, module_data->full_path, MAX_BBS_PER_MODULE);
+	else if (client_arg.instrace_mode == INS_DISASM_TRACE){
+		if (in_module){
+			if (md_get_module_position(instrace_head, module.name) == -1){
+				md_add_module(instrace_head, module.name, 0);
 			}
-			dr_fprintf(data->outfile, "%d,%d_%s_%s\n", md_get_module_position(instrace_head, module_data->full_path), pc, stringop, module_data->full_path);
+			dr_fprintf(data->outfile, "%d,%d_%s_%s\n", md_get_module_position(instrace_head, module.name), pc, stringop, module.name);
 		}
 		else{
 			dr_fprintf(data->outfile, "%d,%d,%s,%s\n",0, 0, stringop, "NONE");
@@ -792,8 +821,6 @@ static void operand_trace(instr_t * instr, void * drcontext){
 
 	}
 
-	dr_free_module_data(module_data);
-
 }
 
 /* this is only called when the instrace mode is disassembly trace (this happens at the analysis time)*/
@@ -801,19 +828,16 @@ static void clean_call_disassembly_trace(){
 
 	char disassembly[SHORT_STRING_LENGTH];
 
-	per_thread_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+	per_thread_t * data = thread_context_get_slot(dr_get_current_drcontext(), tls_slot);
 	instr_trace_t * trace = (instr_trace_t *)data->buf_ptr;
-	module_data_t * md;
-
-	md = dr_lookup_module(instr_get_app_pc(trace->static_info_instr));
+	loaded_module_t module;
 
 	instr_disassemble_to_buffer(dr_get_current_drcontext(), trace->static_info_instr, disassembly, SHORT_STRING_LENGTH);
 
 	dr_fprintf(data->outfile, "%s ", disassembly);
 
-	if (md != NULL){
-		dr_fprintf(data->outfile, "%x", instr_get_app_pc(trace->static_info_instr) - md->start);
-		dr_free_module_data(md);
+	if (module_registry_lookup(instr_get_app_pc(trace->static_info_instr), &module)){
+		dr_fprintf(data->outfile, "%x", instr_get_app_pc(trace->static_info_instr) - module.start);
 	}
 	dr_fprintf(data->outfile, "\n");
 }
@@ -827,7 +851,7 @@ static void clean_call_populate_mem(reg_t regvalue, uint pos, uint dest_or_src){
 	void * drcontext = dr_get_current_drcontext();
 	instr_trace_t * trace;
 
-	data = drmgr_get_tls_field(drcontext, tls_index);
+	data = thread_context_get_slot(drcontext, tls_slot);
 	trace = (instr_trace_t *)data->buf_ptr;
 	trace->mem_opnds[trace->num_mem] = regvalue;
 	trace->pos[trace->num_mem] = pos;
@@ -854,7 +878,7 @@ static void output_populator_printer(void * drcontext, opnd_t opnd, instr_t * in
 	uint width;
 	int i;
 
-	per_thread_t * data = drmgr_get_tls_field(drcontext,tls_index);
+	per_thread_t * data = thread_context_get_slot(drcontext, tls_slot);
 
 
 	if(opnd_is_reg(opnd)){
@@ -1009,7 +1033,7 @@ static void ins_trace(void *drcontext)
 	output_t * output;
 #endif
 
-	data      = drmgr_get_tls_field(drcontext, tls_index);
+	data      = thread_context_get_slot(drcontext, tls_slot);
 	instr_trace   = (instr_trace_t *)data->buf_base;
 	num_refs  = (int)((instr_trace_t *)data->buf_ptr - instr_trace);
 
@@ -32,20 +32,47 @@
 * DAMAGE.
 */
 
-/* Code Manipulation API Sample:
-* inscount.c
+/* SimpleDRClient:
+* main.c
 *
-* Reports the dynamic count of the total number of instructions executed.
-* Illustrates how to perform performant clean calls.
-* Demonstrates effect of clean call optimization and auto-inlining with
-* different -opt_cleancall values.
+* Drives the instrumentation passes (profile, memtrace, instrace, ...). Passes are
+* selected on the command line as "-<pass name> <pass arguments>" groups; only the
+* selected passes are initialized and registered with drmgr, so passes which are
+* not named cost no instrumentation and no per-thread state.
 *
-* The runtime options for this client include:
-* -only_from_app  Do not count instructions in shared libraries
+* Global options (not passes) -
+* -logdir <folder>  folder for the log files
+* -debug <0|1>      debug prints
+* -log <0|1>        per pass log files
+* -exec <name>      name of the executable being instrumented
+* -stats <0|1>      per pass instrumentation cost summary (logdir\passes_<app>_stats.log) with
+*                   the startup cost of each pass
+* -convert <in> <out>  converts a filter / profile file between the text protocol and the binary
+*                   format at startup (a text file is written as binary and the other way around);
+*                   binary files are loaded by every pass without parsing
+* -merge <log> <out> [bin]  adds up the snapshots of a profile snapshot log (profile group with
+*                   snapshot=<ms>) into a profile, written in the text protocol or with bin in the
+*                   binary format
+*
+* Passes do only the option parsing in their init; filter files, output files and tables are set
+* up by their lazy_init just before the pass first sees a block or a module load, so passes that
+* never instrument anything (short lived processes, active=0) cost nothing at startup.
+*
+* A pass group can also carry "active=0" to start the pass switched off; passes are switched on
+* and off, and their filter modes changed, with nudges (see the NUDGE_ ops in dispatch.h), e.g.
+*   drconfig -nudge notepad.exe 0 0x102    (switch on the second enabled pass)
+* Passes are numbered in the order they run, which is printed at startup. Only the code cache
+* regions the pass instruments are flushed.
+*
+* -config <file>    pipeline config file - option groups, one pass per line, e.g.
+*                     # filter files named by several passes are read once
+*                     -profile priority=100 C:\filters\bbs.log 1 C:\logs run
+*                     -memtrace C:\filters\bbs.log 1 C:\logs run
+*                   "priority=N" overrides the pass's default priority; options on the command line
+*                   are appended to the config file
 */
 //#define WINDOWS
 //#define X86_64
-//#define SHOW_RESULTS
 #include <stddef.h>
 #include <stdio.h>
 #include "dr_api.h"
@@ -66,52 +93,53 @@
 #include "include/memdump.h"
 #include "include/funcreplace.h"
 #include "include/misc.h"
+#include "include/dispatch.h"
+#include "include/utilities.h"
+#include "include/options.h"
+#include "include/thread_context.h"
+#include "include/module_registry.h"
+#include "include/atomics.h"
 //#include "dr_ir_instr.h"
 //#include "dr_ir_instr.h"
 
-#ifdef WINDOWS
-# define DISPLAY_STRING(msg) dr_messagebox(msg)
-#else
-# define DISPLAY_STRING(msg) dr_printf("%s\n", msg);
-#endif
-
-#define NULL_TERMINATE(buf) buf[(sizeof(buf)/sizeof(buf[0])) - 1] = '\0'
-
-/* Runtime option: If set, only count instructions in the application itself */
-static bool only_from_app = false;
-/* Application module */
-static app_pc exe_start;
-/* we only have a global count */
-static uint64 global_count;
-/* A simple clean call that will be automatically inlined because it has only
-* one argument and contains no calls to other functions.
-*/
-static void inscount(uint num_instrs) { global_count += num_instrs; }
 static void event_exit(void);
-static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag,
-	instrlist_t *bb,
+static dr_emit_flags_t event_bb_app2app(void *drcontext, void *tag, instrlist_t *bb,
+	bool for_trace, bool translating);
+static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
 	bool for_trace, bool translating,
 	void **user_data);
-static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag,
+static dr_emit_flags_t event_bb_insertion(void *drcontext, void *tag,
 	instrlist_t *bb, instr_t *inst,
 	bool for_trace, bool translating,
 	void *user_data);
 
 // Integrating Helium clients into the simple client
-#define ARGUMENT_LENGTH 20
+#define MAX_INS_PASSES 20 /* size of the pass table - not a limit on the options */
+#define FILTER_CACHE_BITS 8 /* per thread filter decisions remembered by tag - 1 << bits entries */
+#define GUARD_SPILL_SLOT SPILL_SLOT_MAX /* the guards' own slot - passes spill to the low slots */
+#define STATS_SPILL_SLOT (SPILL_SLOT_MAX - 1) /* keeps xax while the call counter saves the flags */
 
 typedef void(*thread_func_t) (void * drcontext);
-typedef void(*init_func_t) (client_id_t id, const char * name, const char * arguments);
+typedef void(*init_func_t) (client_id_t id, const char * name, const option_group_t * options);
 typedef void(*exit_func_t) (void);
 typedef void(*module_load_t) (void * drcontext, const module_data_t * info, bool loaded);
 typedef void(*module_unload_t) (void * drcontext, const module_data_t * info);
 
-typedef struct _cmdarguments_t {
+/* instrumentation cost of a pass; only collected when the stats option is given. Every thread
+   building blocks updates these, so they are only changed with atomic adds */
+typedef struct _pass_stats_t {
 
-	char name[MAX_STRING_LENGTH];
-	char arguments[10 * MAX_STRING_LENGTH];
+	volatile uint blocks;				/* blocks seen by the pass's analysis */
+	volatile uint64 app2app_time;		/* microseconds spent in the pass's bb callbacks */
+	volatile uint64 analysis_time;
+	volatile uint64 insertion_time;
+	volatile uint64 meta_instrs;		/* meta instructions inserted */
+	volatile uint64 calls_inserted;		/* clean calls (and call/mbr instrumentation) inserted */
+	volatile uint calls_executed;		/* runtime executions of the inserted calls - updated from the code cache */
+	uint64 init_time;			/* microseconds in the pass's init at startup */
+	uint64 lazy_init_time;		/* microseconds in the pass's lazy_init */
 
-} cmdarguments_t;
+} pass_stats_t;
 
 typedef struct _instrumentation_pass_t {
 
@@ -121,226 +149,1147 @@ typedef struct _instrumentation_pass_t {
 	drmgr_insertion_cb_t instrumentation_bb;
 	drmgr_xform_cb_t app2app_bb;
 	drmgr_priority_t priority;
+	/* run for every thread from the start, whether or not lazy_init has run (a thread may execute
+	   blocks another thread built) - they only use the per thread state and what init set up */
 	thread_func_t thread_init;
 	thread_func_t thread_exit;
 	exit_func_t process_exit;
-	module_load_t module_load;
-	module_unload_t module_unload;
-
+	exit_func_t lazy_init;			/* heavy setup - run once before the pass first sees a block or a module */
+	exit_func_t lazy_exit;			/* tears down what lazy_init built; only called if lazy_init ran */
+	module_load_t module_load;		/* called by the dispatcher while the pass is active, after lazy_init */
+	module_unload_t module_unload;	/* called by the dispatcher once lazy_init has run */
+	get_filter_func_t get_filter;	/* NULL if the pass cannot change its filter mode at runtime */
+	exit_func_t snapshot;			/* writes what the pass collected so far (NUDGE_PASS_SNAPSHOT); NULL if it cannot */
+	const char * filter_expr;		/* filter=<program> of the pass group - NULL if not given */
+	filter_program_t program;		/* compiled from filter_expr after the pass's lazy_init */
+	volatile bool use_program;		/* cleared when a nudge sets a filter mode */
+
+	uint produces;					/* PRODUCT_MASK bits - see dispatch.h */
+	uint consumes;
+	product_func_t product[NUM_PRODUCTS];	/* for the products the pass produces */
+
+	volatile bool active;			/* blocks are instrumented with the pass; changed by nudges */
+	volatile bool initialized;		/* lazy_init has run */
+	pass_stats_t stats;
 
 } instrumentation_pass_t;
 
+/* filter decisions of the passes for a block, kept across rebuilds of the block (traces,
+   translations); only decisions which depend on the block alone (filter_is_static) are kept */
+typedef struct _filter_cache_entry_t {
+
+	void * tag;
+	uint gen;					/* filter_gen the decisions were made in */
+	uint cached;				/* bit per enabled pass - the pass's decision is in filtered */
+	uint filtered;				/* bit per enabled pass - PRODUCT_BB_FILTER */
+
+} filter_cache_entry_t;
+
+/* dispatcher state for a thread - the block context being built and each pass's analysis user_data */
+typedef struct _per_thread_t {
+
+	bb_context_t bb;
+	filter_cache_entry_t * filter_cache;	/* direct mapped by tag - allocated at the thread's first block */
+	volatile uint active;				/* ACTIVE_ bits of the thread - see dispatch.h */
+	volatile uint blocked[1 << NUM_ACTIVE_BITS];	/* per mask of ACTIVE_ bits - 0 if all of them are set; read by the guards */
+	struct _per_thread_t * next_thread;	/* every thread, for setting active bits of all of them */
+	uint pass_dynamic[MAX_INS_PASSES];	/* ACTIVE_ bits the pass's code for the block is guarded with */
+	bool pass_program[MAX_INS_PASSES];	/* the pass filtered the block with its filter program */
+	void * pass_data[MAX_INS_PASSES];
+	bool pass_active[MAX_INS_PASSES];	/* active flags as seen by the block's analysis */
+	bool pass_filtered[MAX_INS_PASSES];	/* PRODUCT_BB_FILTER of each pass for the block */
+	uint pass_mode[MAX_INS_PASSES];		/* filter mode of each pass as seen by the block's analysis */
+	uint product_value[NUM_PRODUCTS];	/* the thread's products as last computed by their producers */
+	uint product_gen[NUM_PRODUCTS];		/* product_value is current while this equals product_gen; 0 - never */
+
+} per_thread_t;
+
 //allocate statically enough space
-static cmdarguments_t arguments[ARGUMENT_LENGTH];
-static instrumentation_pass_t ins_pass[ARGUMENT_LENGTH];
-static int argument_length = 0;
+static instrumentation_pass_t ins_pass[MAX_INS_PASSES];
 static int pass_length = 0;
 
+/* passes selected on the command line sorted by priority */
+static instrumentation_pass_t * enabled_pass[MAX_INS_PASSES];
+static int enabled_length = 0;
+static uint tls_slot;	/* dispatcher's slot in the thread context */
+
+/* the enabled pass providing each product and the value used when there is none */
+static instrumentation_pass_t * producer[NUM_PRODUCTS];
+static const uint product_default[NUM_PRODUCTS] = { 1, 0, 1, 1 };
+static volatile uint product_gen[NUM_PRODUCTS] = { 1, 1, 1, 1 };	/* bumped when a product changes for every thread */
+
 char logdir[MAX_STRING_LENGTH];
 bool debug_mode = false;
 bool log_mode = false;
 file_t global_logfile;
+bool nudge_instrument = false;	/* FILTER_NUDGE - toggled by nudges */
+static bool stats_mode = false;
+static client_id_t client_id;
+static void * init_mutex;		/* serializes the lazy initialization of the passes */
+static uint64 startup_time;		/* microseconds in dr_client_main */
+static volatile uint filter_gen = 1;	/* bumped when cached filter decisions may have changed */
+static per_thread_t * threads = NULL;	/* threads' dispatcher state - guarded by threads_mutex */
+static void * threads_mutex;			/* guards the list - the active words are updated without it */
 
 static char global_logfilename[MAX_STRING_LENGTH];
 static char exec[MAX_STRING_LENGTH];
 
+/* priority of the dispatcher's own callbacks; same place the passes used to take */
+static drmgr_priority_t dispatch_priority = {
+	sizeof(dispatch_priority), /* size of struct */
+	"dispatch",                /* name of our operation */
+	DRMGR_PRIORITY_NAME_DRWRAP, /* optional name of operation we should precede */
+	NULL,                      /* optional name of operation we should follow */
+	0 };
+
+/* lazily initializes the passes getting module loads and calls their module hooks */
+static drmgr_priority_t module_load_priority = {
+	sizeof(module_load_priority), /* size of struct */
+	"dispatch_module_load",       /* name of our operation */
+	NULL,                         /* optional name of operation we should precede */
+	NULL,                         /* optional name of operation we should follow */
+	-10000 };
+
+static void doCommandLineArgProcessing(client_id_t id);
+static void setupInsPasses();
+static instrumentation_pass_t * get_ins_pass(const char * name);
+static bool is_global_argument(const char * name);
+static void account_inserted_instrs(void * drcontext, instrlist_t * bb, instr_t * prev, instr_t * next,
+	instr_t * current, instrumentation_pass_t * pass, bool translating);
+static void print_pass_stats();
+static void event_nudge(void * drcontext, uint64 argument);
+static void flush_pass_regions(instrumentation_pass_t * pass, uint old_mode);
+static bool is_module_list_mode(uint mode);
+static void resolve_products();
+static int get_enabled_index(instrumentation_pass_t * pass);
+static void enable_ins_pass(client_id_t id, instrumentation_pass_t * pass, const option_group_t * options);
+static void ensure_pass_initialized(instrumentation_pass_t * pass);
+static void replay_module_loads(void * drcontext, instrumentation_pass_t * pass);
+static void event_module_load(void * drcontext, const module_data_t * info, bool loaded);
+static void event_module_unload(void * drcontext, const module_data_t * info);
+static void event_thread_init(void * drcontext);
+static void event_thread_exit(void * drcontext);
+static void insert_guard(void * drcontext, instrlist_t * bb, instr_t * from, instr_t * to, uint mask);
+
+/* the active word is set up after the thread context and before the passes' thread init */
+static drmgr_priority_t thread_priority = {
+	sizeof(thread_priority),   /* size of struct */
+	"dispatch_thread",         /* name of our operation */
+	NULL,                      /* optional name of operation we should precede */
+	NULL,                      /* optional name of operation we should follow */
+	-5000 };
+
 DR_EXPORT void
 dr_client_main(client_id_t id, int argc, const char *argv[])
 {
-	int i;
-	dr_set_client_name("DynamoRIO Sample Client 'inscount'",
+	uint i;
+	uint selected = 0;
+	const option_group_t * options;
+	instrumentation_pass_t * pass;
+	uint64 start = dr_get_microseconds();
+
+	dr_set_client_name("DynamoRIO Client 'SimpleDRClient'",
 		"http://dynamorio.org/issues");
 
-	/* Options */
-	for (i = 1/*skip client*/; i < argc; i++) {
-		if (strcmp(argv[i], "-only_from_app") == 0) {
-			only_from_app = true;
+	drmgr_init();
+	client_id = id;
+	init_mutex = dr_mutex_create();
+	threads_mutex = dr_mutex_create();
+
+	/* global options are processed here as well */
+	doCommandLineArgProcessing(id);
+	setupInsPasses();
+
+	/* per thread state of the dispatcher and of every pass lives in one block per thread; without
+	   a selected pass (e.g. only -convert) there is no per thread state at all */
+	for (i = 0; i < options_group_count(); i++){
+		if (get_ins_pass(options_get_group(i)->name) != NULL){
+			selected++;
 		}
-		else {
-			dr_fprintf(STDERR, "UNRECOGNIZED OPTION: \"%s\"\n", argv[i]);
-			DR_ASSERT_MSG(false, "invalid option");
+	}
+	if (selected > 0){
+		thread_context_init();
+		tls_slot = thread_context_register(sizeof(per_thread_t));
+	}
+	module_registry_init();
+
+	/* files are converted before any pass can load them */
+	if ((options = options_find_group("convert")) != NULL){
+		DR_ASSERT_MSG(option_count(options) >= 2, "-convert expects an input and an output file");
+		if (!filter_convert(option_get_string(options, 0), option_get_string(options, 1))){
+			DR_ASSERT_MSG(false, "bb file conversion failed");
+		}
+	}
+	if ((options = options_find_group("merge")) != NULL){
+		DR_ASSERT_MSG(option_count(options) >= 2, "-merge expects a snapshot log and an output file");
+		if (!profile_merge(option_get_string(options, 0), option_get_string(options, 1),
+			option_count(options) > 2 && strcmp(option_get_string(options, 2), "bin") == 0)){
+			DR_ASSERT_MSG(false, "snapshot merge failed");
 		}
 	}
 
+	/* only the passes named on the command line are initialized and registered */
+	for (i = 0; i < options_group_count(); i++){
+		options = options_get_group(i);
+		pass = get_ins_pass(options->name);
+		if (pass != NULL){
+			enable_ins_pass(id, pass, options);
+		}
+		else if (!is_global_argument(options->name)){
+			dr_fprintf(STDERR, "UNRECOGNIZED OPTION: \"%s\"\n", options->name);
+			DR_ASSERT_MSG(false, "invalid option");
+		}
+	}
 
-	drmgr_init();
+	resolve_products();
 
-	/* Get main module address */
-	if (only_from_app) {
-		module_data_t *exe = dr_get_main_module();
-		if (exe != NULL)
-			dr_fprintf(STDERR, "Application : \"%s\"\n", exe->names.file_name);
-			exe_start = exe->start;
-		dr_free_module_data(exe);
+	/* nudges name the passes by their position in this order */
+	for (i = 0; i < (uint)enabled_length; i++){
+		DEBUG_PRINT("pass %u - %s\n", i, enabled_pass[i]->name);
+		dr_log(NULL, LOG_ALL, 1, "SimpleDRClient: pass %u - %s\n", i, enabled_pass[i]->name);
 	}
 
-	/* register events */
+	/* register events - the passes' bb callbacks are called through a single set of callbacks */
 	dr_register_exit_event(event_exit);
-	drmgr_register_bb_instrumentation_event(event_bb_analysis,
-		event_app_instruction,
-		NULL);
+	dr_register_nudge_event(event_nudge, id);
+	if (enabled_length > 0){
+		drmgr_register_thread_init_event_ex(event_thread_init, &thread_priority);
+		drmgr_register_thread_exit_event_ex(event_thread_exit, &thread_priority);
+		drmgr_register_bb_app2app_event(event_bb_app2app, &dispatch_priority);
+		drmgr_register_bb_instrumentation_event(event_bb_analysis, event_bb_insertion, &dispatch_priority);
+		drmgr_register_module_load_event_ex(event_module_load, &module_load_priority);
+		drmgr_register_module_unload_event_ex(event_module_unload, &module_load_priority);
+	}
+
+	startup_time = dr_get_microseconds() - start;
+	DEBUG_PRINT("client startup - %llu us\n", startup_time);
 
 	/* make it easy to tell, by looking at log file, which client executed */
-	dr_log(NULL, LOG_ALL, 1, "Client 'inscount' initializing\n");
-#ifdef SHOW_RESULTS
-	/* also give notification to stderr */
-	if (dr_is_notify_on()) {
-# ifdef WINDOWS
-		/* ask for best-effort printing to cmd window.  must be called at init. */
-		dr_enable_console_printing();
-# endif
-		dr_fprintf(STDERR, "Client inscount is running\n");
+	dr_log(NULL, LOG_ALL, 1, "Client 'SimpleDRClient' initializing - %d passes enabled\n", enabled_length);
+	DEBUG_PRINT("%d instrumentation passes enabled\n", enabled_length);
+}
+
+static void
+event_exit(void)
+{
+	int i;
+
+	if (stats_mode){
+		print_pass_stats();
+	}
+
+	/* passes are torn down in the reverse order of the pass list */
+	for (i = enabled_length - 1; i >= 0; i--){
+		if (enabled_pass[i]->initialized && enabled_pass[i]->lazy_exit != NULL){
+			enabled_pass[i]->lazy_exit();
+		}
+		if (enabled_pass[i]->process_exit != NULL){
+			enabled_pass[i]->process_exit();
+		}
+		filter_program_release(&enabled_pass[i]->program);
+	}
+
+	if (enabled_length > 0){
+		drmgr_unregister_thread_init_event(event_thread_init);
+		drmgr_unregister_thread_exit_event(event_thread_exit);
+		thread_context_exit();
+	}
+	dr_mutex_destroy(threads_mutex);
+
+	module_registry_exit();
+	dr_mutex_destroy(init_mutex);
+
+	/* passes may keep pointers into the option table until their exit */
+	options_exit();
+	drmgr_exit();
+}
+
+/* one pass over the block to get what every pass needs; called once per block */
+static void populate_bb_context(void * drcontext, bb_context_t * ctx, void * tag, instrlist_t * bb){
+
+	loaded_module_t module;
+	instr_t * instr;
+
+	ctx->tag = tag;
+	ctx->first = instrlist_first_app(bb);
+	ctx->last = NULL;
+	ctx->num_instrs = 0;
+	ctx->user_data = NULL;
+
+	for (instr = ctx->first; instr != NULL; instr = instr_get_next_app(instr)){
+		ctx->last = instr;
+		ctx->num_instrs++;
+	}
+
+	ctx->start_pc = (ctx->first != NULL) ? instr_get_app_pc(ctx->first) : NULL;
+	ctx->module_start = NULL;
+	ctx->module_end = NULL;
+	ctx->module_id = 0;
+	ctx->module_name = "";
+	ctx->offset = 0;
+
+	if (ctx->start_pc == NULL){
+		return;
+	}
+
+	if (module_registry_lookup(ctx->start_pc, &module)){
+		ctx->module_start = module.start;
+		ctx->module_end = module.end;
+		ctx->module_id = module.name_id;
+		ctx->module_name = module.name;
+		ctx->offset = (uint)(ctx->start_pc - module.start);
 	}
-#endif
+
+}
+
+static dr_emit_flags_t
+event_bb_app2app(void *drcontext, void *tag, instrlist_t *bb,
+bool for_trace, bool translating){
+
+	dr_emit_flags_t flags = DR_EMIT_DEFAULT;
+	int i = 0;
+
+	uint64 start = 0;
+
+	for (i = 0; i < enabled_length; i++){
+		if (enabled_pass[i]->active && enabled_pass[i]->app2app_bb != NULL){
+			if (stats_mode) start = dr_get_microseconds();
+			flags |= enabled_pass[i]->app2app_bb(drcontext, tag, bb, for_trace, translating);
+			if (stats_mode) atomic_add64(&enabled_pass[i]->stats.app2app_time, dr_get_microseconds() - start);
+		}
+	}
+
+	return flags;
 }
 
 static dr_emit_flags_t
 event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
-bool for_trace, bool translating, void **user_data)
-{
-	instr_t *instr;
-	uint num_instrs;
-
-#ifdef VERBOSE
-	dr_printf("in dynamorio_basic_block(tag="PFX")\n", tag);
-# ifdef VERBOSE_VERBOSE
-	instrlist_disassemble(drcontext, tag, bb, STDOUT);
-# endif
-#endif
-	/* Only count in app BBs */
-	if (only_from_app) {
-		module_data_t *mod = dr_lookup_module(dr_fragment_app_pc(tag));
-		if (mod != NULL) {
-			bool from_exe = (mod->start == exe_start);
-			dr_free_module_data(mod);
-			if (!from_exe) {
-				*user_data = NULL;
-				return DR_EMIT_DEFAULT;
+bool for_trace, bool translating, void **user_data){
+
+	per_thread_t * data = (per_thread_t *)thread_context_get_slot(drcontext, tls_slot);
+	dr_emit_flags_t flags = DR_EMIT_DEFAULT;
+	int i = 0;
+	module_t * head;
+	uint * filter_mode;
+	filter_cache_entry_t * entry;
+	uint gen = filter_gen;
+	uint mode;
+	uint64 start = 0;
+
+	/* nudges publish a new filter mode before bumping filter_gen */
+	ACQUIRE_BARRIER();
+
+	populate_bb_context(drcontext, &data->bb, tag, bb);
+
+	/* threads which never build a block (most of a thread pool) do not pay for the cache */
+	if (data->filter_cache == NULL){
+		data->filter_cache = (filter_cache_entry_t *)dr_thread_alloc(drcontext,
+			sizeof(filter_cache_entry_t) << FILTER_CACHE_BITS);
+		memset(data->filter_cache, 0, sizeof(filter_cache_entry_t) << FILTER_CACHE_BITS);
+	}
+
+	entry = &data->filter_cache[((uint)(ptr_uint_t)tag * 2654435761u) >> (32 - FILTER_CACHE_BITS)];
+	if (entry->tag != tag || entry->gen != gen){
+		entry->tag = tag;
+		entry->gen = gen;
+		entry->cached = 0;
+		entry->filtered = 0;
+	}
+
+	for (i = 0; i < enabled_length; i++){
+		data->pass_data[i] = NULL;
+		/* the same decision is used for the whole block even if a nudge changes it meanwhile */
+		data->pass_active[i] = enabled_pass[i]->active;
+		if (!data->pass_active[i]){
+			continue;
+		}
+		ensure_pass_initialized(enabled_pass[i]);
+		if (stats_mode && !translating){
+			ATOMIC_INC32(&enabled_pass[i]->stats.blocks);
+		}
+		data->pass_filtered[i] = true;
+		data->pass_program[i] = enabled_pass[i]->use_program;
+		data->pass_dynamic[i] = 0;
+		data->pass_mode[i] = FILTER_NONE;
+		if ((enabled_pass[i]->consumes & PRODUCT_MASK(PRODUCT_BB_FILTER)) && enabled_pass[i]->get_filter != NULL){
+			/* the dynamic terms are left to the guard around the pass's code */
+			enabled_pass[i]->get_filter(&head, &filter_mode);
+			ACQUIRE_BARRIER();
+			mode = *filter_mode;
+			data->pass_mode[i] = mode;
+			data->pass_dynamic[i] = data->pass_program[i] ? enabled_pass[i]->program.dynamic : filter_dynamic_bits(mode);
+			if (entry->cached & (1 << i)){
+				data->pass_filtered[i] = (entry->filtered & (1 << i)) != 0;
+			}
+			else if (data->pass_program[i]){
+				data->pass_filtered[i] = filter_program_bb(&enabled_pass[i]->program, &data->bb);
+				entry->cached |= 1 << i;
+				entry->filtered |= data->pass_filtered[i] << i;
+			}
+			else{
+				data->pass_filtered[i] = filter_bb_from_context(head, &data->bb, mode);
+				if (filter_is_static(mode)){
+					entry->cached |= 1 << i;
+					entry->filtered |= data->pass_filtered[i] << i;
+				}
 			}
 		}
+		if (enabled_pass[i]->analysis_bb != NULL){
+			if (stats_mode) start = dr_get_microseconds();
+			flags |= enabled_pass[i]->analysis_bb(drcontext, tag, bb, for_trace, translating, &data->pass_data[i]);
+			if (stats_mode) atomic_add64(&enabled_pass[i]->stats.analysis_time, dr_get_microseconds() - start);
+		}
 	}
-	/* Count instructions */
-	for (instr = instrlist_first_app(bb), num_instrs = 0;
-		instr != NULL;
-		instr = instr_get_next_app(instr)) {
-		num_instrs++;
-	}
-	*user_data = (void *)(ptr_uint_t)num_instrs;
 
-#if defined(VERBOSE) && defined(VERBOSE_VERBOSE)
-	dr_printf("Finished counting for dynamorio_basic_block(tag="PFX")\n", tag);
-	instrlist_disassemble(drcontext, tag, bb, STDOUT);
-#endif
-	return DR_EMIT_DEFAULT;
+	*user_data = data;
+	return flags;
 }
 
 static dr_emit_flags_t
-event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
-bool for_trace, bool translating, void *user_data)
-{
-	uint num_instrs;
-	if (!drmgr_is_first_instr(drcontext, instr))
-		return DR_EMIT_DEFAULT;
-	/* Only insert calls for in-app BBs */
-	if (user_data == NULL)
-		return DR_EMIT_DEFAULT;
-	/* Insert clean call */
-	num_instrs = (uint)(ptr_uint_t)user_data;
-	dr_insert_clean_call(drcontext, bb, instrlist_first_app(bb),
-		(void *)inscount, false /* save fpstate */, 1,
-		OPND_CREATE_INT32(num_instrs));
-	return DR_EMIT_DEFAULT;
+event_bb_insertion(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+bool for_trace, bool translating, void *user_data){
+
+	per_thread_t * data = (per_thread_t *)user_data;
+	dr_emit_flags_t flags = DR_EMIT_DEFAULT;
+	int i = 0;
+
+	instr_t * prev;
+	instr_t * next;
+	uint64 start = 0;
+	uint guard;
+
+	for (i = 0; i < enabled_length; i++){
+		if (data->pass_active[i] && enabled_pass[i]->instrumentation_bb != NULL){
+			data->bb.user_data = data->pass_data[i];
+			data->bb.filtered = data->pass_filtered[i];
+			data->bb.program = data->pass_program[i] ? &enabled_pass[i]->program : NULL;
+			data->bb.filter_mode = data->pass_mode[i];
+			/* with bb or range terms the pass may instrument instructions of a block filtered out as a whole */
+			guard = (data->pass_filtered[i] || (data->pass_program[i] && enabled_pass[i]->program.instr_level)) ?
+				data->pass_dynamic[i] : 0;
+			if (!stats_mode && guard == 0){
+				flags |= enabled_pass[i]->instrumentation_bb(drcontext, tag, bb, instr, for_trace, translating, &data->bb);
+				continue;
+			}
+			prev = instr_get_prev(instr);
+			next = instr_get_next(instr);
+			if (stats_mode) start = dr_get_microseconds();
+			flags |= enabled_pass[i]->instrumentation_bb(drcontext, tag, bb, instr, for_trace, translating, &data->bb);
+			if (stats_mode) atomic_add64(&enabled_pass[i]->stats.insertion_time, dr_get_microseconds() - start);
+			if (guard != 0){
+				insert_guard(drcontext, bb, prev, instr, guard);
+				if (!instr_is_cti(instr)){
+					insert_guard(drcontext, bb, instr, next, guard);
+				}
+			}
+			if (stats_mode){
+				account_inserted_instrs(drcontext, bb, prev, next, instr, enabled_pass[i], translating);
+			}
+		}
+	}
+
+	return flags;
 }
 
+/* makes the code a pass inserted between from and to (both exclusive; NULL - the list ends) run only
+   while every ACTIVE_ bit of mask is set for the thread, jumping around it otherwise. The test reads
+   the thread's precomputed blocked word for the mask and branches with jecxz, so no flags are saved */
+static void insert_guard(void * drcontext, instrlist_t * bb, instr_t * from, instr_t * to, uint mask){
+
+	instr_t * first = (from != NULL) ? instr_get_next(from) : instrlist_first(bb);
+	instr_t * run;
+	instr_t * skip;
+
+	if (first == to || first == NULL){
+		return;
+	}
+
+	run = INSTR_CREATE_label(drcontext);
+	skip = INSTR_CREATE_label(drcontext);
+
+	dr_save_reg(drcontext, bb, first, DR_REG_XCX, GUARD_SPILL_SLOT);
+	thread_context_insert_load(drcontext, bb, first, DR_REG_XCX);
+	instrlist_meta_preinsert(bb, first, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(DR_REG_ECX),
+		OPND_CREATE_MEM32(DR_REG_XCX, tls_slot + offsetof(per_thread_t, blocked) + mask * sizeof(uint))));
+	instrlist_meta_preinsert(bb, first, INSTR_CREATE_jecxz(drcontext, opnd_create_instr(run)));
+	dr_restore_reg(drcontext, bb, first, DR_REG_XCX, GUARD_SPILL_SLOT);
+	instrlist_meta_preinsert(bb, first, INSTR_CREATE_jmp(drcontext, opnd_create_instr(skip)));
+	instrlist_meta_preinsert(bb, first, run);
+	dr_restore_reg(drcontext, bb, first, DR_REG_XCX, GUARD_SPILL_SLOT);
+
+	if (to != NULL){
+		instrlist_meta_preinsert(bb, to, skip);
+	}
+	else{
+		instrlist_meta_append(bb, skip);
+	}
 
-static void
-event_exit(void)
-{
-#ifdef SHOW_RESULTS
-	char msg[512];
-	int len;
-	len = dr_snprintf(msg, sizeof(msg) / sizeof(msg[0]),
-		"Instrumentation results: %llu instructions executed\n",
-		global_count);
-	DR_ASSERT(len > 0);
-	NULL_TERMINATE(msg);
-	DISPLAY_STRING(msg);
-#endif /* SHOW_RESULTS */
-	drmgr_exit();
 }
 
-void process_global_arguments(){
+/* a thread updates its own word without a lock (funcwrap does on every wrapped call) while a
+   broadcast may update it at the same time - the word is changed with a compare and swap, and
+   blocked is rewritten until it was derived from the latest word */
+static void update_active(per_thread_t * data, uint bits, bool set){
+
+	uint old, active, mask;
+
+	do {
+		old = data->active;
+		active = set ? (old | bits) : (old & ~bits);
+	} while (ATOMIC_CAS32(&data->active, old, active) != old);
+
+	do {
+		active = data->active;
+		for (mask = 0; mask < (1 << NUM_ACTIVE_BITS); mask++){
+			data->blocked[mask] = ((active & mask) != mask);
+		}
+		FULL_BARRIER();
+	} while (data->active != active);
+
+}
+
+void dispatch_set_active(void * drcontext, uint bits, bool set){
+
+	per_thread_t * data;
+
+	if (drcontext != NULL){
+		update_active((per_thread_t *)thread_context_get_slot(drcontext, tls_slot), bits, set);
+		return;
+	}
+
+	/* threads_mutex keeps the list stable while every thread is updated */
+	dr_mutex_lock(threads_mutex);
+	for (data = threads; data != NULL; data = data->next_thread){
+		update_active(data, bits, set);
+	}
+	dr_mutex_unlock(threads_mutex);
+
+}
+
+/* bits of products no enabled pass produces are always set, as their defaults are */
+static void event_thread_init(void * drcontext){
+
+	per_thread_t * data = (per_thread_t *)thread_context_get_slot(drcontext, tls_slot);
+
+	dr_mutex_lock(threads_mutex);
+	update_active(data, ((producer[PRODUCT_FUNCTION_FILTER] == NULL) ? ACTIVE_FUNCTION : 0) |
+		((producer[PRODUCT_THREAD_FILTER] == NULL) ? ACTIVE_THREAD : 0) |
+		(nudge_instrument ? ACTIVE_NUDGE : 0), true);
+	data->next_thread = threads;
+	threads = data;
+	dr_mutex_unlock(threads_mutex);
+
+}
+
+static void event_thread_exit(void * drcontext){
+
+	per_thread_t * data = (per_thread_t *)thread_context_get_slot(drcontext, tls_slot);
+	per_thread_t ** link;
+
+	dr_mutex_lock(threads_mutex);
+	for (link = &threads; *link != NULL; link = &(*link)->next_thread){
+		if (*link == data){
+			*link = data->next_thread;
+			break;
+		}
+	}
+	dr_mutex_unlock(threads_mutex);
+
+	if (data->filter_cache != NULL){
+		dr_thread_free(drcontext, data->filter_cache, sizeof(filter_cache_entry_t) << FILTER_CACHE_BITS);
+		data->filter_cache = NULL;
+	}
+
+}
+
+/* products a pass declares are handed out through dispatch_product; defaults are used for the
+   ones no enabled pass produces */
+uint dispatch_product(void * drcontext, uint product){
+
+	per_thread_t * data;
+	uint gen;
+
+	DR_ASSERT(product < NUM_PRODUCTS);
+
+	/* a producer which has not been initialized has not seen a block yet */
+	if (producer[product] == NULL || !producer[product]->active || !producer[product]->initialized){
+		return product_default[product];
+	}
+	ACQUIRE_BARRIER();
+
+	/* the generation is read first, so a change reported meanwhile makes the next call ask again */
+	data = (per_thread_t *)thread_context_get_slot(drcontext, tls_slot);
+	gen = product_gen[product];
+	if (data->product_gen[product] != gen){
+		data->product_value[product] = producer[product]->product[product](drcontext);
+		data->product_gen[product] = gen;
+	}
+
+	return data->product_value[product];
+
+}
+
+void dispatch_product_changed(void * drcontext, uint product){
+
+	DR_ASSERT(product < NUM_PRODUCTS);
+
+	if (drcontext != NULL){
+		((per_thread_t *)thread_context_get_slot(drcontext, tls_slot))->product_gen[product] = 0;
+	}
+	else if (ATOMIC_INC32(&product_gen[product]) == 0){
+		/* 0 is what a thread's never computed value carries */
+		ATOMIC_INC32(&product_gen[product]);
+	}
+
+}
+
+void dispatch_insert_product_changed(void * drcontext, instrlist_t * bb, instr_t * where, reg_id_t base, uint product){
+
+	DR_ASSERT(product < NUM_PRODUCTS);
+
+	instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+		OPND_CREATE_MEM32(base, tls_slot + offsetof(per_thread_t, product_gen) + product * sizeof(uint)),
+		OPND_CREATE_INT32(0)));
+
+}
+
+static int get_enabled_index(instrumentation_pass_t * pass){
+
+	int i;
+
+	for (i = 0; i < enabled_length; i++){
+		if (enabled_pass[i] == pass){
+			return i;
+		}
+	}
+
+	return -1;
+
+}
+
+/* picks the producer of every product and moves consumers after their producers so that the
+   producer's analysis and instrumentation of a block come first */
+static void resolve_products(){
+
+	int i, j, k;
+	uint product;
+	bool moved = true;
+	int rounds = 0;
+	instrumentation_pass_t * pass;
+
+	for (i = 0; i < enabled_length; i++){
+		for (product = 0; product < NUM_PRODUCTS; product++){
+			if ((enabled_pass[i]->produces & PRODUCT_MASK(product)) && producer[product] == NULL){
+				DR_ASSERT(enabled_pass[i]->product[product] != NULL);
+				producer[product] = enabled_pass[i];
+			}
+		}
+	}
+
+	while (moved){
+		moved = false;
+		DR_ASSERT_MSG(rounds++ <= enabled_length * NUM_PRODUCTS, "cyclic dependency between passes");
+		for (i = 0; i < enabled_length && !moved; i++){
+			for (product = 0; product < NUM_PRODUCTS && !moved; product++){
+				if (!(enabled_pass[i]->consumes & PRODUCT_MASK(product)) || producer[product] == NULL){
+					continue;
+				}
+				j = get_enabled_index(producer[product]);
+				if (j > i){
+					dr_fprintf(STDERR, "pass %s is moved after %s, which produces what it uses\n", enabled_pass[i]->name, producer[product]->name);
+					pass = enabled_pass[i];
+					for (k = i; k < j; k++){
+						enabled_pass[k] = enabled_pass[k + 1];
+					}
+					enabled_pass[j] = pass;
+					moved = true;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < enabled_length; i++){
+		for (product = 1; product < NUM_PRODUCTS; product++){
+			if ((enabled_pass[i]->consumes & PRODUCT_MASK(product)) && producer[product] == NULL){
+				DEBUG_PRINT("pass %s - no pass produces product %u, using the default\n", enabled_pass[i]->name, product);
+			}
+		}
+	}
+
+}
+
+/* gets the pass with the given name from the pass table */
+static instrumentation_pass_t * get_ins_pass(const char * name){
 
 	int i = 0;
 
-	for (i = 0; i < argument_length; i++){
-		if (strcmp(arguments[i].name, "logdir") == 0){
-			dr_printf("global logdir - %s\n", arguments[i].arguments);
-			strncpy(logdir, arguments[i].arguments, MAX_STRING_LENGTH);
+	for (i = 0; i < pass_length; i++){
+		if (strcmp(ins_pass[i].name, name) == 0){
+			return &ins_pass[i];
+		}
+	}
+
+	return NULL;
+
+}
+
+static bool is_global_argument(const char * name){
+
+	return (strcmp(name, "logdir") == 0) || (strcmp(name, "debug") == 0) ||
+		(strcmp(name, "log") == 0) || (strcmp(name, "exec") == 0) ||
+		(strcmp(name, "stats") == 0) || (strcmp(name, "config") == 0) ||
+		(strcmp(name, "convert") == 0) || (strcmp(name, "merge") == 0);
+
+}
+
+/* counts what the pass inserted around instr (between prev and next) and makes each inserted call
+   count its executions. Only instrumentation placed next to the current instruction is seen, which
+   is where all the passes insert; calls inlined by DR's clean call optimization are not counted */
+static void account_inserted_instrs(void * drcontext, instrlist_t * bb, instr_t * prev, instr_t * next,
+	instr_t * current, instrumentation_pass_t * pass, bool translating){
+
+	instr_t * instr;
+	instr_t * inc;
+	uint64 meta_instrs = 0;
+	uint64 calls_inserted = 0;
+
+	instr = (prev != NULL) ? instr_get_next(prev) : instrlist_first(bb);
+
+	for (; instr != next && instr != NULL; instr = instr_get_next(instr)){
+		if (instr == current || instr_ok_to_mangle(instr)){
+			continue;
+		}
+		meta_instrs++;
+		if (instr_is_call(instr)){
+			calls_inserted++;
+			/* not every call is preceded by a flags save (dr_insert_mbr_instrumentation, the
+			   functrace inline code) so the counter keeps the application's flags itself */
+			dr_save_arith_flags(drcontext, bb, instr, STATS_SPILL_SLOT);
+			inc = INSTR_CREATE_inc(drcontext, OPND_CREATE_ABSMEM((void *)&pass->stats.calls_executed, OPSZ_4));
+			instr_set_prefix_flag(inc, PREFIX_LOCK);
+			instrlist_meta_preinsert(bb, instr, inc);
+			dr_restore_arith_flags(drcontext, bb, instr, STATS_SPILL_SLOT);
+		}
+	}
+
+	if (!translating){
+		atomic_add64(&pass->stats.meta_instrs, meta_instrs);
+		atomic_add64(&pass->stats.calls_inserted, calls_inserted);
+	}
+
+}
+
+/* runtime control of the passes - see dispatch.h for the argument encoding */
+static void event_nudge(void * drcontext, uint64 argument){
+
+	uint op = NUDGE_GET_OP(argument);
+	uint index = NUDGE_GET_PASS(argument);
+	uint mode = NUDGE_GET_MODE(argument);
+	instrumentation_pass_t * pass = NULL;
+	module_t * head;
+	uint * filter_mode;
+	uint old_mode;
+	uint product;
+	bool has_file;
+
+	/* FILTER_NUDGE code is guarded by ACTIVE_NUDGE, so nothing has to be flushed */
+	if (op == NUDGE_INSTRUMENT_ON || op == NUDGE_INSTRUMENT_OFF){
+		nudge_instrument = (op == NUDGE_INSTRUMENT_ON);
+		dispatch_set_active(NULL, ACTIVE_NUDGE, nudge_instrument);
+		DEBUG_PRINT("nudge - instrumentation %s\n", nudge_instrument ? "on" : "off");
+		return;
+	}
+
+	if (index >= (uint)enabled_length){
+		dr_fprintf(STDERR, "nudge %llx - there is no enabled pass %u\n", argument, index);
+		return;
+	}
+	pass = enabled_pass[index];
+
+	if (op == NUDGE_PASS_DISABLE || op == NUDGE_PASS_ENABLE){
+		if (pass->active == (op == NUDGE_PASS_ENABLE)){
+			return;
+		}
+		/* the filter is needed to flush the regions the pass is about to instrument; a pass being
+		   disabled before it was initialized has no filter loaded and the whole cache is unlinked */
+		if (op == NUDGE_PASS_ENABLE){
+			ensure_pass_initialized(pass);
+		}
+		/* blocks being built read the flag without a lock */
+		RELEASE_BARRIER();
+		pass->active = (op == NUDGE_PASS_ENABLE);
+		/* after the flag is set, so a module loading meanwhile is seen twice rather than not at all */
+		if (pass->active){
+			replay_module_loads(drcontext, pass);
 		}
-		else if (strcmp(arguments[i].name, "debug") == 0){
-			dr_printf("global debug - %s\n", arguments[i].arguments);
-			debug_mode = arguments[i].arguments[0] - '0';
+		/* the threads' values of what the pass produces were taken while it was on, or are defaults */
+		for (product = 0; product < NUM_PRODUCTS; product++){
+			if (producer[product] == pass){
+				dispatch_product_changed(NULL, product);
+			}
+		}
+		DEBUG_PRINT("nudge - pass %s %s\n", pass->name, pass->active ? "on" : "off");
+		old_mode = FILTER_NONE;
+		if (pass->get_filter != NULL){
+			pass->get_filter(&head, &filter_mode);
+			old_mode = *filter_mode;
+		}
+		flush_pass_regions(pass, old_mode);
+	}
+	else if (op == NUDGE_PASS_SNAPSHOT){
+		if (pass->snapshot == NULL){
+			dr_fprintf(STDERR, "nudge %llx - pass %s does not write snapshots\n", argument, pass->name);
+			return;
+		}
+		DEBUG_PRINT("nudge - pass %s snapshot\n", pass->name);
+		pass->snapshot();
+	}
+	else if (op == NUDGE_PASS_FILTER_MODE){
+		if (pass->get_filter == NULL || mode < FILTER_BB || mode > FILTER_NUDGE){
+			dr_fprintf(STDERR, "nudge %llx - cannot change the filter of pass %s\n", argument, pass->name);
+			return;
+		}
+		/* the filter is needed to check the mode and to flush the pass's regions */
+		ensure_pass_initialized(pass);
+		pass->get_filter(&head, &filter_mode);
+		/* a pass started without a filter file has an empty list, which would filter everything out */
+		dr_mutex_lock(init_mutex);
+		has_file = filter_has_file(head);
+		dr_mutex_unlock(init_mutex);
+		if (is_module_list_mode(mode) && !has_file){
+			dr_fprintf(STDERR, "nudge %llx - pass %s has no filter file for filter mode %u\n", argument, pass->name, mode);
+			return;
 		}
-		else if (strcmp(arguments[i].name, "log") == 0){
-			dr_printf("global log - %s\n", arguments[i].arguments);
-			log_mode = arguments[i].arguments[0] - '0';
+		old_mode = *filter_mode;
+		/* the mode is published before use_program is cleared and before the cached decisions go stale */
+		*filter_mode = mode;
+		RELEASE_BARRIER();
+		/* the program's lists stay loaded - blocks being built may still use them */
+		if (pass->use_program){
+			pass->use_program = false;
+			old_mode = FILTER_NONE;
 		}
-		else if (strcmp(arguments[i].name, "exec") == 0){
-			dr_printf("exec - %s\n", arguments[i].arguments);
-			strncpy(exec, arguments[i].arguments, MAX_STRING_LENGTH);
+		ATOMIC_INC32(&filter_gen);
+		DEBUG_PRINT("nudge - pass %s filter mode %u -> %u\n", pass->name, old_mode, mode);
+		if (pass->active){
+			flush_pass_regions(pass, old_mode);
 		}
 	}
+	else{
+		dr_fprintf(STDERR, "nudge %llx - unknown operation\n", argument);
+	}
+
 }
 
-static void doCommandLineArgProcessing(client_id_t id){
+/* flushes the code the pass instruments or will instrument after a change of its state. Module
+   list modes (bb, module, range) only touch the modules in the pass's filter, so only those loaded
+   modules are flushed; anything else may have instrumented any block and the whole cache is
+   unlinked instead - the threads are not stopped and the fragments are deleted as they leave them */
+static bool is_module_list_mode(uint mode){
+	return (mode == FILTER_BB) || (mode == FILTER_MODULE) || (mode == FILTER_RANGE);
+}
 
-	const char * args = dr_get_options(id);
+static void flush_pass_regions(instrumentation_pass_t * pass, uint old_mode){
+
+	module_t * head = NULL;
+	uint * filter_mode = NULL;
+	dr_module_iterator_t * iter;
+	module_data_t * module_data;
+
+	if (pass->get_filter != NULL){
+		pass->get_filter(&head, &filter_mode);
+	}
+
+	if (head == NULL || !is_module_list_mode(old_mode) || !is_module_list_mode(*filter_mode)){
+		dr_unlink_flush_region(0, ~((size_t)0));
+		return;
+	}
+
+	iter = dr_module_iterator_start();
+	while (dr_module_iterator_hasnext(iter)){
+		module_data = dr_module_iterator_next(iter);
+		if (md_lookup_module(head, module_data->full_path) != NULL){
+			DEBUG_PRINT("flushing %s for pass %s\n", module_data->full_path, pass->name);
+			dr_flush_region(module_data->start, module_data->end - module_data->start);
+		}
+		dr_free_module_data(module_data);
+	}
+	dr_module_iterator_stop(iter);
 
+}
+
+/* one summary file for all the enabled passes */
+static void print_pass_stats(){
+
+	char filename[MAX_STRING_LENGTH];
+	file_t file;
+	pass_stats_t * stats;
 	int i = 0;
 
-	int string_index = 0;
-	int index = -1;
-	int name_collect_state = 0;
-	int arguments_collect_state = 0;
-
-	while (args[i] != '\0'){
-		if (args[i] == '-'){
-			name_collect_state = 1;
-			arguments_collect_state = 0;
-			if (index >= 0){
-				arguments[index].arguments[string_index - 1] = '\0';
-			}
-			index++;
-			string_index = 0;
-			i++;
-			continue;
+	populate_conv_filename(filename, logdir, "passes", "stats");
+	file = dr_open_file(filename, DR_FILE_WRITE_OVERWRITE);
+	if (file == INVALID_FILE){
+		dr_fprintf(STDERR, "cannot open the pass statistics file %s\n", filename);
+		return;
+	}
+
+	dr_fprintf(file, "pass,priority,blocks,app2app_us,analysis_us,insertion_us,meta_instrs,calls_inserted,calls_executed,init_us,lazy_init_us\n");
+	for (i = 0; i < enabled_length; i++){
+		stats = &enabled_pass[i]->stats;
+		dr_fprintf(file, "%s,%d,%u,%llu,%llu,%llu,%llu,%llu,%u,%llu,%llu\n", enabled_pass[i]->name,
+			enabled_pass[i]->priority.priority, stats->blocks,
+			stats->app2app_time, stats->analysis_time, stats->insertion_time,
+			stats->meta_instrs, stats->calls_inserted, stats->calls_executed,
+			stats->init_time, stats->lazy_init_time);
+	}
+	/* whole dr_client_main - option parsing and every pass's init */
+	dr_fprintf(file, "startup,,,,,,,,,%llu,\n", startup_time);
+
+	dr_close_file(file);
+
+}
+
+/* initializes the pass and registers only the callbacks it implements with drmgr; bb callbacks
+   are not registered here but called by the dispatcher in priority order */
+static void enable_ins_pass(client_id_t id, instrumentation_pass_t * pass, const option_group_t * options){
+
+	int i = 0;
+	int j = 0;
+	uint priority;
+	uint active;
+	uint64 start;
+
+	for (i = 0; i < enabled_length; i++){
+		if (enabled_pass[i] == pass){
+			dr_fprintf(STDERR, "pass \"%s\" given more than once\n", pass->name);
+			DR_ASSERT_MSG(false, "duplicate pass");
+			return;
 		}
+	}
 
-		if (args[i] == ' ' && name_collect_state){
-			arguments[index].name[string_index++] = '\0';
-			name_collect_state = 0;
-			arguments_collect_state = 1;
-			string_index = 0;
-			i++;
-			continue;
+	if (option_get_named_uint(options, "priority", &priority)){
+		pass->priority.priority = (int)priority;
+	}
+	pass->active = !option_get_named_uint(options, "active", &active) || active != 0;
+	pass->filter_expr = option_get_named_string(options, "filter");
+	pass->use_program = false;
+	DR_ASSERT_MSG(pass->filter_expr == NULL || pass->get_filter != NULL, "filter= is given to a pass which does not filter");
+
+	DEBUG_PRINT("enabling pass %s - priority %d - %u options\n", pass->name, pass->priority.priority, option_count(options));
+
+	start = dr_get_microseconds();
+	pass->init_func(id, pass->name, options);
+	pass->stats.init_time = dr_get_microseconds() - start;
+	pass->initialized = (pass->lazy_init == NULL);
+
+	if (pass->thread_init != NULL){
+		drmgr_register_thread_init_event_ex(pass->thread_init, &pass->priority);
+	}
+	if (pass->thread_exit != NULL){
+		drmgr_register_thread_exit_event_ex(pass->thread_exit, &pass->priority);
+	}
+
+	/* insert keeping the passes sorted by priority - passes with the same priority keep the command line order */
+	for (i = enabled_length; i > 0; i--){
+		if (enabled_pass[i - 1]->priority.priority <= pass->priority.priority){
+			break;
 		}
+	}
+	for (j = enabled_length; j > i; j--){
+		enabled_pass[j] = enabled_pass[j - 1];
+	}
+	enabled_pass[i] = pass;
+	enabled_length++;
+
+}
 
+/* runs the pass's lazy_init once; cheap after the first call */
+static void ensure_pass_initialized(instrumentation_pass_t * pass){
 
-		if (name_collect_state){
-			arguments[index].name[string_index++] = args[i];
+	uint64 start;
+	module_t * head;
+	uint * filter_mode;
+	bool compiled;
+
+	/* what lazy_init built is published by the release before initialized is set */
+	if (pass->initialized){
+		ACQUIRE_BARRIER();
+		return;
+	}
+
+	dr_mutex_lock(init_mutex);
+	if (!pass->initialized){
+		DEBUG_PRINT("lazily initializing pass %s\n", pass->name);
+		start = dr_get_microseconds();
+		pass->lazy_init();
+		if (pass->filter_expr != NULL){
+			pass->get_filter(&head, &filter_mode);
+			compiled = filter_program_compile(&pass->program, pass->filter_expr, head);
+			DR_ASSERT_MSG(compiled, "bad filter program");
+			pass->use_program = true;
 		}
-		if (arguments_collect_state){
-			arguments[index].arguments[string_index++] = args[i];
+		pass->stats.lazy_init_time = dr_get_microseconds() - start;
+		RELEASE_BARRIER();
+		pass->initialized = true;
+	}
+	dr_mutex_unlock(init_mutex);
+
+}
+
+/* the passes' module hooks are called from here in pass order rather than registered with drmgr,
+   so a pass which is off (active=0, or disabled by a nudge) does not see the module and a module
+   load is the first relevant event for the passes which do - they are initialized before it */
+static void event_module_load(void * drcontext, const module_data_t * info, bool loaded){
+
+	int i;
+
+	/* blocks of the new module may reuse the tags of an unloaded one */
+	ATOMIC_INC32(&filter_gen);
+
+	for (i = 0; i < enabled_length; i++){
+		if (enabled_pass[i]->active && enabled_pass[i]->module_load != NULL){
+			ensure_pass_initialized(enabled_pass[i]);
+			enabled_pass[i]->module_load(drcontext, info, loaded);
 		}
+	}
 
-		i++;
+}
+
+/* a pass which saw the load undoes what it set up even if it was disabled since */
+static void event_module_unload(void * drcontext, const module_data_t * info){
+
+	int i;
+
+	for (i = 0; i < enabled_length; i++){
+		if (enabled_pass[i]->initialized && enabled_pass[i]->module_unload != NULL){
+			ACQUIRE_BARRIER();
+			enabled_pass[i]->module_unload(drcontext, info);
+		}
 	}
 
-	//epilog
-	arguments[index].arguments[string_index++] = '\0';
-	argument_length = index + 1;
+}
+
+/* a pass being enabled missed the loads of the modules which came while it was off - the hooks
+   are given every loaded module again (drwrap refuses to wrap a function twice) */
+static void replay_module_loads(void * drcontext, instrumentation_pass_t * pass){
+
+	dr_module_iterator_t * iter;
+	module_data_t * module_data;
 
+	if (pass->module_load == NULL){
+		return;
+	}
+
+	iter = dr_module_iterator_start();
+	while (dr_module_iterator_hasnext(iter)){
+		module_data = dr_module_iterator_next(iter);
+		pass->module_load(drcontext, module_data, true);
+		dr_free_module_data(module_data);
+	}
+	dr_module_iterator_stop(iter);
+
+}
+
+/* copies a string option into a fixed size global */
+static void get_global_string(const option_group_t * options, char * dest){
+
+	const char * value = option_get_string(options, 0);
+
+	DR_ASSERT_MSG(value != NULL, "missing value for a global option");
+	strncpy(dest, value, MAX_STRING_LENGTH);
+	dest[MAX_STRING_LENGTH - 1] = '\0';
+
+}
+
+static void get_global_bool(const option_group_t * options, bool * dest){
+
+	DR_ASSERT_MSG(option_get_bool(options, 0, dest), "global option expects 0 or 1");
+
+}
+
+void process_global_arguments(){
+
+	const option_group_t * options;
+
+	if ((options = options_find_group("logdir")) != NULL){
+		get_global_string(options, logdir);
+		dr_printf("global logdir - %s\n", logdir);
+	}
+	if ((options = options_find_group("debug")) != NULL){
+		get_global_bool(options, &debug_mode);
+		dr_printf("global debug - %d\n", debug_mode);
+	}
+	if ((options = options_find_group("log")) != NULL){
+		get_global_bool(options, &log_mode);
+		dr_printf("global log - %d\n", log_mode);
+	}
+	if ((options = options_find_group("exec")) != NULL){
+		get_global_string(options, exec);
+		dr_printf("exec - %s\n", exec);
+	}
+	if ((options = options_find_group("stats")) != NULL){
+		get_global_bool(options, &stats_mode);
+		dr_printf("global stats - %d\n", stats_mode);
+	}
+}
+
+/* reads the config file and builds the options from it followed by the command line options */
+static bool load_config_file(const char * filename, const char * args){
+
+	file_t file;
+	uint64 file_size;
+	size_t size;
+	size_t args_length;
+	ssize_t read;
+	char * text;
+	bool parsed;
+
+	file = dr_open_file(filename, DR_FILE_READ);
+	if (file == INVALID_FILE){
+		dr_fprintf(STDERR, "cannot open the config file %s\n", filename);
+		return false;
+	}
+
+	DR_ASSERT(dr_file_size(file, &file_size));
+	args_length = strlen(args);
+	size = (size_t)file_size + args_length + 2;
+	text = (char *)dr_global_alloc(size);
+
+	read = dr_read_file(file, text, (size_t)file_size);
+	dr_close_file(file);
+	if (read < 0){
+		read = 0;
+	}
+	text[read] = '\n';
+	memcpy(text + read + 1, args, args_length + 1);
+
+	/* the option table copies what it needs; the text is not kept */
+	parsed = options_init(text);
+	dr_global_free(text, size);
+
+	return parsed;
+
+}
+
+/* the options are tokenized once into the option table; passes read their group through the
+   typed getters in options.h */
+static void doCommandLineArgProcessing(client_id_t id){
+
+	const char * args = dr_get_options(id);
+	const char * config;
+	char filename[MAX_STRING_LENGTH];
+	bool parsed = options_init(args);
+
+	DR_ASSERT_MSG(parsed, "malformed client options");
+
+	config = option_get_string(options_find_group("config"), 0);
+	if (config != NULL){
+		strncpy(filename, config, MAX_STRING_LENGTH);
+		filename[MAX_STRING_LENGTH - 1] = '\0';
+		options_exit();
+		parsed = load_config_file(filename, args);
+		DR_ASSERT_MSG(parsed, "malformed config file");
+	}
 
 	process_global_arguments();
 
@@ -370,8 +1319,14 @@ static void setupInsPasses(){
 	ins_pass[0].thread_init = bbinfo_thread_init;
 	ins_pass[0].thread_exit = bbinfo_thread_exit;
 	ins_pass[0].process_exit = bbinfo_exit_event;
+	ins_pass[0].lazy_init = bbinfo_lazy_init;
+	ins_pass[0].lazy_exit = bbinfo_lazy_exit;
 	ins_pass[0].module_load = NULL;
 	ins_pass[0].module_unload = NULL;
+	ins_pass[0].get_filter = bbinfo_get_filter;
+	ins_pass[0].snapshot = bbinfo_snapshot;
+	ins_pass[0].produces = 0;
+	ins_pass[0].consumes = PRODUCT_MASK(PRODUCT_BB_FILTER) | PRODUCT_MASK(PRODUCT_CURRENT_FUNCTION);
 
 
 	//ins pass 2 - cpuid
@@ -386,8 +1341,14 @@ static void setupInsPasses(){
 	ins_pass[1].thread_init = cpuid_thread_init;
 	ins_pass[1].thread_exit = cpuid_thread_exit;
 	ins_pass[1].process_exit = cpuid_exit_event;
+	ins_pass[1].lazy_init = NULL;
+	ins_pass[1].lazy_exit = NULL;
 	ins_pass[1].module_load = NULL;
 	ins_pass[1].module_unload = NULL;
+	ins_pass[1].get_filter = NULL;
+	ins_pass[1].snapshot = NULL;
+	ins_pass[1].produces = 0;
+	ins_pass[1].consumes = 0;
 
 	//ins pass 3 - memtrace
 	ins_pass[2].name = "memtrace";
@@ -401,8 +1362,14 @@ static void setupInsPasses(){
 	ins_pass[2].thread_init = memtrace_thread_init;
 	ins_pass[2].thread_exit = memtrace_thread_exit;
 	ins_pass[2].process_exit = memtrace_exit_event;
+	ins_pass[2].lazy_init = memtrace_lazy_init;
+	ins_pass[2].lazy_exit = memtrace_lazy_exit;
 	ins_pass[2].module_load = NULL;
 	ins_pass[2].module_unload = NULL;
+	ins_pass[2].get_filter = memtrace_get_filter;
+	ins_pass[2].snapshot = NULL;
+	ins_pass[2].produces = 0;
+	ins_pass[2].consumes = PRODUCT_MASK(PRODUCT_BB_FILTER);
 
 
 	//ins pass 4 - inscount
@@ -417,8 +1384,14 @@ static void setupInsPasses(){
 	ins_pass[3].thread_init = NULL;
 	ins_pass[3].thread_exit = NULL;
 	ins_pass[3].process_exit = inscount_exit_event;
+	ins_pass[3].lazy_init = inscount_lazy_init;
+	ins_pass[3].lazy_exit = inscount_lazy_exit;
 	ins_pass[3].module_load = NULL;
 	ins_pass[3].module_unload = NULL;
+	ins_pass[3].get_filter = inscount_get_filter;
+	ins_pass[3].snapshot = NULL;
+	ins_pass[3].produces = 0;
+	ins_pass[3].consumes = PRODUCT_MASK(PRODUCT_BB_FILTER);
 
 	//ins pass 5 - instrace
 	ins_pass[4].name = "instrace";
@@ -432,8 +1405,14 @@ static void setupInsPasses(){
 	ins_pass[4].thread_init = instrace_thread_init;
 	ins_pass[4].thread_exit = instrace_thread_exit;
 	ins_pass[4].process_exit = instrace_exit_event;
+	ins_pass[4].lazy_init = instrace_lazy_init;
+	ins_pass[4].lazy_exit = instrace_lazy_exit;
 	ins_pass[4].module_load = NULL;
 	ins_pass[4].module_unload = NULL;
+	ins_pass[4].get_filter = instrace_get_filter;
+	ins_pass[4].snapshot = NULL;
+	ins_pass[4].produces = 0;
+	ins_pass[4].consumes = PRODUCT_MASK(PRODUCT_BB_FILTER) | PRODUCT_MASK(PRODUCT_THREAD_FILTER);
 
 
 	//ins pass 6 - functrace - this is a low priority update (should be the last)
@@ -448,8 +1427,15 @@ static void setupInsPasses(){
 	ins_pass[5].thread_init = functrace_thread_init;
 	ins_pass[5].thread_exit = functrace_thread_exit;
 	ins_pass[5].process_exit = functrace_exit_event;
+	ins_pass[5].lazy_init = NULL;
+	ins_pass[5].lazy_exit = NULL;
 	ins_pass[5].module_load = NULL;
 	ins_pass[5].module_unload = NULL;
+	ins_pass[5].get_filter = NULL;
+	ins_pass[5].snapshot = NULL;
+	ins_pass[5].produces = PRODUCT_MASK(PRODUCT_CURRENT_FUNCTION);
+	ins_pass[5].consumes = 0;
+	ins_pass[5].product[PRODUCT_CURRENT_FUNCTION] = get_current_function_all;
 
 	//ins pass 7 - funcwrapping - given a high priority
 	ins_pass[6].name = "funcwrap";
@@ -459,12 +1445,20 @@ static void setupInsPasses(){
 	ins_pass[6].init_func = funcwrap_init;
 	ins_pass[6].app2app_bb = NULL;
 	ins_pass[6].analysis_bb = NULL;
-	ins_pass[6].instrumentation_bb = funcwrap_bb_instrumentation;
+	ins_pass[6].instrumentation_bb = NULL;
 	ins_pass[6].thread_init = funcwrap_thread_init;
 	ins_pass[6].thread_exit = funcwrap_thread_exit;
 	ins_pass[6].process_exit = funcwrap_exit_event;
+	ins_pass[6].lazy_init = funcwrap_lazy_init;
+	ins_pass[6].lazy_exit = funcwrap_lazy_exit;
 	ins_pass[6].module_load = funcwrap_module_load;
 	ins_pass[6].module_unload = NULL;
+	ins_pass[6].get_filter = NULL;
+	ins_pass[6].snapshot = NULL;
+	ins_pass[6].produces = PRODUCT_MASK(PRODUCT_FUNCTION_FILTER) | PRODUCT_MASK(PRODUCT_THREAD_FILTER);
+	ins_pass[6].consumes = 0;
+	ins_pass[6].product[PRODUCT_FUNCTION_FILTER] = funcwrap_function_filter;
+	ins_pass[6].product[PRODUCT_THREAD_FILTER] = funcwrap_thread_filter;
 
 
 	//ins pass 8 - memdump
@@ -479,8 +1473,14 @@ static void setupInsPasses(){
 	ins_pass[7].thread_init = memdump_thread_init;
 	ins_pass[7].thread_exit = memdump_thread_exit;
 	ins_pass[7].process_exit = memdump_exit_event;
+	ins_pass[7].lazy_init = memdump_lazy_init;
+	ins_pass[7].lazy_exit = memdump_lazy_exit;
 	ins_pass[7].module_load = memdump_module_load;
 	ins_pass[7].module_unload = NULL;
+	ins_pass[7].get_filter = NULL;
+	ins_pass[7].snapshot = NULL;
+	ins_pass[7].produces = 0;
+	ins_pass[7].consumes = 0;
 
 	//ins pass 9 - funcreplace
 	ins_pass[8].name = "funcreplace";
@@ -494,8 +1494,14 @@ static void setupInsPasses(){
 	ins_pass[8].thread_init = funcreplace_thread_init;
 	ins_pass[8].thread_exit = funcreplace_thread_exit;
 	ins_pass[8].process_exit = funcreplace_exit_event;
+	ins_pass[8].lazy_init = funcreplace_lazy_init;
+	ins_pass[8].lazy_exit = funcreplace_lazy_exit;
 	ins_pass[8].module_load = funcreplace_module_load;
 	ins_pass[8].module_unload = NULL;
+	ins_pass[8].get_filter = NULL;
+	ins_pass[8].snapshot = NULL;
+	ins_pass[8].produces = 0;
+	ins_pass[8].consumes = 0;
 
 	//ins pass 10 - misc
 	ins_pass[9].name = "misc";
@@ -509,8 +1515,14 @@ static void setupInsPasses(){
 	ins_pass[9].thread_init = misc_thread_init;
 	ins_pass[9].thread_exit = misc_thread_exit;
 	ins_pass[9].process_exit = misc_exit_event;
+	ins_pass[9].lazy_init = misc_lazy_init;
+	ins_pass[9].lazy_exit = misc_lazy_exit;
 	ins_pass[9].module_load = NULL;
 	ins_pass[9].module_unload = NULL;
+	ins_pass[9].get_filter = NULL;
+	ins_pass[9].snapshot = NULL;
+	ins_pass[9].produces = 0;
+	ins_pass[9].consumes = 0;
 
 
 	pass_length = 10;
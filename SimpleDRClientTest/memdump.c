@@ -3,7 +3,9 @@
 #include "drutil.h"
 #include "include/moduleinfo.h"
 #include "include/utilities.h"
+#include "include/module_registry.h"
 #include "include/memdump.h"
+#include "include/thread_context.h"
 
 
 /* for each client following functions may be implemented
@@ -26,10 +28,10 @@ thread_func_t thread_exit;
 
 typedef struct _client_arg_t{
 
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
-	char app_pc_filename[MAX_STRING_LENGTH];
-	char output_folder[MAX_STRING_LENGTH];
+	const char * app_pc_filename;
+	const char * output_folder;
 
 } client_arg_t;
 
@@ -48,11 +50,11 @@ typedef struct {
 
 /******************************************global variables****************************/
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * done_head;
 static module_t * filter_head;
 static module_t * app_pc_head;
-static int tls_index;
+static uint tls_slot;
 static void * mutex;
 
 static file_t logfile;
@@ -69,45 +71,36 @@ static uint written_count = 0;
 
 /********************************implementation******************************************/
 
-static bool parse_commandline_args(const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
+	if (option_count(options) < 4){
+		return false;
+	}
 
-	if (dr_sscanf(args, "%s %d %s %s", &client_arg->filter_filename,
-									&client_arg->filter_mode,
-									&client_arg->app_pc_filename,
-									&client_arg->output_folder) != 4){
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
 		return false;
 	}
+	client_arg.app_pc_filename = option_get_string(options, 2);
+	client_arg.output_folder = option_get_string(options, 3);
 
 	return true;
 }
 
 
 /* callbacks for the entire process */
-void memdump_init(client_id_t id, const char * name, const char * arguments)
+void memdump_init(client_id_t id, const char * name, const option_group_t * options)
 {
 
 	char logfilename[MAX_STRING_LENGTH];
-	file_t in_file;
 
 	drmgr_init();
 	drutil_init();
 	drwrap_init();
-	tls_index = drmgr_register_tls_field();
-	DR_ASSERT(parse_commandline_args(arguments) == true);
+	tls_slot = thread_context_register(sizeof(per_thread_t));
+	DR_ASSERT(parse_commandline_args(options) == true);
 
-	filter_head = md_initialize();
 	done_head = md_initialize();
-	app_pc_head = md_initialize();
-
-	in_file = dr_open_file(client_arg->filter_filename, DR_FILE_READ);
-	md_read_from_file(filter_head, in_file, false);
-	dr_close_file(in_file);
-
-	in_file = dr_open_file(client_arg->app_pc_filename, DR_FILE_READ);
-	md_read_from_file(app_pc_head, in_file, false);
-	dr_close_file(in_file);
 
 
 	if (log_mode){
@@ -119,17 +112,30 @@ void memdump_init(client_id_t id, const char * name, const char * arguments)
 
 }
 
+/* both files are always read, whatever the filter mode is - at the first module load or block */
+void memdump_lazy_init(void)
+{
+
+	filter_head = filter_load(client_arg.filter_filename, FILTER_BB);
+	app_pc_head = filter_load(client_arg.app_pc_filename, FILTER_BB);
+
+}
+
+void memdump_lazy_exit(void)
+{
+
+	filter_release(filter_head);
+	filter_release(app_pc_head);
+
+}
+
 void memdump_exit_event(void)
 {
 
 	int i = 0;
 
-	md_delete_list(filter_head, false);
 	md_delete_list(done_head, false);
-	md_delete_list(app_pc_head, false);
 
-	dr_global_free(client_arg, sizeof(client_arg_t));
-	drmgr_unregister_tls_field(tls_index);
 	if (log_mode){
 		dr_close_file(logfile);
 	}
@@ -148,16 +154,14 @@ void memdump_thread_init(void *drcontext){
 	per_thread_t * data;
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
-	data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
-	drmgr_set_tls_field(drcontext, tls_index, data);
+	data = thread_context_get_slot(drcontext, tls_slot);
 
 }
 
 void
 memdump_thread_exit(void *drcontext){
 	per_thread_t * data;
-	data = drmgr_get_tls_field(drcontext, tls_index);
-	dr_thread_free(drcontext, data, sizeof(per_thread_t));
+	data = thread_context_get_slot(drcontext, tls_slot);
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
 }
@@ -192,7 +196,7 @@ static char * get_mem_dump_filename(app_pc base_pc, uint size, uint write, uint
 	char * filename = dr_global_alloc(sizeof(char) * MAX_STRING_LENGTH);
 
 	dr_snprintf(other_details, MAX_STRING_LENGTH, "%x_%d_%d_%d", base_pc, size, write, other_info);
-	populate_conv_filename(filename, client_arg->output_folder, ins_pass_name, other_details);
+	populate_conv_filename(filename, client_arg.output_folder, ins_pass_name, other_details);
 	return filename;
 
 
@@ -217,7 +221,8 @@ static void do_mem_dump(file_t file, uint base_pc,uint size){
 void clean_call_mem_information(instr_t * instr, app_pc mem_val, uint write){
 
 	void * drcontext = dr_get_current_drcontext();
-	module_data_t * data = dr_lookup_module(instr_get_app_pc(instr));
+	loaded_module_t module;
+	bool in_module = module_registry_lookup(instr_get_app_pc(instr), &module);
 	uint offset;
 
 	app_pc base_pc;
@@ -226,14 +231,14 @@ void clean_call_mem_information(instr_t * instr, app_pc mem_val, uint write){
 	file_t dump_file;
 	char * dump_filename;
 
-	DR_ASSERT(data != NULL);
-	offset = instr_get_app_pc(instr) - data->start;
+	DR_ASSERT(in_module);
+	offset = instr_get_app_pc(instr) - module.start;
 
 	dr_mutex_lock(mutex);
 
-	//if (!md_lookup_bb_in_module(done_head, data->full_path, offset)){
+	//if (!md_lookup_bb_in_module(done_head, module.name, offset)){
 
-		//md_add_bb_to_module(done_head, data->full_path, offset, MAX_BBS_PER_MODULE, false);
+		//md_add_bb_to_module(done_head, module.name, offset, 0, false);
 		dr_query_memory(mem_val, &base_pc, &size, &prot);
 		//DEBUG_PRINT("base pc - %x, size - %u, write - %u\n", base_pc, size, write);
 		if (write){  /* postpone till the end of the function */
@@ -266,7 +271,6 @@ void clean_call_mem_information(instr_t * instr, app_pc mem_val, uint write){
 	//}
 
 	dr_mutex_unlock(mutex);
-	dr_free_module_data(data);
 
 
 }
@@ -288,11 +292,12 @@ instr_t *instr, bool for_trace, bool translating,
 void *user_data)
 {
 
+	bb_context_t * ctx = (bb_context_t *)user_data;
 	reg_id_t reg1 = DR_REG_XAX;
 	reg_id_t reg2 = DR_REG_XBX;
 	int i = 0;
 
-	if(filter_bb_level_from_list(app_pc_head, instr)){
+	if(filter_instr_from_context(app_pc_head, ctx, instr, FILTER_BB)){
 
 		dr_save_reg(drcontext, bb, instr, reg1, SPILL_SLOT_1);
 		dr_save_reg(drcontext, bb, instr, reg2, SPILL_SLOT_2);
@@ -368,9 +373,9 @@ void memdump_module_load(void * drcontext, module_data_t * module, bool loaded){
 
 
 	if (md != NULL){
-		for (int i = 1; i <= md->bbs[0].start_addr; i++){
+		for (i = 0; i < md_get_bb_count(md); i++){
 
-			address = md->bbs[i].start_addr + module->start;
+			address = md_get_bb_addr(md, i) + module->start;
 			DEBUG_PRINT("%s module %x function wrapping\n", md->module, address);
 			drwrap_wrap(address, NULL, post_func_cb);
 			DEBUG_PRINT("wrapped\n");
@@ -5,8 +5,10 @@
 #include "drmgr.h"
 #include "drutil.h"
 #include "include/utilities.h"
+#include "include/module_registry.h"
 #include "include/moduleinfo.h"
 #include "include/defines.h"
+#include "include/thread_context.h"
 
 /*************************defines******************************/
 
@@ -59,10 +61,10 @@ typedef struct {
 } per_thread_t;
 
 typedef struct _client_arg_t{
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
-	char output_folder[MAX_STRING_LENGTH];
-	char extra_info[MAX_STRING_LENGTH];
+	const char * output_folder;
+	const char * extra_info;
 
 } client_arg_t;
 
@@ -72,9 +74,9 @@ static client_id_t client_id;
 static app_pc code_cache;
 static void  *mutex;    /* for multithread support */
 static uint64 num_refs; /* keep a global memory reference count */
-static int tls_index;
+static uint tls_slot;
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * head;
 
 static file_t logfile;
@@ -91,29 +93,31 @@ static void instrument_mem(void        *drcontext,
 						   instr_t     *where,
 						   int          pos,
 						   bool         write);
-static bool parse_commandline_args (const char * args);
+static bool parse_commandline_args(const option_group_t * options);
 
 
 /*********************function implementation*******************/
 
-static bool parse_commandline_args (const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
+
+	if (option_count(options) < 4){
+		return false;
+	}
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
-	if(dr_sscanf(args,"%s %d %s %s",&client_arg->filter_filename,
-								&client_arg->filter_mode,
-								&client_arg->output_folder,
-								&client_arg->extra_info)!=4){
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
 		return false;
 	}
+	client_arg.output_folder = option_get_string(options, 2);
+	client_arg.extra_info = option_get_string(options, 3);
 
 	return true;
 }
 
-void memtrace_init(client_id_t id,const char * name, const char * arguments)
+void memtrace_init(client_id_t id,const char * name, const option_group_t * options)
 {
 
 	char logfilename[MAX_STRING_LENGTH];
-	file_t in_file;
 
 
 	drmgr_init();
@@ -122,22 +126,9 @@ void memtrace_init(client_id_t id,const char * name, const char * arguments)
 	client_id = id;
 	mutex = dr_mutex_create();
 
-	DR_ASSERT(parse_commandline_args(arguments) == true);
-
-	head = md_initialize();
-
-
-	if(client_arg->filter_mode != FILTER_NONE){
-		in_file = dr_open_file(client_arg->filter_filename,DR_FILE_READ);
-		DR_ASSERT(in_file != INVALID_FILE);
-		md_read_from_file(head,in_file,false);
-		dr_close_file(in_file);
-	}
+	DR_ASSERT(parse_commandline_args(options) == true);
 
-	tls_index = drmgr_register_tls_field();
-	DR_ASSERT(tls_index != -1);
-
-	code_cache_init();
+	tls_slot = thread_context_register(sizeof(per_thread_t));
 
 	if (log_mode){
 		populate_conv_filename(logfilename, logdir, name, NULL);
@@ -147,17 +138,38 @@ void memtrace_init(client_id_t id,const char * name, const char * arguments)
 
 }
 
-void memtrace_exit_event()
+/* filter used by the pass - the dispatcher changes the mode on nudges */
+void memtrace_get_filter(module_t ** list, uint ** mode){
+
+	*list = head;
+	*mode = &client_arg.filter_mode;
+
+}
+
+/* filter and the shared clean call code - set up when the first block is seen */
+void memtrace_lazy_init(void)
 {
 
-	md_delete_list(head,false);
+	head = filter_load(client_arg.filter_filename, client_arg.filter_mode);
+	code_cache_init();
+
+}
+
+void memtrace_lazy_exit(void)
+{
+
+	filter_release(head);
 	code_cache_exit();
-	drmgr_unregister_tls_field(tls_index);
+
+}
+
+void memtrace_exit_event()
+{
+
 	if (log_mode){
 		dr_close_file(logfile);
 	}
 	dr_mutex_destroy(mutex);
-	dr_global_free(client_arg, sizeof(client_arg_t));
 	drutil_exit();
 	drmgr_exit();
 }
@@ -181,9 +193,8 @@ void memtrace_thread_init(void *drcontext)
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
-	/* allocate thread private data */
-	data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
-	drmgr_set_tls_field(drcontext, tls_index, data);
+	/* thread private data lives in the shared thread context */
+	data = thread_context_get_slot(drcontext, tls_slot);
 	data->buf_base = dr_thread_alloc(drcontext, MEM_BUF_SIZE);
 	data->buf_ptr  = data->buf_base;
 	/* set buf_end to be negative of address of buffer end for the lea later */
@@ -205,9 +216,9 @@ void memtrace_thread_init(void *drcontext)
 
 
 
-	dr_snprintf(extra_info, MAX_STRING_LENGTH, "%s_%s", client_arg->extra_info, thread_id);
+	dr_snprintf(extra_info, MAX_STRING_LENGTH, "%s_%s", client_arg.extra_info, thread_id);
 
-	populate_conv_filename(outfilename, client_arg->output_folder, ins_pass_name, extra_info);
+	populate_conv_filename(outfilename, client_arg.output_folder, ins_pass_name, extra_info);
 	data->outfile = dr_open_file(outfilename, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
 	DR_ASSERT(data->outfile != INVALID_FILE);
 
@@ -236,7 +247,7 @@ void memtrace_thread_exit(void *drcontext)
 	per_thread_t *data;
 
 	memtrace(drcontext);
-	data = drmgr_get_tls_field(drcontext, tls_index);
+	data = thread_context_get_slot(drcontext, tls_slot);
 	dr_mutex_lock(mutex);
 	num_refs += data->num_refs;
 	dr_mutex_unlock(mutex);
@@ -245,7 +256,6 @@ void memtrace_thread_exit(void *drcontext)
 	}
 	dr_close_file(data->outfile);
 	dr_thread_free(drcontext, data->buf_base, MEM_BUF_SIZE);
-	dr_thread_free(drcontext, data, sizeof(per_thread_t));
 
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 }
@@ -293,25 +303,16 @@ memtrace_bb_instrumentation(void *drcontext, void *tag, instrlist_t *bb,
 				instr_t *instr, bool for_trace, bool translating,
 				void *user_data)
 {
+	bb_context_t * ctx = (bb_context_t *)user_data;
 	int i;
 	reg_id_t reg;
 	file_t out_file;
-	instr_t * first = NULL;
-	instr_t * current;
 
 	//DR_ASSERT(instr_ok_to_mangle(instr));
 
 	if (instr_ok_to_mangle(instr)){
-		/* FIXME - need to generalize the filtering library */
-
-		for (current = instrlist_first(bb); current != NULL; current = instr_get_next(current)){
-			if (instr_ok_to_mangle(current)){
-				first = current;
-				break;
-			}
-		}
 
-		if ((first != NULL) && filter_from_list(head, first, client_arg->filter_mode)){
+		if ((ctx->first != NULL) && ctx->filtered){
 
 			if (instr_reads_memory(instr)) {
 				for (i = 0; i < instr_num_srcs(instr); i++) {
@@ -349,9 +350,9 @@ memtrace(void *drcontext)
 	int i;
 #endif
 
-	module_data_t * mdata;
+	loaded_module_t module;
 
-	data      = drmgr_get_tls_field(drcontext, tls_index);
+	data      = thread_context_get_slot(drcontext, tls_slot);
 	mem_ref   = (mem_ref_t *)data->buf_base;
 	num_refs  = (int)((mem_ref_t *)data->buf_ptr - mem_ref);
 
@@ -360,14 +361,12 @@ memtrace(void *drcontext)
 			   "Format: <instr address>,<(r)ead/(w)rite>,<data size>,<data address>\n");*/
 
 	for (i = 0; i < num_refs; i++) {
-		mdata = dr_lookup_module(mem_ref->pc);
-		if (mdata != NULL){
+		if (module_registry_lookup(mem_ref->pc, &module)){
 			//if (((uint)mem_ref->addr > data->stack_base) || ((uint)mem_ref->addr < data->stack_limit)){
-				dr_fprintf(data->outfile, "%x,%x,%d,%d,"PFX"\n", mdata->start, mem_ref->pc - mdata->start
+				dr_fprintf(data->outfile, "%x,%x,%d,%d,"PFX"\n", module.start, mem_ref->pc - module.start
 					, mem_ref->write ? 1 : 0 , mem_ref->size, mem_ref->addr);
 			//}
 		}
-		dr_free_module_data(mdata);
 
 		++mem_ref;
 	}
@@ -442,7 +441,7 @@ instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
 	per_thread_t *data;
 	app_pc pc;
 
-	data = drmgr_get_tls_field(drcontext, tls_index);
+	data = thread_context_get_slot(drcontext, tls_slot);
 
 	/* Steal the register for memory reference address *
 	 * We can optimize away the unnecessary register save and restore
@@ -468,10 +467,10 @@ instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
 	 * if (buf_ptr >= buf_end_ptr)
 	 *    clean_call();
 	 */
-	drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
+	thread_context_insert_load(drcontext, ilist, where, reg2);
 	/* Load data->buf_ptr into reg2 */
 	opnd1 = opnd_create_reg(reg2);
-	opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
+	opnd2 = OPND_CREATE_MEMPTR(reg2, tls_slot + offsetof(per_thread_t, buf_ptr));
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
@@ -516,8 +515,8 @@ instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
 	instrlist_meta_preinsert(ilist, where, instr);
 
 	/* Update the data->buf_ptr */
-	drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
-	opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_ptr));
+	thread_context_insert_load(drcontext, ilist, where, reg1);
+	opnd1 = OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, buf_ptr));
 	opnd2 = opnd_create_reg(reg2);
 	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
@@ -528,7 +527,7 @@ instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
 	 */
 	/* lea [reg2 - buf_end] => reg2 */
 	opnd1 = opnd_create_reg(reg1);
-	opnd2 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_end));
+	opnd2 = OPND_CREATE_MEMPTR(reg1, tls_slot + offsetof(per_thread_t, buf_end));
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 	opnd1 = opnd_create_reg(reg2);
@@ -2,6 +2,7 @@
 #include "include/defines.h"
 #include "include/moduleinfo.h"
 #include "include/utilities.h"
+#include "include/thread_context.h"
 
 
 /* for each client following functions may be implemented
@@ -20,7 +21,7 @@ thread_func_t thread_exit;
 */
 
 typedef struct _client_arg_t{
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
 } client_arg_t;
 
@@ -29,20 +30,22 @@ typedef struct {
 	file_t  outfile;
 } per_thread_t;
 
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 static module_t * head;
-static int tls_index;
+static uint tls_slot;
 
 static file_t logfile;
 static char ins_pass_name[MAX_STRING_LENGTH];
 
 
-static bool parse_commandline_args(const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
+	if (option_count(options) < 2){
+		return false;
+	}
 
-	if (dr_sscanf(args, "%s %d", &client_arg->filter_filename,
-		&client_arg->filter_mode) != 2){
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
 		return false;
 	}
 
@@ -51,22 +54,14 @@ static bool parse_commandline_args(const char * args) {
 
 
 /* callbacks for the entire process */
-void misc_init(client_id_t id, const char * name, const char * arguments)
+void misc_init(client_id_t id, const char * name, const option_group_t * options)
 {
 
 	char logfilename[MAX_STRING_LENGTH];
-	file_t in_file;
 
 	drmgr_init();
-	tls_index = drmgr_register_tls_field();
-	DR_ASSERT(parse_commandline_args(arguments) == true);
-	head = md_initialize();
-
-	if (client_arg->filter_mode != FILTER_NONE){
-		in_file = dr_open_file(client_arg->filter_filename, DR_FILE_READ);
-		md_read_from_file(head, in_file, false);
-		dr_close_file(in_file);
-	}
+	tls_slot = thread_context_register(sizeof(per_thread_t));
+	DR_ASSERT(parse_commandline_args(options) == true);
 
 	if (log_mode){
 		populate_conv_filename(logfilename, logdir, name, NULL);
@@ -76,12 +71,20 @@ void misc_init(client_id_t id, const char * name, const char * arguments)
 
 }
 
+/* the filter is read when the first block is seen */
+void misc_lazy_init(void)
+{
+	head = filter_load(client_arg.filter_filename, client_arg.filter_mode);
+}
+
+void misc_lazy_exit(void)
+{
+	filter_release(head);
+}
+
 void misc_exit_event(void)
 {
 
-	md_delete_list(head, false);
-	dr_global_free(client_arg, sizeof(client_arg_t));
-	drmgr_unregister_tls_field(tls_index);
 	if (log_mode){
 		dr_close_file(logfile);
 	}
@@ -94,16 +97,14 @@ void misc_thread_init(void *drcontext){
 	per_thread_t * data;
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
-	data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
-	drmgr_set_tls_field(drcontext, tls_index, data);
+	data = thread_context_get_slot(drcontext, tls_slot);
 
 }
 
 void
 misc_thread_exit(void *drcontext){
 	per_thread_t * data;
-	data = drmgr_get_tls_field(drcontext, tls_index);
-	dr_thread_free(drcontext, data, sizeof(per_thread_t));
+	data = thread_context_get_slot(drcontext, tls_slot);
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
 }
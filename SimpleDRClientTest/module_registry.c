@@ -0,0 +1,211 @@
+#include "dr_api.h"
+#include "drmgr.h"
+#include "include/module_registry.h"
+#include <string.h>
+
+/* the registry sees a module before and forgets it after every pass */
+#define MODULE_REGISTRY_PRIORITY 20000
+
+/* loaded modules sorted by start; written by the load / unload events, read by every lookup */
+static loaded_module_t modules[MAX_LOADED_MODULES];
+static uint num_modules = 0;
+static void * modules_lock;
+
+/* interned names - slots hold id + 1 (0 - empty); the table is kept at most half full */
+static const char * names[MAX_MODULE_NAMES];
+static size_t name_sizes[MAX_MODULE_NAMES];
+static uint name_slots[2 * MAX_MODULE_NAMES];
+static volatile uint num_names = 0;
+static void * names_mutex;
+
+static drmgr_priority_t load_priority = {
+	sizeof(load_priority),        /* size of struct */
+	"module_registry_load",       /* name of our operation */
+	NULL,                         /* optional name of operation we should precede */
+	NULL,                         /* optional name of operation we should follow */
+	-MODULE_REGISTRY_PRIORITY };
+
+static drmgr_priority_t unload_priority = {
+	sizeof(unload_priority),      /* size of struct */
+	"module_registry_unload",     /* name of our operation */
+	NULL,                         /* optional name of operation we should precede */
+	NULL,                         /* optional name of operation we should follow */
+	MODULE_REGISTRY_PRIORITY };
+
+static void event_module_load(void * drcontext, const module_data_t * info, bool loaded);
+static void event_module_unload(void * drcontext, const module_data_t * info);
+
+void module_registry_init(){
+
+	modules_lock = dr_rwlock_create();
+	names_mutex = dr_mutex_create();
+
+	drmgr_register_module_load_event_ex(event_module_load, &load_priority);
+	drmgr_register_module_unload_event_ex(event_module_unload, &unload_priority);
+
+}
+
+void module_registry_exit(){
+
+	uint i;
+
+	drmgr_unregister_module_load_event(event_module_load);
+	drmgr_unregister_module_unload_event(event_module_unload);
+
+	for (i = 0; i < num_names; i++){
+		dr_global_free((void *)names[i], name_sizes[i]);
+	}
+	num_names = 0;
+	num_modules = 0;
+
+	dr_mutex_destroy(names_mutex);
+	dr_rwlock_destroy(modules_lock);
+
+}
+
+/* index of the first module starting after pc */
+static uint upper_bound(app_pc pc){
+
+	uint low = 0;
+	uint high = num_modules;
+	uint mid;
+
+	while (low < high){
+		mid = (low + high) / 2;
+		if (modules[mid].start <= pc){
+			low = mid + 1;
+		}
+		else{
+			high = mid;
+		}
+	}
+
+	return low;
+
+}
+
+bool module_registry_lookup(app_pc pc, loaded_module_t * module){
+
+	uint index;
+	bool found = false;
+
+	dr_rwlock_read_lock(modules_lock);
+	index = upper_bound(pc);
+	if (index > 0 && pc < modules[index - 1].end){
+		*module = modules[index - 1];
+		found = true;
+	}
+	dr_rwlock_read_unlock(modules_lock);
+
+	return found;
+
+}
+
+/* FNV-1a */
+static uint hash_name(const char * name){
+
+	uint hash = 2166136261u;
+
+	for (; *name != '\0'; name++){
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	}
+
+	return hash;
+
+}
+
+uint module_registry_intern(const char * name){
+
+	uint mask = 2 * MAX_MODULE_NAMES - 1;
+	uint slot;
+	uint id;
+	char * copy;
+
+	dr_mutex_lock(names_mutex);
+
+	for (slot = hash_name(name) & mask; name_slots[slot] != 0; slot = (slot + 1) & mask){
+		if (strcmp(names[name_slots[slot] - 1], name) == 0){
+			id = name_slots[slot] - 1;
+			dr_mutex_unlock(names_mutex);
+			return id;
+		}
+	}
+
+	DR_ASSERT_MSG(num_names < MAX_MODULE_NAMES, "too many module names");
+
+	id = num_names;
+	name_sizes[id] = strlen(name) + 1;
+	copy = (char *)dr_global_alloc(name_sizes[id]);
+	memcpy(copy, name, name_sizes[id]);
+	names[id] = copy;
+	name_slots[slot] = id + 1;
+	/* the name is in place before the id becomes visible to module_registry_name */
+	num_names = id + 1;
+
+	dr_mutex_unlock(names_mutex);
+
+	return id;
+
+}
+
+bool module_registry_find(const char * name, uint * name_id){
+
+	uint mask = 2 * MAX_MODULE_NAMES - 1;
+	uint slot;
+	bool found = false;
+
+	dr_mutex_lock(names_mutex);
+	for (slot = hash_name(name) & mask; name_slots[slot] != 0; slot = (slot + 1) & mask){
+		if (strcmp(names[name_slots[slot] - 1], name) == 0){
+			*name_id = name_slots[slot] - 1;
+			found = true;
+			break;
+		}
+	}
+	dr_mutex_unlock(names_mutex);
+
+	return found;
+
+}
+
+const char * module_registry_name(uint name_id){
+
+	DR_ASSERT(name_id < num_names);
+	return names[name_id];
+
+}
+
+static void event_module_load(void * drcontext, const module_data_t * info, bool loaded){
+
+	loaded_module_t module;
+	uint index;
+
+	module.start = info->start;
+	module.end = info->end;
+	module.name_id = module_registry_intern(info->full_path != NULL ? info->full_path : "");
+	module.name = names[module.name_id];
+
+	dr_rwlock_write_lock(modules_lock);
+	DR_ASSERT_MSG(num_modules < MAX_LOADED_MODULES, "too many loaded modules");
+	index = upper_bound(module.start);
+	memmove(&modules[index + 1], &modules[index], (num_modules - index) * sizeof(loaded_module_t));
+	modules[index] = module;
+	num_modules++;
+	dr_rwlock_write_unlock(modules_lock);
+
+}
+
+static void event_module_unload(void * drcontext, const module_data_t * info){
+
+	uint index;
+
+	dr_rwlock_write_lock(modules_lock);
+	index = upper_bound(info->start);
+	if (index > 0 && modules[index - 1].start == info->start){
+		index--;
+		memmove(&modules[index], &modules[index + 1], (num_modules - index - 1) * sizeof(loaded_module_t));
+		num_modules--;
+	}
+	dr_rwlock_write_unlock(modules_lock);
+
+}
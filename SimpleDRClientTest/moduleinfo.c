@@ -3,24 +3,482 @@
 #include <stdlib.h>
 #include <string.h>
 #include "include/defines.h"
+#include "include/module_registry.h"
+#include "include/writer.h"
+#include "include/atomics.h"
 
 
-/* private functions */
+/* bb storage -
+the bbs of a module live in chunks which double in size (BB_FIRST_CHUNK, BB_FIRST_CHUNK,
+2 * BB_FIRST_CHUNK, ...), so a module costs a small first chunk and position -> chunk is a few bit
+operations. Chunks are carved out of a process wide arena and are never moved or freed on their own;
+pointers to bbinfo_t (baked into the instrumentation) stay valid until the last list is deleted,
+which releases the whole arena */
+
+#define BB_ARENA_BLOCK_SIZE	(64 * 1024)
+
+typedef struct _arena_block_t {
+	struct _arena_block_t * next;
+	size_t size;
+	size_t used;
+} arena_block_t;
+
+static arena_block_t * bb_arena = NULL;
+static uint live_lists = 0;
+static void * arena_mutex = NULL;
+static void * map_mutex = NULL;		/* serializes materialize and build_ranges */
+
+static void * arena_alloc(size_t size){
+
+	arena_block_t * block;
+	size_t block_size;
+	void * mem;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	dr_mutex_lock(arena_mutex);
+	if (bb_arena == NULL || bb_arena->size - bb_arena->used < size){
+		block_size = sizeof(arena_block_t) + size;
+		if (block_size < BB_ARENA_BLOCK_SIZE){
+			block_size = BB_ARENA_BLOCK_SIZE;
+		}
+		block = (arena_block_t *)dr_global_alloc(block_size);
+		block->size = block_size;
+		block->used = sizeof(arena_block_t);
+		block->next = bb_arena;
+		bb_arena = block;
+	}
+	mem = (char *)bb_arena + bb_arena->used;
+	bb_arena->used += size;
+	dr_mutex_unlock(arena_mutex);
+
+	return mem;
+
+}
+
+static void arena_release(){
+
+	arena_block_t * block;
+
+	while (bb_arena != NULL){
+		block = bb_arena;
+		bb_arena = block->next;
+		dr_global_free(block, block->size);
+	}
+	dr_mutex_destroy(arena_mutex);
+	arena_mutex = NULL;
+	dr_mutex_destroy(map_mutex);
+	map_mutex = NULL;
+
+}
+
+/* binary format -
+all fields are uints unless noted and all offsets are from the start of the file
+	header		bin_header_t
+	modules		one bin_module_t per module
+	strings		module names, '\0' terminated
+	per module	the bb offsets in ascending order, then with BIN_HAS_INFO one bin_bb_t per bb in the
+				same order followed by the edges (edge_t) of the bbs - from_bbs, to_bbs, called_from
+				and called_to of the first bb, then of the next bb, ...
+nothing is parsed when a binary file is loaded; the offsets are already sorted, so the lists are
+filled straight from the mapped arrays and come out sorted. A list whose bbs were not added in
+ascending order (range filters pair consecutive entries) has BIN_ADD_ORDER set and, without bb
+records, each module's sorted offsets followed by the same offsets in the add order
+a snapshot log is a sequence of such files (with bb records), each padded to SNAPSHOT_ALIGN, which
+hold only the bbs and edges counted since the snapshot before */
+
+#define BIN_MAGIC		0x42425244		/* "DRBB" */
+#define BIN_VERSION		1
+#define BIN_HAS_INFO	0x1				/* bin_bb_t records and edges follow the offsets */
+#define BIN_ADD_ORDER	0x2				/* the offsets in the add order follow the sorted ones - not with BIN_HAS_INFO */
+#define BIN_EDGE_LISTS	4
+
+#define SNAPSHOT_ALIGN(size)	(((size) + 7) & ~7u)	/* start of the next snapshot in a log */
+
+typedef struct _bin_header_t {
+	uint magic;
+	uint version;
+	uint flags;
+	uint num_modules;
+	uint strings_offset;
+	uint strings_size;
+	uint file_size;
+	uint reserved;
+} bin_header_t;
+
+typedef struct _bin_module_t {
+	uint64 start_addr;
+	uint name_offset;		/* into the string table */
+	uint num_bbs;
+	uint bbs_offset;
+	uint info_offset;		/* 0 without BIN_HAS_INFO */
+	uint edges_offset;
+	uint num_edges;
+} bin_module_t;
+
+typedef struct _bin_bb_t {
+	uint func_addr;
+	uint size;
+	uint freq;
+	uint is_call;
+	uint is_ret;
+	uint is_call_target;
+	uint num_edges[BIN_EDGE_LISTS];	/* from_bbs, to_bbs, called_from, called_to */
+} bin_bb_t;
+
+/* chunk holding position pos and the position's index in it */
+static uint chunk_of(uint pos, uint * index){
+
+	uint chunk = 0;
+	uint first = pos / BB_FIRST_CHUNK;
+
+	if (first == 0){
+		*index = pos;
+		return 0;
+	}
+
+	while ((first >> chunk) > 1){
+		chunk++;
+	}
+	*index = pos - (BB_FIRST_CHUNK << chunk);
+	return chunk + 1;
+
+}
+
+static uint chunk_size(uint chunk){
+	return (chunk == 0) ? BB_FIRST_CHUNK : (BB_FIRST_CHUNK << (chunk - 1));
+}
+
+static bbinfo_t * bb_at(module_t * module, uint pos){
+
+	uint index;
+	uint chunk = chunk_of(pos, &index);
+
+	return &module->bb_chunks[chunk][index];
+
+}
+
+/* the index is kept at most half full */
+static uint index_bits_for(uint list_length){
+
+	uint bits = 4;
+
+	while ((1u << bits) < 2 * list_length){
+		bits++;
+	}
+	return bits;
+
+}
+
+/* concurrent readers -
+lookups (md_lookup_module_id, md_lookup_bb, md_contains_bb, md_get_bb_count, md_get_bb) take no
+lock and may run while one writer adds modules or bbs; writers to the same list are serialized by
+the caller. Everything is published after it is complete: a bb is filled in before its index slot
+is written and before num_bbs counts it, and a module before it is linked in. The publishing store
+comes after a RELEASE_BARRIER and the readers put an ACQUIRE_BARRIER after the load that finds the
+object (atomics.h), so the order does not depend on how the compiler treats volatile. A grown index
+is built on the side and swapped in; the old one stays readable until the list is deleted (the
+retired indexes add up to less than the live one). Sorting and printing are writer side */
+
+typedef struct _bb_index_t {
+	struct _bb_index_t * retired;	/* the index this one replaced */
+	uint bits;						/* 1 << bits slots */
+	volatile uint slots[1];			/* positions + 1 (0 - empty slot); linear probing */
+} bb_index_t;
+
+static bb_index_t * index_alloc(uint bits){
+
+	bb_index_t * index = (bb_index_t *)dr_global_alloc(sizeof(bb_index_t) + (sizeof(uint) << bits));
+
+	index->retired = NULL;
+	index->bits = bits;
+	memset((void *)index->slots, 0, sizeof(uint) << bits);
+	return index;
+
+}
+
+/* frees the index and the ones it replaced */
+static void index_free(bb_index_t * index){
+
+	bb_index_t * retired;
+
+	while (index != NULL){
+		retired = index->retired;
+		dr_global_free(index, sizeof(bb_index_t) + (sizeof(uint) << index->bits));
+		index = retired;
+	}
+
+}
+
+/* fibonacci hashing - block offsets share their low bits */
+static uint index_slot(bb_index_t * index, uint addr){
+	return (addr * 2654435761u) >> (32 - index->bits);
+}
+
+/* records position pos in the index (slots hold pos + 1); the first bb added with an address is the one found */
+static void index_insert(module_t * module, bb_index_t * index, uint pos){
+
+	uint mask = (1u << index->bits) - 1;
+	uint addr = bb_at(module, pos)->start_addr;
+	uint slot;
+
+	for (slot = index_slot(index, addr); index->slots[slot] != 0; slot = (slot + 1) & mask){
+		if (bb_at(module, index->slots[slot] - 1)->start_addr == addr){
+			return;
+		}
+	}
+	RELEASE_BARRIER();
+	index->slots[slot] = pos + 1;
+
+}
+
+/* builds an index of 1 << bits slots over the current bbs and swaps it in */
+static void index_replace(module_t * module, uint bits){
+
+	bb_index_t * index = index_alloc(bits);
+	uint i;
+
+	for (i = 0; i < module->num_bbs; i++){
+		index_insert(module, index, i);
+	}
+	index->retired = module->bb_index;
+	RELEASE_BARRIER();
+	module->bb_index = index;
+
+}
+
+/* bloom filters -
+filter lists are mostly asked about blocks they do not hold, so modules read from a file with at
+least BLOOM_MIN_BBS bbs get a bloom filter of BLOOM_BITS_PER_BB bits per bb; a miss then costs two
+bit tests instead of an index probe (or a binary search over a mapped file). Bbs added later set
+their bits before they are counted, like the index slots, and a filter which would go over capacity
+is rebuilt twice as large on the side and swapped in; the replaced ones stay readable until the list
+is deleted */
+
+typedef struct _bb_bloom_t {
+	struct _bb_bloom_t * retired;	/* the filter this one replaced */
+	uint bits;						/* 1 << bits bits */
+	uint capacity;					/* bbs it is sized for */
+	volatile uint words[1];
+} bb_bloom_t;
+
+static bb_bloom_t * bloom_alloc(uint bits){
+
+	bb_bloom_t * bloom = (bb_bloom_t *)dr_global_alloc(sizeof(bb_bloom_t) + (sizeof(uint) << (bits - 5)));
+
+	bloom->retired = NULL;
+	bloom->bits = bits;
+	bloom->capacity = (1u << bits) / BLOOM_BITS_PER_BB;
+	memset((void *)bloom->words, 0, sizeof(uint) << (bits - 5));
+	return bloom;
+
+}
+
+static void bloom_free(bb_bloom_t * bloom){
+
+	bb_bloom_t * retired;
+
+	while (bloom != NULL){
+		retired = bloom->retired;
+		dr_global_free(bloom, sizeof(bb_bloom_t) + (sizeof(uint) << (bloom->bits - 5)));
+		bloom = retired;
+	}
+
+}
+
+/* the two probes - fibonacci hashing as for the index, and a second multiplier over the offset with
+   its high bits folded in */
+#define BLOOM_PROBE1(bloom, addr)	(((addr) * 2654435761u) >> (32 - (bloom)->bits))
+#define BLOOM_PROBE2(bloom, addr)	((((addr) ^ ((addr) >> 15)) * 0x2c1b3c6du) >> (32 - (bloom)->bits))
+
+static void bloom_set(bb_bloom_t * bloom, uint addr){
+
+	uint bit1 = BLOOM_PROBE1(bloom, addr);
+	uint bit2 = BLOOM_PROBE2(bloom, addr);
+
+	bloom->words[bit1 >> 5] |= 1u << (bit1 & 31);
+	bloom->words[bit2 >> 5] |= 1u << (bit2 & 31);
+
+}
+
+static bool bloom_test(bb_bloom_t * bloom, uint addr){
+
+	uint bit1 = BLOOM_PROBE1(bloom, addr);
+	uint bit2 = BLOOM_PROBE2(bloom, addr);
+
+	return (bloom->words[bit1 >> 5] & (1u << (bit1 & 31))) &&
+		(bloom->words[bit2 >> 5] & (1u << (bit2 & 31)));
+
+}
+
+/* builds a filter for at least count bbs over the current bbs (mapped or not) and swaps it in */
+static void bloom_replace(module_t * module, uint count){
+
+	bb_bloom_t * bloom;
+	uint bits = 6;
+	uint i;
+
+	while ((1u << bits) < count * BLOOM_BITS_PER_BB && bits < 31){
+		bits++;
+	}
+	bloom = bloom_alloc(bits);
+	for (i = 0; i < md_get_bb_count(module); i++){
+		bloom_set(bloom, md_get_bb_addr(module, i));
+	}
+	bloom->retired = module->bloom;
+	RELEASE_BARRIER();
+	module->bloom = bloom;
+
+}
+
+/* the modules read from a file, from first on */
+static void bloom_modules(module_t * first){
+
+	for (; first != NULL; first = first->next){
+		if (md_get_bb_count(first) >= BLOOM_MIN_BBS){
+			bloom_replace(first, md_get_bb_count(first));
+		}
+	}
+
+}
+
+/* module name matching -
+filter files name modules either by full path or by a prefix pattern (everything before the first
+'*'), and the first module of the list that matches a name wins. The patterns are compiled once,
+when a module is linked in: plain names go to a table indexed by interned name id and prefix
+patterns to a character trie, so a lookup is one table read plus a walk over at most strlen(name)
+trie nodes instead of a string compare against every module of the list. Every node keeps the
+earliest module whose pattern ends there and the lookup keeps the lowest list position among the
+candidates. Nodes are prepended and published like the modules, so lookups stay lock-free */
+
+typedef struct _pattern_node_t {
+	struct _pattern_node_t * volatile children;
+	struct _pattern_node_t * volatile sibling;
+	module_t * volatile module;		/* first module whose pattern ends here - NULL if none */
+	char c;
+} pattern_node_t;
+
+static pattern_node_t * new_pattern_node(char c){
+
+	pattern_node_t * node = (pattern_node_t *)arena_alloc(sizeof(pattern_node_t));
+
+	node->children = NULL;
+	node->sibling = NULL;
+	node->module = NULL;
+	node->c = c;
+	return node;
+
+}
+
+static void compile_module(module_t * head, module_t * elem){
+
+	pattern_node_t * node;
+	pattern_node_t * child;
+	int i;
+
+	/* elem and every new node are complete before they can be reached */
+	RELEASE_BARRIER();
+	if (elem->prefix_length < 0){
+		if (head->by_name[elem->name_id] == NULL){
+			head->by_name[elem->name_id] = elem;
+		}
+		return;
+	}
+
+	if (head->patterns == NULL){
+		child = new_pattern_node('\0');
+		RELEASE_BARRIER();
+		head->patterns = child;
+	}
+	node = head->patterns;
+	for (i = 0; i < elem->prefix_length; i++){
+		for (child = node->children; child != NULL && child->c != elem->module[i]; child = child->sibling);
+		if (child == NULL){
+			child = new_pattern_node(elem->module[i]);
+			child->sibling = node->children;
+			RELEASE_BARRIER();
+			node->children = child;
+		}
+		node = child;
+	}
+	if (node->module == NULL){
+		node->module = elem;
+	}
+
+}
+
+/* exact - the module named exactly name (by_name), if any */
+static module_t * match_module(module_t * head, const char * name, module_t * exact){
+
+	pattern_node_t * node = head->patterns;
+	module_t * best = exact;
+	module_t * candidate;
+
+	ACQUIRE_BARRIER();
+	while (node != NULL){
+		candidate = node->module;
+		if (candidate != NULL && (best == NULL || candidate->position < best->position)){
+			best = candidate;
+		}
+		if (*name == '\0'){
+			break;
+		}
+		for (node = node->children; node != NULL && node->c != *name; node = node->sibling){
+			ACQUIRE_BARRIER();
+		}
+		ACQUIRE_BARRIER();
+		name++;
+	}
+
+	return best;
+
+}
+
+/* links a complete module after tail - negative lookups cached before this are dropped */
+static void publish_module(module_t * head, module_t * tail, module_t * elem){
+
+	elem->position = tail->position + 1;
+	compile_module(head, elem);
+	RELEASE_BARRIER();
+	tail->next = elem;
+	/* a lookup which read the old generation may have missed the module */
+	RELEASE_BARRIER();
+	head->list_gen++;
+
+}
 
 /* gets a new element */
-static module_t * new_elem (char * name,
-							unsigned int list_length){
+static module_t * new_elem (const char * name,
+							unsigned int expected_bbs){
 
 	module_t * elem = (module_t *)dr_global_alloc(sizeof(module_t));
+	char * asterix;
 
 	elem->module = (char *)dr_global_alloc(sizeof(char)*MAX_STRING_LENGTH);
 	strncpy(elem->module,name,MAX_STRING_LENGTH);
 
-	elem->bbs = (bbinfo_t *)dr_global_alloc(sizeof(bbinfo_t)*list_length);
-	elem->bbs[0].start_addr = 0;    // this is there for storing the length
+	elem->num_bbs = 0;
+	memset(elem->bb_chunks, 0, sizeof(elem->bb_chunks));
+	elem->sorted_bbs = NULL;
 
-	elem->size_bbs = list_length;
 	elem->next = NULL;
+	elem->name_id = module_registry_intern(elem->module);
+	asterix = strchr(elem->module, '*');
+	elem->prefix_length = (asterix != NULL) ? (int)(asterix - elem->module) : -1;
+	elem->position = 0;
+	elem->id_cache = NULL;
+	elem->by_name = NULL;
+	elem->patterns = NULL;
+	elem->mapped_bbs = NULL;
+	elem->mapped_order = NULL;
+	elem->num_mapped = 0;
+	elem->ranges = NULL;
+	elem->map = NULL;
+	elem->map_size = 0;
+
+	elem->list_gen = 0;
+	elem->bb_index = index_alloc(index_bits_for(expected_bbs));
+	elem->bloom = NULL;
 
 	return elem;
 
@@ -36,49 +494,204 @@ static module_t * get_tail (module_t * head){
 	return tail;
 }
 
-/* adds an address to the linear list with addresses */
-static bbinfo_t * add_bb_to_list (bbinfo_t * bb_list, unsigned int addr, bool extra_info, uint size){
+/* appends an address to the bbs of the module */
+static bbinfo_t * add_bb_to_list (module_t * module, unsigned int addr, bool extra_info){
 
-	DR_ASSERT(size > bb_list[0].start_addr);
+	bbinfo_t * bb;
+	uint index;
+	uint chunk = chunk_of(module->num_bbs, &index);
 
+	DR_ASSERT_MSG(chunk < MAX_BB_CHUNKS, "too many bbs in a module");
+
+	if (module->bb_chunks[chunk] == NULL){
+		module->bb_chunks[chunk] = (bbinfo_t *)arena_alloc(sizeof(bbinfo_t) * chunk_size(chunk));
+	}
+	bb = &module->bb_chunks[chunk][index];
 
-	bb_list[0].start_addr++;  //first element of the start address will have the length
-	bb_list[bb_list[0].start_addr].start_addr = addr;
-	bb_list[bb_list[0].start_addr].freq = 0;
-	bb_list[bb_list[0].start_addr].printable = true;
+	bb->start_addr = addr;
+	bb->freq = 0;
+	bb->printable = true;
 
 	if(extra_info){
-		//initialize from and to bbs
-		bb_list[bb_list[0].start_addr].from_bbs = (call_bb_info_t *)dr_global_alloc(sizeof(call_bb_info_t)*MAX_TARGETS);
-		bb_list[bb_list[0].start_addr].from_bbs[0].start_addr = 0;
+		//initialize the edge lists - nothing is allocated until a list overflows
+		memset(&bb->from_bbs, 0, sizeof(edge_list_t));
+		memset(&bb->to_bbs, 0, sizeof(edge_list_t));
+		memset(&bb->called_from, 0, sizeof(edge_list_t));
+		memset(&bb->called_to, 0, sizeof(edge_list_t));
 
-		bb_list[bb_list[0].start_addr].to_bbs = (call_bb_info_t *)dr_global_alloc(sizeof(call_bb_info_t)*MAX_TARGETS);
-		bb_list[bb_list[0].start_addr].to_bbs[0].start_addr = 0;
+		bb->func = NULL;
+		bb->func_addr = 0;
 
-		//initialize call target
-		bb_list[bb_list[0].start_addr].called_from = (call_target_info_t *)dr_global_alloc(sizeof(call_target_info_t)*MAX_TARGETS);
-		bb_list[bb_list[0].start_addr].called_from[0].bb_addr = 0;
+	}
+
+	/* doubles the index once it would be more than half full */
+	if (2 * (module->num_bbs + 1) > (1u << module->bb_index->bits)){
+		index_replace(module, module->bb_index->bits + 1);
+	}
+	index_insert(module, module->bb_index, module->num_bbs);
+	if (module->bloom != NULL){
+		if (module->num_bbs + 1 > module->bloom->capacity){
+			bloom_replace(module, 2 * module->bloom->capacity);
+		}
+		bloom_set(module->bloom, addr);
+	}
+	RELEASE_BARRIER();
+	module->num_bbs++;
+
+	return bb;
+
+}
 
-		//initialize called tos
-		bb_list[bb_list[0].start_addr].called_to = (call_target_info_t *)dr_global_alloc(sizeof(call_target_info_t)*MAX_TARGETS);
-		bb_list[bb_list[0].start_addr].called_to[0].bb_addr = 0;
 
-		bb_list[bb_list[0].start_addr].func = NULL;
-		bb_list[bb_list[0].start_addr].func_addr = 0;
+static void set_sorted_in_add_order(module_t * module);
+static void sort_module(module_t * module);
 
+/* bbs of a module loaded from a binary file stay in the mapped file (only md_contains_bb,
+   md_get_bb_addr and md_get_bb_count read them) until bbinfo_t records are asked for */
+static void materialize(module_t * module){
+
+	uint i;
+
+	if (module->mapped_bbs == NULL){
+		/* the records built by materialize are complete */
+		ACQUIRE_BARRIER();
+		return;
 	}
 
-	return &bb_list[bb_list[0].start_addr];
+	dr_mutex_lock(map_mutex);
+	if (module->mapped_bbs != NULL){
+		index_replace(module, index_bits_for(module->num_mapped));
+		if (module->mapped_order != NULL){
+			for (i = 0; i < module->num_mapped; i++){
+				add_bb_to_list(module, module->mapped_order[i], false);
+			}
+			sort_module(module);
+		}
+		else{
+			for (i = 0; i < module->num_mapped; i++){
+				add_bb_to_list(module, module->mapped_bbs[i], false);
+			}
+			set_sorted_in_add_order(module);
+		}
+		/* the records are complete before other threads stop reading the mapped file */
+		RELEASE_BARRIER();
+		module->mapped_bbs = NULL;
+	}
+	dr_mutex_unlock(map_mutex);
+
+}
+
+/* edge lists -
+most bbs have one or two predecessors / successors, so the first EDGE_INLINE edges are kept in the
+list itself. Overflow arrays come from the bb arena and double when full; the old array is left in
+the arena (at most as much as the live arrays). Callers serialize updates to the same list */
+
+uint md_get_edge_count(edge_list_t * list){
+	return list->count;
+}
+
+edge_t * md_get_edge(edge_list_t * list, uint index){
+
+	DR_ASSERT(index < list->count);
+
+	if (index < EDGE_INLINE){
+		return &list->first[index];
+	}
+	return &list->more[index - EDGE_INLINE];
+
+}
+
+/* appends without looking for the address */
+static edge_t * append_edge(edge_list_t * list, uint addr, uint call_point_addr, uint freq){
+
+	uint capacity;
+	edge_t * edge;
+	edge_t * more;
+
+	if (list->count >= EDGE_INLINE && list->count - EDGE_INLINE == list->capacity){
+		capacity = list->capacity == 0 ? EDGE_FIRST_OVERFLOW : 2 * list->capacity;
+		more = (edge_t *)arena_alloc(sizeof(edge_t) * capacity);
+		if (list->capacity != 0){
+			memcpy(more, list->more, sizeof(edge_t) * list->capacity);
+		}
+		list->more = more;
+		list->capacity = capacity;
+	}
+
+	list->count++;
+	edge = md_get_edge(list, list->count - 1);
+	edge->addr = addr;
+	edge->call_point_addr = call_point_addr;
+	edge->freq = freq;
+
+	return edge;
 
 }
 
+edge_t * md_record_edge(edge_list_t * list, uint addr, uint call_point_addr){
+
+	uint i;
+	edge_t * edge;
+
+	for (i = 0; i < list->count; i++){
+		edge = md_get_edge(list, i);
+		if (edge->addr == addr){
+			edge->freq++;
+			return edge;
+		}
+	}
+
+	return append_edge(list, addr, call_point_addr, 1);
+
+}
+
+
+/* sorting -
+LSD radix sort on the 32 bit offsets, a byte per pass; passes where every key has the same byte
+are skipped, so small modules (offsets sharing the high bytes) take one or two passes. The sort is
+stable, so bbs with the same offset keep their add order */
+
+typedef struct _sort_item_t {
+	uint key;
+	uint value;			/* end of the range for build_ranges */
+	bbinfo_t * bb;
+} sort_item_t;
+
+/* sorts count items; tmp has room for count items. Returns the array holding the result */
+static sort_item_t * radix_sort(sort_item_t * items, sort_item_t * tmp, uint count){
 
-/* compare function for qsort */
-static int compare_func (const void * a, const void * b){
+	uint counts[256];
+	uint shift;
+	uint i;
+	uint sum;
+	uint digit;
+	sort_item_t * swap;
 
-	bbinfo_t * a_bb = (bbinfo_t *)a;
-	bbinfo_t * b_bb = (bbinfo_t *)b;
-	return (a_bb->start_addr - b_bb->start_addr);
+	for (shift = 0; shift < 32; shift += 8){
+
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < count; i++){
+			counts[(items[i].key >> shift) & 0xff]++;
+		}
+		if (count == 0 || counts[(items[0].key >> shift) & 0xff] == count){
+			continue;
+		}
+
+		for (i = 0, sum = 0; i < 256; i++){
+			digit = counts[i];
+			counts[i] = sum;
+			sum += digit;
+		}
+		for (i = 0; i < count; i++){
+			tmp[counts[(items[i].key >> shift) & 0xff]++] = items[i];
+		}
+
+		swap = items;
+		items = tmp;
+		tmp = swap;
+	}
+
+	return items;
 
 }
 
@@ -109,85 +722,82 @@ void getFinalName(char * buf){
 
 /* intial node - dummy node to initialize the data structure */
 module_t * md_initialize(){
-	return new_elem("__init",100);
-}
-
 
-int internal_compare_prefix(char * prefix, char * name){
+	module_t * head = new_elem("__init",0);
 
-	int i = 0;
-
-	while (prefix[i] != '*'){
-		if ( (prefix[i] != name[i]) || (name[i] == '\0') /* prefix is longer */ ){
-			return 1;
-		}
-		i++;
+	if (live_lists++ == 0){
+		arena_mutex = dr_mutex_create();
+		map_mutex = dr_mutex_create();
 	}
-	return 0;
 
-}
+	head->id_cache = (ptr_uint_t *)dr_global_alloc(sizeof(ptr_uint_t) * MAX_MODULE_NAMES);
+	memset(head->id_cache, 0, sizeof(ptr_uint_t) * MAX_MODULE_NAMES);
+	head->by_name = (module_t **)dr_global_alloc(sizeof(module_t *) * MAX_MODULE_NAMES);
+	memset(head->by_name, 0, sizeof(module_t *) * MAX_MODULE_NAMES);
 
-bool internal_is_prefix(char * string){
-	/* asterix included means that this is a prefix */
-	char * asterix = strchr(string, '*');
-	return (asterix != NULL);
+	return head;
 
 }
 
-/* looks up the linked list using name and returns the node with matching name*/
-module_t * md_lookup_module (module_t * head,char * name){
 
-	while(head!=NULL){
+/* looks up the linked list using name and returns the first module matching the name */
+module_t * md_lookup_module (module_t * head, const char * name){
 
-		if (internal_is_prefix(head->module)){
-			if (internal_compare_prefix(head->module, name) == 0){
-				return head;
-			}
-		}
-		else{
-			if (strcmp(name, head->module) == 0){
-				return head;
-			}
-		}
-		head = head->next;
+	uint name_id;
+	module_t * exact = NULL;
+
+	/* every module name is interned when the module is created, so a name the registry does not
+	   know cannot match a module exactly */
+	if (module_registry_find(name, &name_id)){
+		exact = head->by_name[name_id];
 	}
-	return NULL;
+	return match_module(head, name, exact);
 
 }
 
-/* gets the module position with respect to the module head */
-int md_get_module_position(module_t * head, char * name){
+/* cache entries - 0 (not looked up), the module, or (generation << 1) | 1 for 'not in the list'.
+   Modules are only appended, so a found module stays valid; 'not in the list' only holds for the
+   generation it was looked up in. The generation is read before the walk, so a module published
+   meanwhile makes the entry stale rather than wrong */
+module_t * md_lookup_module_id (module_t * head, uint name_id){
 
-	int pos = 0;
+	ptr_uint_t entry = head->id_cache[name_id];
+	ptr_uint_t absent = ((ptr_uint_t)head->list_gen << 1) | 1;
+	module_t * module;
 
-	while (head != NULL){
+	/* the generation is read before anything the walk reads */
+	ACQUIRE_BARRIER();
 
-		if (internal_is_prefix(head->module)){
-			if (internal_compare_prefix(head->module, name) == 0){
-				return pos;
-			}
-		}
-		else{
-			if (strcmp(name, head->module) == 0){
-				return pos;
-			}
-		}
-		head = head->next;
-		pos++;
+	if (entry != 0 && (entry & 1) == 0){
+		return (module_t *)entry;
+	}
+	if (entry == absent){
+		return NULL;
 	}
 
-	return -1;
+	module = match_module(head, module_registry_name(name_id), head->by_name[name_id]);
+	head->id_cache[name_id] = (module != NULL) ? (ptr_uint_t)module : absent;
+
+	return module;
+
+}
+
+/* gets the module position with respect to the module head */
+int md_get_module_position(module_t * head, const char * name){
+
+	module_t * module = md_lookup_module(head, name);
+	return (module != NULL) ? (int)module->position : -1;
 
 }
 
 
-bool md_add_module(module_t * head, char * name, uint length_list_bbs){
+bool md_add_module(module_t * head, const char * name, uint expected_bbs){
 
 	module_t * tail;
 
 	if (md_lookup_module(head, name) == NULL){
 		tail = get_tail(head);
-		tail->next = new_elem(name, length_list_bbs);
+		publish_module(head, tail, new_elem(name, expected_bbs));
 		return true;
 	}
 
@@ -200,28 +810,169 @@ bool md_add_module(module_t * head, char * name, uint length_list_bbs){
 /* adds an element to the linked list*/
 /* important assumes that the head is not null - therefore, the user should initialize the head */
 bbinfo_t * md_add_bb_to_module(module_t * head,
-								char * name,
+								const char * name,
 								unsigned int addr,
-								unsigned int length_list_bbs,
+								unsigned int expected_bbs,
 								bool extra_info){
 
 	module_t * module = md_lookup_module(head,name);
 	module_t * new_module;
 	if(module != NULL){
-		return add_bb_to_list(module->bbs,addr,extra_info, module->size_bbs);
+		materialize(module);
+		return add_bb_to_list(module,addr,extra_info);
 	}
 	else{
 		module = get_tail (head);
-		new_module = new_elem(name,length_list_bbs);
-		module->next = new_module;
-		return add_bb_to_list(new_module->bbs,addr,extra_info,new_module->size_bbs);
+		new_module = new_elem(name,expected_bbs);
+		publish_module(head, module, new_module);
+		return add_bb_to_list(new_module,addr,extra_info);
+	}
+}
+
+/* ranges -
+range filters list each range as two consecutive bbs (start, end - both inclusive; an unpaired last
+start is ignored). On first use the pairs are sorted by start and overlapping or adjacent ranges
+merged, so a lookup is a binary search. The array is
+	[number of ranges][bbs it was built from][start, end]...
+in the arena; it is rebuilt (and swapped in) if bbs were added since, and lookups take no lock */
+
+static const uint * build_ranges(module_t * module){
+
+	const uint * ranges;
+	uint * merged;
+	sort_item_t * items;
+	sort_item_t * sorted;
+	uint count;
+	uint n = 0;
+	uint i;
+
+	dr_mutex_lock(map_mutex);
+
+	count = md_get_bb_count(module);
+	ranges = module->ranges;
+	if (ranges != NULL && ranges[1] == count){
+		dr_mutex_unlock(map_mutex);
+		return ranges;
+	}
+
+	items = (sort_item_t *)dr_global_alloc(sizeof(sort_item_t) * (count + 2));
+	for (i = 0; i + 1 < count; i += 2){
+		if (md_get_bb_addr(module, i) <= md_get_bb_addr(module, i + 1)){
+			items[n].key = md_get_bb_addr(module, i);
+			items[n].value = md_get_bb_addr(module, i + 1);
+			items[n++].bb = NULL;
+		}
+	}
+	sorted = radix_sort(items, items + n + 1, n);
+
+	merged = (uint *)arena_alloc(sizeof(uint) * (2 * n + 2));
+	merged[0] = 0;
+	merged[1] = count;
+	for (i = 0; i < n; i++){
+		/* overlaps (or touches) the last range */
+		if (merged[0] > 0 && (sorted[i].key <= merged[2 * merged[0] + 1] ||
+			sorted[i].key - 1 == merged[2 * merged[0] + 1])){
+			if (sorted[i].value > merged[2 * merged[0] + 1]){
+				merged[2 * merged[0] + 1] = sorted[i].value;
+			}
+			continue;
+		}
+		merged[2 * merged[0] + 2] = sorted[i].key;
+		merged[2 * merged[0] + 3] = sorted[i].value;
+		merged[0]++;
+	}
+
+	dr_global_free(items, sizeof(sort_item_t) * (count + 2));
+	RELEASE_BARRIER();
+	module->ranges = merged;
+
+	dr_mutex_unlock(map_mutex);
+
+	return merged;
+
+}
+
+bool md_in_range(module_t * module, unsigned int addr){
+
+	const uint * ranges = module->ranges;
+	uint low = 0;
+	uint high;
+	uint mid;
+
+	ACQUIRE_BARRIER();
+	if (ranges == NULL || ranges[1] != md_get_bb_count(module)){
+		ranges = build_ranges(module);
+	}
+
+	/* the first range starting after addr - addr can only be in the one before */
+	high = ranges[0];
+	while (low < high){
+		mid = (low + high) / 2;
+		if (ranges[2 * mid + 2] <= addr){
+			low = mid + 1;
+		}
+		else{
+			high = mid;
+		}
 	}
+
+	return (low > 0) && (addr <= ranges[2 * low + 1]);
+
 }
 
-/* sorts the elements stored in individual lists of the linked list */
+/* sorts the bbs added since the last sort of the module and merges them into the sorted list */
+static void sort_module(module_t * module){
+
+	uint old_count = (module->sorted_bbs != NULL) ? module->num_sorted : 0;
+	uint new_count = module->num_bbs - old_count;
+	sort_item_t * items;
+	sort_item_t * sorted;
+	bbinfo_t ** merged;
+	uint i, j, k;
+
+	if (module->sorted_bbs != NULL && new_count == 0){
+		return;
+	}
+
+	items = (sort_item_t *)dr_global_alloc(sizeof(sort_item_t) * 2 * (new_count + 1));
+	for (i = 0; i < new_count; i++){
+		items[i].bb = bb_at(module, old_count + i);
+		items[i].key = items[i].bb->start_addr;
+	}
+	sorted = radix_sort(items, items + new_count + 1, new_count);
+
+	/* on equal offsets the older bb comes first, as in a full sort */
+	merged = (bbinfo_t **)dr_global_alloc(sizeof(bbinfo_t *) * (module->num_bbs + 1));
+	for (i = 0, j = 0, k = 0; j < new_count; k++){
+		if (i < old_count && module->sorted_bbs[i]->start_addr <= sorted[j].key){
+			merged[k] = module->sorted_bbs[i++];
+		}
+		else{
+			merged[k] = sorted[j++].bb;
+		}
+	}
+	for (; i < old_count; i++, k++){
+		merged[k] = module->sorted_bbs[i];
+	}
+
+	if (module->sorted_bbs != NULL){
+		dr_global_free(module->sorted_bbs, sizeof(bbinfo_t *) * (module->num_sorted + 1));
+	}
+	module->sorted_bbs = merged;
+	module->num_sorted = module->num_bbs;
+
+	dr_global_free(items, sizeof(sort_item_t) * 2 * (new_count + 1));
+
+}
+
+/* sorts the elements stored in individual lists of the linked list - the bbs themselves do not
+   move; the sorted order is kept as a list of pointers used by md_get_sorted_bb. Only the bbs
+   added since the previous sort are sorted, so periodic dumps pay for the new bbs only */
 void md_sort_bb_list_in_module (module_t * head){
+
 	while(head != NULL){
-		qsort(&head->bbs[1],head->bbs[0].start_addr,sizeof(bbinfo_t),compare_func);
+		materialize(head);
+		sort_module(head);
 		head = head->next;
 	}
 }
@@ -230,48 +981,141 @@ void md_sort_bb_list_in_module (module_t * head){
 void md_delete_list (module_t * head, bool extra_info){
 
 	module_t * prev;
-	int i = 0;
-	int j= 0;
+
+	if (head != NULL && head->map != NULL){
+		dr_unmap_file(head->map, head->map_size);
+	}
 
 	while(head != NULL){
 		dr_global_free(head->module,sizeof(char)*MAX_STRING_LENGTH);
-		if(extra_info){
-			for(i=1;i<=head->bbs[0].start_addr;i++){
-				dr_global_free(head->bbs[i].from_bbs,sizeof(call_bb_info_t)*MAX_TARGETS);
-				dr_global_free(head->bbs[i].to_bbs,sizeof(call_bb_info_t)*MAX_TARGETS);
-				dr_global_free(head->bbs[i].called_from,sizeof(call_target_info_t)*MAX_TARGETS);
-				dr_global_free(head->bbs[i].called_to, sizeof(call_target_info_t)*MAX_TARGETS);
-			}
+		/* the chunks and the edge overflow arrays go back with the arena */
+		if (head->sorted_bbs != NULL){
+			dr_global_free(head->sorted_bbs, sizeof(bbinfo_t *) * (head->num_sorted + 1));
+		}
+		index_free(head->bb_index);
+		bloom_free(head->bloom);
+		if (head->id_cache != NULL){
+			dr_global_free(head->id_cache, sizeof(ptr_uint_t) * MAX_MODULE_NAMES);
+			dr_global_free(head->by_name, sizeof(module_t *) * MAX_MODULE_NAMES);
 		}
-		dr_global_free(head->bbs,sizeof(bbinfo_t)*head->size_bbs);
+		/* the pattern trie goes back with the arena */
 		prev = head;
 		head = head->next;
 		dr_global_free(prev,sizeof(module_t));
 	}
 
+	if (--live_lists == 0){
+		arena_release();
+	}
+
 }
 
 
-/* assumes a sorted list - does a binary search on it */
-bbinfo_t* md_lookup_bb_in_module(module_t * head, char * name, unsigned int addr){
+/* hash index lookup - the order of the list does not matter */
+bbinfo_t * md_lookup_bb(module_t * module, unsigned int addr){
 
-	module_t * module = md_lookup_module(head,name);
-	bbinfo_t * list;
-	unsigned int size;
-	int i;
+	bb_index_t * index;
+	uint mask;
+	uint slot;
+	uint pos;
 
+	materialize(module);
 
-	if(module != NULL){
-		list = module->bbs;
-		size = list[0].start_addr;
+	/* one index for the whole lookup - a concurrent grow swaps in a new one */
+	index = module->bb_index;
+	ACQUIRE_BARRIER();
+	mask = (1u << index->bits) - 1;
+	for (slot = index_slot(index, addr); (pos = index->slots[slot]) != 0; slot = (slot + 1) & mask){
+		ACQUIRE_BARRIER();
+		if (bb_at(module, pos - 1)->start_addr == addr){
+			return bb_at(module, pos - 1);
+		}
+	}
+	return NULL;
 
-		for(i=1;i<=size;i++){
-			if(addr == list[i].start_addr){
-				return &list[i];
-			}
+}
+
+/* bloom filter first, then a binary search in the mapped file while the module is not materialized */
+bool md_contains_bb(module_t * module, unsigned int addr){
 
+	bb_bloom_t * bloom = module->bloom;
+	const uint * mapped = module->mapped_bbs;
+	uint low = 0;
+	uint high = module->num_mapped;
+	uint mid;
+
+	ACQUIRE_BARRIER();
+	if (bloom != NULL && !bloom_test(bloom, addr)){
+		return false;
+	}
+
+	if (mapped == NULL){
+		return md_lookup_bb(module, addr) != NULL;
+	}
+
+	while (low < high){
+		mid = (low + high) / 2;
+		if (mapped[mid] < addr){
+			low = mid + 1;
 		}
+		else{
+			high = mid;
+		}
+	}
+	return (low < module->num_mapped) && (mapped[low] == addr);
+
+}
+
+uint md_get_bb_count(module_t * module){
+
+	uint count = (module->mapped_bbs != NULL) ? module->num_mapped : module->num_bbs;
+
+	/* the bbs counted are complete */
+	ACQUIRE_BARRIER();
+	return count;
+
+}
+
+/* index in the order the bbs were added - 0 .. md_get_bb_count - 1 */
+bbinfo_t * md_get_bb(module_t * module, uint index){
+
+	materialize(module);
+	DR_ASSERT(index < module->num_bbs);
+	return bb_at(module, index);
+
+}
+
+/* start address of md_get_bb(module, index) */
+uint md_get_bb_addr(module_t * module, uint index){
+
+	const uint * mapped = module->mapped_bbs;
+
+	ACQUIRE_BARRIER();
+	if (mapped != NULL){
+		DR_ASSERT(index < module->num_mapped);
+		return (module->mapped_order != NULL) ? module->mapped_order[index] : mapped[index];
+	}
+	return md_get_bb(module, index)->start_addr;
+
+}
+
+/* index in the order of md_sort_bb_list_in_module; the add order if the module was not sorted */
+bbinfo_t * md_get_sorted_bb(module_t * module, uint index){
+
+	materialize(module);
+	if (module->sorted_bbs == NULL || index >= module->num_sorted){
+		return md_get_bb(module, index);
+	}
+	return module->sorted_bbs[index];
+
+}
+
+bbinfo_t* md_lookup_bb_in_module(module_t * head, const char * name, unsigned int addr){
+
+	module_t * module = md_lookup_module(head,name);
 
+	if(module != NULL){
+		return md_lookup_bb(module, addr);
 	}
 	return NULL;
 
@@ -279,6 +1123,258 @@ bbinfo_t* md_lookup_bb_in_module(module_t * head, char * name, unsigned int addr
 
 
 /* file I/O */
+
+static edge_list_t * edge_list_of(bbinfo_t * bb, uint list){
+
+	switch (list){
+	case 0: return &bb->from_bbs;
+	case 1: return &bb->to_bbs;
+	case 2: return &bb->called_from;
+	default: return &bb->called_to;
+	}
+
+}
+
+/* the bbs were added in ascending order - the sorted order is the add order */
+static void set_sorted_in_add_order(module_t * module){
+
+	uint i;
+
+	if (module->sorted_bbs != NULL){
+		dr_global_free(module->sorted_bbs, sizeof(bbinfo_t *) * (module->num_sorted + 1));
+	}
+	module->num_sorted = module->num_bbs;
+	module->sorted_bbs = (bbinfo_t **)dr_global_alloc(sizeof(bbinfo_t *) * (module->num_sorted + 1));
+	for (i = 0; i < module->num_sorted; i++){
+		module->sorted_bbs[i] = bb_at(module, i);
+	}
+
+}
+
+static void check_bin_range(const bin_header_t * header, uint offset, uint64 size){
+	DR_ASSERT_MSG((uint64)offset + size <= header->file_size, "corrupt binary bb file");
+}
+
+static void check_bin_header(const char * map, size_t map_size){
+
+	const bin_header_t * header = (const bin_header_t *)map;
+
+	DR_ASSERT_MSG(header->version == BIN_VERSION, "unsupported binary bb file version");
+	DR_ASSERT_MSG(header->file_size <= map_size, "truncated binary bb file");
+	check_bin_range(header, sizeof(bin_header_t), (uint64)header->num_modules * sizeof(bin_module_t));
+	check_bin_range(header, header->strings_offset, header->strings_size);
+	DR_ASSERT_MSG(header->strings_size > 0 && map[header->strings_offset + header->strings_size - 1] == '\0',
+		"corrupt binary bb file");
+
+}
+
+/* without extra_info the modules point into the map, which is then kept by the head (true) */
+static bool read_binary(module_t * head, char * map, size_t map_size, bool extra_info){
+
+	bin_header_t * header = (bin_header_t *)map;
+	bin_module_t * module;
+	bin_bb_t * info;
+	edge_t * edge;
+	uint * offsets;
+	module_t * tail = get_tail(head);
+	module_t * elem;
+	uint * order;
+	bbinfo_t * bb;
+	bool has_info;
+	bool add_order;
+	uint i, j, k, e;
+
+	check_bin_header(map, map_size);
+
+	has_info = extra_info && (header->flags & BIN_HAS_INFO);
+	add_order = (header->flags & BIN_ADD_ORDER) != 0;
+	DR_ASSERT_MSG(!add_order || !(header->flags & BIN_HAS_INFO), "corrupt binary bb file");
+
+	for (i = 0; i < header->num_modules; i++){
+
+		module = (bin_module_t *)(map + sizeof(bin_header_t)) + i;
+		DR_ASSERT_MSG(module->name_offset < header->strings_size, "corrupt binary bb file");
+		check_bin_range(header, module->bbs_offset, (uint64)module->num_bbs * sizeof(uint) * (add_order ? 2 : 1));
+
+		offsets = (uint *)(map + module->bbs_offset);
+		for (j = 1; j < module->num_bbs; j++){
+			DR_ASSERT_MSG(offsets[j - 1] <= offsets[j], "binary bb file is not sorted");
+		}
+		order = add_order ? offsets + module->num_bbs : NULL;
+
+		elem = new_elem(map + header->strings_offset + module->name_offset, extra_info ? module->num_bbs : 0);
+		elem->start_addr = module->start_addr;
+		if (!extra_info){
+			elem->mapped_order = order;
+			elem->num_mapped = module->num_bbs;
+			elem->mapped_bbs = offsets;
+		}
+		publish_module(head, tail, elem);
+		tail = elem;
+
+		if (!extra_info){
+			continue;
+		}
+
+		info = NULL;
+		edge = NULL;
+		if (has_info){
+			check_bin_range(header, module->info_offset, (uint64)module->num_bbs * sizeof(bin_bb_t));
+			check_bin_range(header, module->edges_offset, (uint64)module->num_edges * sizeof(edge_t));
+			info = (bin_bb_t *)(map + module->info_offset);
+			edge = (edge_t *)(map + module->edges_offset);
+		}
+
+		for (j = 0; j < module->num_bbs; j++){
+			bb = add_bb_to_list(elem, (order != NULL) ? order[j] : offsets[j], extra_info);
+			if (info != NULL){
+				bb->func_addr = info[j].func_addr;
+				bb->size = info[j].size;
+				bb->freq = info[j].freq;
+				bb->is_call = info[j].is_call;
+				bb->is_ret = info[j].is_ret;
+				bb->is_call_target = info[j].is_call_target;
+				for (k = 0; k < BIN_EDGE_LISTS; k++){
+					for (e = 0; e < info[j].num_edges[k]; e++, edge++){
+						DR_ASSERT_MSG(edge < (edge_t *)(map + module->edges_offset) + module->num_edges,
+							"corrupt binary bb file");
+						append_edge(edge_list_of(bb, k), edge->addr, edge->call_point_addr, edge->freq);
+					}
+				}
+			}
+		}
+
+		if (order != NULL){
+			sort_module(elem);
+		}
+		else{
+			set_sorted_in_add_order(elem);
+		}
+
+	}
+
+	if (!extra_info){
+		DR_ASSERT_MSG(head->map == NULL, "a list can hold one mapped binary file");
+		head->map = map;
+		head->map_size = map_size;
+		return true;
+	}
+	return false;
+
+}
+
+/* adds the edge counts of a snapshot to the list */
+static void merge_edge(edge_list_t * list, edge_t * edge){
+
+	edge_t * own;
+	uint i;
+
+	for (i = 0; i < list->count; i++){
+		own = md_get_edge(list, i);
+		if (own->addr == edge->addr){
+			own->freq += edge->freq;
+			return;
+		}
+	}
+	append_edge(list, edge->addr, edge->call_point_addr, edge->freq);
+
+}
+
+/* adds one snapshot image (md_print_snapshot_to_writer) to the list - counts are added up, the bb
+   attributes are taken from the latest snapshot */
+static void merge_snapshot(module_t * head, char * map, size_t map_size){
+
+	bin_header_t * header = (bin_header_t *)map;
+	bin_module_t * image;
+	bin_bb_t * info;
+	edge_t * edge;
+	uint * offsets;
+	module_t * module;
+	bbinfo_t * bb;
+	const char * name;
+	uint i, j, k, e;
+
+	check_bin_header(map, map_size);
+	DR_ASSERT_MSG(header->flags & BIN_HAS_INFO, "snapshot without bb records");
+
+	for (i = 0; i < header->num_modules; i++){
+
+		image = (bin_module_t *)(map + sizeof(bin_header_t)) + i;
+		DR_ASSERT_MSG(image->name_offset < header->strings_size, "corrupt snapshot");
+		check_bin_range(header, image->bbs_offset, (uint64)image->num_bbs * sizeof(uint));
+		check_bin_range(header, image->info_offset, (uint64)image->num_bbs * sizeof(bin_bb_t));
+		check_bin_range(header, image->edges_offset, (uint64)image->num_edges * sizeof(edge_t));
+		offsets = (uint *)(map + image->bbs_offset);
+		info = (bin_bb_t *)(map + image->info_offset);
+		edge = (edge_t *)(map + image->edges_offset);
+
+		name = map + header->strings_offset + image->name_offset;
+		md_add_module(head, name, image->num_bbs);
+		module = md_lookup_module(head, name);
+		module->start_addr = image->start_addr;
+		materialize(module);
+
+		for (j = 0; j < image->num_bbs; j++){
+			bb = md_lookup_bb(module, offsets[j]);
+			if (bb == NULL){
+				bb = add_bb_to_list(module, offsets[j], true);
+			}
+			bb->freq += info[j].freq;
+			bb->func_addr = info[j].func_addr;
+			bb->size = info[j].size;
+			bb->is_call = info[j].is_call;
+			bb->is_ret = info[j].is_ret;
+			bb->is_call_target |= info[j].is_call_target;
+			for (k = 0; k < BIN_EDGE_LISTS; k++){
+				for (e = 0; e < info[j].num_edges[k]; e++, edge++){
+					DR_ASSERT_MSG(edge < (edge_t *)(map + image->edges_offset) + image->num_edges,
+						"corrupt snapshot");
+					merge_edge(edge_list_of(bb, k), edge);
+				}
+			}
+		}
+
+	}
+
+}
+
+uint md_read_snapshots_from_file (module_t * head, file_t file){
+
+	uint64 map_size;
+	size_t actual_size;
+	size_t pos = 0;
+	bin_header_t * header;
+	char * map = NULL;
+	uint snapshots = 0;
+
+	if (dr_file_size(file, &map_size) && map_size > 0){
+		actual_size = (size_t)map_size;
+		DR_ASSERT(actual_size == map_size);
+		map = (char *)dr_map_file(file, &actual_size, 0, NULL, DR_MEMPROT_READ, 0);
+		DR_ASSERT_MSG(map != NULL, "cannot map the snapshot log");
+	}
+	if (map == NULL){
+		return 0;
+	}
+
+	while (pos + sizeof(bin_header_t) <= actual_size){
+		header = (bin_header_t *)(map + pos);
+		DR_ASSERT_MSG(header->magic == BIN_MAGIC, "corrupt snapshot log");
+		/* the process may have died while a snapshot was written - the earlier ones still count */
+		if (header->file_size < sizeof(bin_header_t) || header->file_size > actual_size - pos){
+			dr_fprintf(STDERR, "incomplete snapshot at the end of the log - ignored\n");
+			break;
+		}
+		merge_snapshot(head, map + pos, header->file_size);
+		pos += SNAPSHOT_ALIGN(header->file_size);
+		snapshots++;
+	}
+
+	dr_unmap_file(map, actual_size);
+	return snapshots;
+
+}
+
 void md_read_from_file (module_t * head, file_t file, bool extra_info){
 
 	uint64 map_size;
@@ -299,6 +1395,8 @@ void md_read_from_file (module_t * head, file_t file, bool extra_info){
 
 	/* for filling up the linked list data structure */
 	module_t * elem;
+	module_t * list = head;
+	module_t * tail = get_tail(head);
 
 	ok = dr_file_size(file,&map_size);
 	if(ok){
@@ -306,6 +1404,15 @@ void md_read_from_file (module_t * head, file_t file, bool extra_info){
 		DR_ASSERT(actual_size == map_size);
 		map = dr_map_file(file, &actual_size, 0, NULL, DR_MEMPROT_READ, 0);
 	}
+	DR_ASSERT_MSG(map != NULL, "cannot map the bb file");
+
+	if (actual_size >= sizeof(bin_header_t) && ((bin_header_t *)map)->magic == BIN_MAGIC){
+		if (!read_binary(head, (char *)map, actual_size, extra_info)){
+			dr_unmap_file(map, actual_size);
+		}
+		bloom_modules(tail->next);
+		return;
+	}
 
 
 	dr_sscanf((char *)map,"%d\n",&no_modules);
@@ -331,7 +1438,7 @@ void md_read_from_file (module_t * head, file_t file, bool extra_info){
 
 		//create a new element
 		elem = new_elem(module_name,no_instructions+2);
-		head->next = elem;
+		publish_module(list, head, elem);
 		head = elem;
 
 		for(j=0;j<no_instructions;j++){
@@ -340,52 +1447,54 @@ void md_read_from_file (module_t * head, file_t file, bool extra_info){
 			line++; //start of the next line
 			dr_sscanf(line,"%u\n",&addr);
 			//dr_printf(line,"%x\n",addr); //debug
-			add_bb_to_list(head->bbs,addr, extra_info, head->size_bbs);
+			add_bb_to_list(head,addr, extra_info);
 		}
 
 	}
 
+	bloom_modules(tail->next);
+	dr_unmap_file(map, actual_size);
+
 }
 
-void print_bb_info(bbinfo_t * bb, file_t file, bool extra_info){
+/* <count>, addr, freq, ... */
+static void print_edges(edge_list_t * list, writer_t * writer){
+
+	uint i;
+	edge_t * edge;
 
-	int i = 0;
+	writer_printf(writer, "%u,", list->count);
+	for (i = 0; i < list->count; i++){
+		edge = md_get_edge(list, i);
+		writer_printf(writer, "%x,%u,", edge->addr, edge->freq);
+	}
+
+}
+
+void print_bb_info(bbinfo_t * bb, writer_t * writer, bool extra_info){
 
 	DR_ASSERT(bb != NULL);
 
 	if (!extra_info){
-		dr_fprintf(file, "%x\n", bb->start_addr);
+		writer_printf(writer, "%x\n", bb->start_addr);
 	}
 	else{
 		/*func, bb_addr, size, freq, is_call, is_ret, <from_bbs_count>, from_bb, freq, .., <caller_count>, caller, freq, ..., <to_bbs_count>, to_bbs, freq, ..., <callee_count>, callee, freq*/
 		if (bb->func != NULL){
-			dr_fprintf(file,"%x,", bb->func->start_addr);
+			writer_printf(writer,"%x,", bb->func->start_addr);
 		}
 		else{
-			dr_fprintf(file, "0,");
+			writer_printf(writer, "0,");
 		}
 
-		//dr_fprintf(file,"%x,",bb->func_addr);
-		dr_fprintf(file, "%x,%u,%u,", bb->start_addr, bb->size, bb->freq);
-		dr_fprintf(file, "%u,%u,%u,", bb->is_call, bb->is_ret, bb->is_call_target);
-		dr_fprintf(file, "%u,", bb->from_bbs[0].start_addr);
-
-		for (i = 1; i <= bb->from_bbs[0].start_addr; i++){
-			dr_fprintf(file, "%x,%u,", bb->from_bbs[i].start_addr, bb->from_bbs[i].freq);
-		}
-		dr_fprintf(file, "%u,", bb->to_bbs[0].start_addr);
-		for (i = 1; i <= bb->to_bbs[0].start_addr; i++){
-			dr_fprintf(file, "%x,%u,", bb->to_bbs[i].start_addr, bb->to_bbs[i].freq);
-		}
-		dr_fprintf(file, "%u,", bb->called_from[0].bb_addr);
-		for (i = 1; i <= bb->called_from[0].bb_addr; i++){
-			dr_fprintf(file, "%x,%u,", bb->called_from[i].bb_addr, bb->called_from[i].freq);
-		}
-		dr_fprintf(file, "%u,", bb->called_to[0].bb_addr);
-		for (i = 1; i <= bb->called_to[0].bb_addr; i++){
-			dr_fprintf(file, "%x,%u,", bb->called_to[i].bb_addr, bb->called_to[i].freq);
-		}
-		dr_fprintf(file, "\n");
+		//writer_printf(writer,"%x,",bb->func_addr);
+		writer_printf(writer, "%x,%u,%u,", bb->start_addr, bb->size, bb->freq);
+		writer_printf(writer, "%u,%u,%u,", bb->is_call, bb->is_ret, bb->is_call_target);
+		print_edges(&bb->from_bbs, writer);
+		print_edges(&bb->to_bbs, writer);
+		print_edges(&bb->called_from, writer);
+		print_edges(&bb->called_to, writer);
+		writer_printf(writer, "\n");
 	}
 
 }
@@ -409,6 +1518,7 @@ void md_print_to_file (module_t * head,file_t file, bool extra_info){
 	int limit;
 	module_t * module;
 	unsigned int number = 0;
+	writer_t * writer = writer_create(file, 0);
 
 	/*first get the number of modules to instrument*/
 	module = head->next;
@@ -416,20 +1526,250 @@ void md_print_to_file (module_t * head,file_t file, bool extra_info){
 		number++;
 		module = module->next;
 	}
-	dr_fprintf(file,"%u\n",number);
+	writer_printf(writer,"%u\n",number);
 
 	head = head->next;
 	while(head != NULL){
-		dr_fprintf(file,"%s\n",head->module);
-		dr_fprintf(file, "%x\n", head->start_addr);
-		limit = head->bbs[0].start_addr;
-		dr_fprintf(file,"%u\n",limit);
-		for(i=1;i<=limit;i++){
-			print_bb_info(&head->bbs[i], file, extra_info);
-			//dr_fprintf(file,"%u\n",head->bbs[i].start_addr);
+		materialize(head);
+		writer_printf(writer,"%s\n",head->module);
+		writer_printf(writer, "%x\n", head->start_addr);
+		limit = head->num_bbs;
+		writer_printf(writer,"%u\n",limit);
+		for(i=0;i<limit;i++){
+			print_bb_info(md_get_sorted_bb(head, i), writer, extra_info);
 		}
 		head = head->next;
 	}
 
+	writer_destroy(writer);
+
+}
+
+/* same protocol as md_read_from_file reads - addresses only */
+void md_print_filter_to_file (module_t * head, file_t file){
+
+	module_t * module;
+	uint number = 0;
+	uint i;
+	writer_t * writer = writer_create(file, 0);
+
+	for (module = head->next; module != NULL; module = module->next){
+		number++;
+	}
+	writer_printf(writer, "%u\n", number);
+
+	for (module = head->next; module != NULL; module = module->next){
+		writer_printf(writer, "%s\n", module->module);
+		writer_printf(writer, "%u\n", md_get_bb_count(module));
+		for (i = 0; i < md_get_bb_count(module); i++){
+			writer_printf(writer, "%u\n", md_get_bb_addr(module, i));
+		}
+	}
+
+	writer_destroy(writer);
+
+}
+
+bool md_file_is_binary (file_t file, bool * extra_info){
+
+	bin_header_t header;
+
+	if (dr_read_file(file, &header, sizeof(header)) != sizeof(header) || header.magic != BIN_MAGIC){
+		return false;
+	}
+	*extra_info = (header.flags & BIN_HAS_INFO) != 0;
+	return true;
+
+}
+
+/* a snapshot (delta) only carries the edges and bbs counted since the previous snapshot */
+static uint bb_edge_count(bbinfo_t * bb, uint list, bool delta){
+
+	edge_list_t * edges = edge_list_of(bb, list);
+	uint count = 0;
+	uint e;
+
+	if (!delta){
+		return md_get_edge_count(edges);
+	}
+	for (e = 0; e < md_get_edge_count(edges); e++){
+		count += (md_get_edge(edges, e)->freq != 0);
+	}
+	return count;
+
+}
+
+static bool bb_in_delta(bbinfo_t * bb){
+
+	uint k;
+
+	if (bb->freq != 0){
+		return true;
+	}
+	for (k = 0; k < BIN_EDGE_LISTS; k++){
+		if (bb_edge_count(bb, k, true) != 0){
+			return true;
+		}
+	}
+	return false;
+
+}
+
+/* delta - only what was counted since the last delta, and the counts are zeroed once written */
+static void print_binary(module_t * head, writer_t * writer, bool extra_info, bool delta){
+
+	bin_header_t header;
+	bin_module_t * modules;
+	module_t * module;
+	bbinfo_t * bb;
+	uint * offsets;
+	bin_bb_t * info;
+	edge_t * edges;
+	uint64 padding = 0;
+	uint offset;
+	uint i, j, k, e, n, m;
+	uint * picked;		/* positions in sorted_bbs of the bbs written */
+	edge_t * edge;
+	bool add_order = false;
+
+	md_sort_bb_list_in_module(head);
+
+	/* a filter list also keeps its add order when that is not the sorted order (range pairs) */
+	for (module = head->next; module != NULL && !extra_info && !delta; module = module->next){
+		for (j = 1; j < module->num_bbs && !add_order; j++){
+			add_order = bb_at(module, j - 1)->start_addr > bb_at(module, j)->start_addr;
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = BIN_MAGIC;
+	header.version = BIN_VERSION;
+	header.flags = extra_info ? BIN_HAS_INFO : (add_order ? BIN_ADD_ORDER : 0);
+	for (module = head->next; module != NULL; module = module->next){
+		header.num_modules++;
+		header.strings_size += strlen(module->module) + 1;
+	}
+	header.strings_offset = sizeof(bin_header_t) + header.num_modules * sizeof(bin_module_t);
+
+	/* lay out the per module arrays after the (aligned) string table */
+	modules = (bin_module_t *)dr_global_alloc(sizeof(bin_module_t) * (header.num_modules + 1));
+	offset = (header.strings_offset + header.strings_size + 3) & ~3u;
+	n = 0;
+	for (module = head->next, i = 0; module != NULL; module = module->next, i++){
+		modules[i].start_addr = module->start_addr;
+		modules[i].name_offset = n;
+		n += strlen(module->module) + 1;
+		modules[i].num_bbs = 0;
+		modules[i].num_edges = 0;
+		for (j = 0; j < module->num_sorted; j++){
+			if (!delta || bb_in_delta(module->sorted_bbs[j])){
+				modules[i].num_bbs++;
+				for (k = 0; k < BIN_EDGE_LISTS && extra_info; k++){
+					modules[i].num_edges += bb_edge_count(module->sorted_bbs[j], k, delta);
+				}
+			}
+		}
+		modules[i].bbs_offset = offset;
+		offset += modules[i].num_bbs * sizeof(uint) * (add_order ? 2 : 1);
+		modules[i].info_offset = 0;
+		modules[i].edges_offset = 0;
+		if (extra_info){
+			modules[i].info_offset = offset;
+			offset += modules[i].num_bbs * sizeof(bin_bb_t);
+			modules[i].edges_offset = offset;
+			offset += modules[i].num_edges * sizeof(edge_t);
+		}
+	}
+	header.file_size = offset;
+
+	writer_write(writer, &header, sizeof(header));
+	writer_write(writer, modules, sizeof(bin_module_t) * header.num_modules);
+	for (module = head->next; module != NULL; module = module->next){
+		writer_write(writer, module->module, strlen(module->module) + 1);
+	}
+	if (((header.strings_offset + header.strings_size) & 3) != 0){
+		writer_write(writer, &padding, 4 - ((header.strings_offset + header.strings_size) & 3));
+	}
+
+	for (module = head->next, i = 0; module != NULL; module = module->next, i++){
+
+		/* the bbs of the image - every sorted bb, or for a delta the ones counted since the last */
+		picked = (uint *)dr_global_alloc(sizeof(uint) * (modules[i].num_bbs + 1));
+		offsets = (uint *)dr_global_alloc(sizeof(uint) * (modules[i].num_bbs + 1));
+		for (j = 0, m = 0; j < module->num_sorted; j++){
+			if (!delta || bb_in_delta(module->sorted_bbs[j])){
+				picked[m] = j;
+				offsets[m++] = module->sorted_bbs[j]->start_addr;
+			}
+		}
+		writer_write(writer, offsets, sizeof(uint) * modules[i].num_bbs);
+		if (add_order){
+			for (j = 0; j < modules[i].num_bbs; j++){
+				offsets[j] = bb_at(module, j)->start_addr;
+			}
+			writer_write(writer, offsets, sizeof(uint) * modules[i].num_bbs);
+		}
+		dr_global_free(offsets, sizeof(uint) * (modules[i].num_bbs + 1));
+
+		if (!extra_info){
+			dr_global_free(picked, sizeof(uint) * (modules[i].num_bbs + 1));
+			continue;
+		}
+
+		info = (bin_bb_t *)dr_global_alloc(sizeof(bin_bb_t) * (modules[i].num_bbs + 1));
+		edges = (edge_t *)dr_global_alloc(sizeof(edge_t) * (modules[i].num_edges + 1));
+		n = 0;
+		for (j = 0; j < modules[i].num_bbs; j++){
+			bb = module->sorted_bbs[picked[j]];
+			info[j].func_addr = (bb->func != NULL) ? bb->func->start_addr : bb->func_addr;
+			info[j].size = bb->size;
+			info[j].freq = bb->freq;
+			info[j].is_call = bb->is_call;
+			info[j].is_ret = bb->is_ret;
+			info[j].is_call_target = bb->is_call_target;
+			for (k = 0; k < BIN_EDGE_LISTS; k++){
+				info[j].num_edges[k] = 0;
+				for (e = 0; e < md_get_edge_count(edge_list_of(bb, k)); e++){
+					edge = md_get_edge(edge_list_of(bb, k), e);
+					if (!delta || edge->freq != 0){
+						edges[n++] = *edge;
+						info[j].num_edges[k]++;
+						if (delta){
+							edge->freq = 0;
+						}
+					}
+				}
+			}
+			if (delta){
+				bb->freq = 0;
+			}
+		}
+		writer_write(writer, info, sizeof(bin_bb_t) * modules[i].num_bbs);
+		writer_write(writer, edges, sizeof(edge_t) * modules[i].num_edges);
+		dr_global_free(info, sizeof(bin_bb_t) * (modules[i].num_bbs + 1));
+		dr_global_free(edges, sizeof(edge_t) * (modules[i].num_edges + 1));
+		dr_global_free(picked, sizeof(uint) * (modules[i].num_bbs + 1));
+
+	}
+
+	/* snapshots follow each other in one log - each starts aligned */
+	if (delta && SNAPSHOT_ALIGN(header.file_size) != header.file_size){
+		writer_write(writer, &padding, SNAPSHOT_ALIGN(header.file_size) - header.file_size);
+	}
+
+	dr_global_free(modules, sizeof(bin_module_t) * (header.num_modules + 1));
+
+}
+
+void md_print_binary_to_file (module_t * head, file_t file, bool extra_info){
+
+	writer_t * writer = writer_create(file, 0);
+
+	print_binary(head, writer, extra_info, false);
+	writer_destroy(writer);
+
+}
 
+void md_print_snapshot_to_writer (module_t * head, writer_t * writer){
+	print_binary(head, writer, true, true);
 }
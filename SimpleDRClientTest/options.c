@@ -0,0 +1,292 @@
+#include "dr_api.h"
+#include "include/options.h"
+#include <string.h>
+#include <limits.h>
+
+/* option table - built once by options_init and read only afterwards */
+
+/* arena layout - [option_group_t x num_groups][const char * x num_values][named_option_t x num_named][token text] */
+static void * arena = NULL;
+static size_t arena_size = 0;
+
+static option_group_t * groups = NULL;
+static uint num_groups = 0;
+
+/* finds the next token starting at args; returns the position after the token or NULL if there
+   are no more tokens. Quotes are not part of the token */
+static const char * next_token(const char * args, const char ** start, size_t * length, bool * quoted){
+
+	const char * end;
+
+	for (;;){
+		while (*args == ' ' || *args == '\t' || *args == '\n' || *args == '\r'){
+			args++;
+		}
+		if (*args != '#'){
+			break;
+		}
+		while (*args != '\0' && *args != '\n'){
+			args++;
+		}
+	}
+
+	if (*args == '\0'){
+		return NULL;
+	}
+
+	if (*args == '"'){
+		args++;
+		end = args;
+		while (*end != '\0' && *end != '"'){
+			end++;
+		}
+		*start = args;
+		*length = end - args;
+		*quoted = true;
+		return (*end == '"') ? end + 1 : end;
+	}
+
+	end = args;
+	while (*end != '\0' && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r'){
+		end++;
+	}
+	*start = args;
+	*length = end - args;
+	*quoted = false;
+	return end;
+
+}
+
+static bool is_group_name(const char * token, size_t length, bool quoted){
+	return !quoted && length > 1 && token[0] == '-' && !(token[1] >= '0' && token[1] <= '9');
+}
+
+/* length of the key if the token is key=value, 0 otherwise */
+static size_t named_key_length(const char * token, size_t length, bool quoted){
+
+	size_t i;
+
+	if (quoted){
+		return 0;
+	}
+
+	for (i = 0; i < length && ((token[i] >= 'a' && token[i] <= 'z') || token[i] == '_'); i++);
+
+	return (i > 0 && i < length && token[i] == '=') ? i : 0;
+
+}
+
+bool options_init(const char * args){
+
+	const char * pos;
+	const char * token;
+	size_t length;
+	bool quoted;
+	size_t text_size;
+	size_t key_length;
+	uint value_count = 0;
+	uint named_count = 0;
+	uint group_count = 0;
+	uint value_index = 0;
+	uint named_index = 0;
+	const char ** values;
+	named_option_t * named;
+	char * text;
+	option_group_t * group = NULL;
+
+	DR_ASSERT(arena == NULL);
+
+	/* first pass - size the arena */
+	for (pos = next_token(args, &token, &length, &quoted); pos != NULL; pos = next_token(pos, &token, &length, &quoted)){
+		if (is_group_name(token, length, quoted)){
+			group_count++;
+		}
+		else if (group_count == 0){
+			dr_fprintf(STDERR, "option value \"%.*s\" is not preceded by an option name\n", (int)length, token);
+			return false;
+		}
+		else if (named_key_length(token, length, quoted) > 0){
+			named_count++;
+		}
+		else{
+			value_count++;
+		}
+	}
+
+	/* every token is followed by a separator or a quote in args, or ends args */
+	text_size = strlen(args) + 1;
+	arena_size = group_count * sizeof(option_group_t) + value_count * sizeof(const char *) +
+		named_count * sizeof(named_option_t) + text_size;
+	arena = dr_global_alloc(arena_size);
+
+	groups = (option_group_t *)arena;
+	values = (const char **)(groups + group_count);
+	named = (named_option_t *)(values + value_count);
+	text = (char *)(named + named_count);
+
+	/* second pass - fill the tables */
+	for (pos = next_token(args, &token, &length, &quoted); pos != NULL; pos = next_token(pos, &token, &length, &quoted)){
+		key_length = 0;
+		if (is_group_name(token, length, quoted)){
+			token++;
+			length--;
+			group = &groups[num_groups++];
+			group->name = text;
+			group->num_values = 0;
+			group->values = &values[value_index];
+			group->num_named = 0;
+			group->named = &named[named_index];
+		}
+		else if ((key_length = named_key_length(token, length, quoted)) > 0){
+			named[named_index].key = text;
+			named[named_index++].value = text + key_length + 1;
+			group->num_named++;
+		}
+		else{
+			values[value_index++] = text;
+			group->num_values++;
+		}
+		memcpy(text, token, length);
+		text[length] = '\0';
+		if (key_length > 0){
+			text[key_length] = '\0';
+		}
+		text += length + 1;
+	}
+
+	DR_ASSERT(num_groups == group_count && value_index == value_count && named_index == named_count);
+	DR_ASSERT(text <= (char *)arena + arena_size);
+
+	return true;
+
+}
+
+void options_exit(){
+
+	if (arena != NULL){
+		dr_global_free(arena, arena_size);
+	}
+	arena = NULL;
+	arena_size = 0;
+	groups = NULL;
+	num_groups = 0;
+
+}
+
+uint options_group_count(){
+	return num_groups;
+}
+
+const option_group_t * options_get_group(uint index){
+	return (index < num_groups) ? &groups[index] : NULL;
+}
+
+const option_group_t * options_find_group(const char * name){
+
+	uint i;
+
+	for (i = 0; i < num_groups; i++){
+		if (strcmp(groups[i].name, name) == 0){
+			return &groups[i];
+		}
+	}
+
+	return NULL;
+
+}
+
+uint option_count(const option_group_t * group){
+	return (group != NULL) ? group->num_values : 0;
+}
+
+const char * option_get_string(const option_group_t * group, uint index){
+
+	if (group == NULL || index >= group->num_values){
+		return NULL;
+	}
+	return group->values[index];
+
+}
+
+/* decimal or 0x prefixed hex; the whole value has to be a number */
+static bool parse_uint(const char * str, uint * value){
+
+	uint base = 10;
+	uint result = 0;
+	uint digit;
+
+	if (str == NULL || *str == '\0'){
+		return false;
+	}
+
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')){
+		base = 16;
+		str += 2;
+		if (*str == '\0'){
+			return false;
+		}
+	}
+
+	for (; *str != '\0'; str++){
+		if (*str >= '0' && *str <= '9'){
+			digit = *str - '0';
+		}
+		else if (base == 16 && *str >= 'a' && *str <= 'f'){
+			digit = *str - 'a' + 10;
+		}
+		else if (base == 16 && *str >= 'A' && *str <= 'F'){
+			digit = *str - 'A' + 10;
+		}
+		else{
+			return false;
+		}
+		if (result > (UINT_MAX - digit) / base){
+			return false;
+		}
+		result = result * base + digit;
+	}
+
+	*value = result;
+	return true;
+
+}
+
+bool option_get_uint(const option_group_t * group, uint index, uint * value){
+	return parse_uint(option_get_string(group, index), value);
+}
+
+bool option_get_bool(const option_group_t * group, uint index, bool * value){
+
+	uint result;
+
+	if (!option_get_uint(group, index, &result) || result > 1){
+		return false;
+	}
+
+	*value = (result == 1);
+	return true;
+
+}
+
+const char * option_get_named_string(const option_group_t * group, const char * key){
+
+	uint i;
+
+	if (group == NULL){
+		return NULL;
+	}
+
+	/* the last one wins so that a later value overrides an earlier one */
+	for (i = group->num_named; i > 0; i--){
+		if (strcmp(group->named[i - 1].key, key) == 0){
+			return group->named[i - 1].value;
+		}
+	}
+
+	return NULL;
+
+}
+
+bool option_get_named_uint(const option_group_t * group, const char * key, uint * value){
+	return parse_uint(option_get_named_string(group, key), value);
+}
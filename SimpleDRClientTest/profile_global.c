@@ -2,6 +2,9 @@
 #include "include/utilities.h"
 #include "include/defines.h"
 #include "include/moduleinfo.h"
+#include "include/thread_context.h"
+#include "include/module_registry.h"
+#include "include/writer.h"
 #include "drmgr.h"
 //#include <stdio.h>
 
@@ -53,10 +56,12 @@ indirectly can be got by a walk and that will be implemented
 */
 
 /*********************************** defines *******************************/
-#define MAX_STRING_POINTERS 1000000
 
 /* filter modes - refer to utilities (common filtering mode for all files) */
 
+/* the snapshot timer is checked once every SNAPSHOT_CHECK_PERIOD block executions (power of 2) */
+#define SNAPSHOT_CHECK_PERIOD	4096
+
 /************************************* macros ******************************/
 #define TESTALL(mask, var) (((mask) & (var)) == (mask))
 #define TESTANY(mask, var) (((mask) & (var)) != 0)
@@ -65,7 +70,7 @@ indirectly can be got by a walk and that will be implemented
 typedef struct _per_thread_data_t {
 
 	bbinfo_t * bbinfo;
-	char module_name[MAX_STRING_LENGTH];
+	const char * module_name;	/* interned */
 	int prev_bb_start_addr;
 	bool is_call_ins;
 	int call_ins_addr;
@@ -75,10 +80,13 @@ typedef struct _per_thread_data_t {
 
 typedef struct _client_arg_t {
 
-	char filter_filename[MAX_STRING_LENGTH];
+	const char * filter_filename;
 	uint filter_mode;
-	char output_folder[MAX_STRING_LENGTH];
-	char extra_info[MAX_STRING_LENGTH];
+	const char * output_folder;
+	const char * extra_info;
+	bool binary_output;		/* format=bin - the output is written in the binary format */
+	bool snapshots;			/* snapshot=<ms> - counts go to a snapshot log instead of the output */
+	uint snapshot_interval;	/* milliseconds between timed snapshots; 0 - only on nudges and at exit */
 
 } client_arg_t;
 
@@ -89,127 +97,189 @@ static void bbinfo_population(void* bb, int offset, const char * module, uint is
 static void register_bb(void * bbinfo);
 static void called_to_population(app_pc instr_addr, app_pc target_addr);
 static void populate_call_target_information();
+static void take_snapshot();
 
 /*debug and auxiliary prototypes*/
-static bool parse_commandline_args(const char * args);
+static bool parse_commandline_args(const option_group_t * options);
 static void print_readable_output();
 
 /************************ global variables **************************/
 
-file_t out_file;
+file_t out_file = INVALID_FILE;
+static file_t snapshot_file = INVALID_FILE;
+static uint64 next_snapshot;		/* dr_get_milliseconds() at which the next timed snapshot is due */
+static uint executions;				/* block executions - for checking the snapshot timer */
 static module_t * filter_head;
 static module_t * info_head;
 static module_t * call_target_head;
 static void *stats_mutex; /* for multithread support */
-static int tls_index;
+static void *snapshot_mutex;		/* one snapshot at a time, in order in the log - taken before stats_mutex */
+static writer_t * snapshot_writer;	/* memory writer - a snapshot is serialized into it under stats_mutex */
+static uint tls_slot;
 
-char ** string_pointers;   /* global list of string pointers */
-int string_pointer_index = 0;
 
 /* client arguments */
-static client_arg_t * client_arg;
+static client_arg_t client_arg;
 
-static file_t logfile;
+static file_t logfile = INVALID_FILE;
 static char ins_pass_name[MAX_STRING_LENGTH];
 
 
 /********************* function implementations ********************/
 
 
-static bool parse_commandline_args(const char * args) {
+static bool parse_commandline_args(const option_group_t * options) {
+
+	const char * format;
 
-	client_arg = (client_arg_t *)dr_global_alloc(sizeof(client_arg_t));
-	if (dr_sscanf(args, "%s %d %s %s",
-		&client_arg->filter_filename,
-		&client_arg->filter_mode,
-		&client_arg->output_folder,
-		&client_arg->extra_info
-		) != 4){
+	if (option_count(options) < 4){
 		return false;
 	}
 
+	client_arg.filter_filename = option_get_string(options, 0);
+	if (!option_get_uint(options, 1, &client_arg.filter_mode)){
+		return false;
+	}
+	client_arg.output_folder = option_get_string(options, 2);
+	client_arg.extra_info = option_get_string(options, 3);
+	format = option_get_named_string(options, "format");
+	client_arg.binary_output = (format != NULL) && (strcmp(format, "bin") == 0);
+	client_arg.snapshots = option_get_named_uint(options, "snapshot", &client_arg.snapshot_interval);
 
 	return true;
 }
 
 void bbinfo_init(client_id_t id, const char * name,
-	const char * arguments)
+	const option_group_t * options)
 {
-	file_t in_file;
-	char filename[MAX_STRING_LENGTH];
 	char logfilename[MAX_STRING_LENGTH];
 
 	drmgr_init();
 
-	filter_head = md_initialize();
 	info_head = md_initialize();
 	call_target_head = md_initialize();
 
-	DR_ASSERT(parse_commandline_args(arguments) == true);
+	DR_ASSERT(parse_commandline_args(options) == true);
 
-	populate_conv_filename(filename, client_arg->output_folder, name, client_arg->extra_info);
+	if (log_mode){
+		populate_conv_filename(logfilename, logdir, name, NULL);
+		logfile = dr_open_file(logfilename, DR_FILE_WRITE_OVERWRITE);
+	}
+	strncpy(ins_pass_name, name, MAX_STRING_LENGTH);
+
+	stats_mutex = dr_mutex_create();
+	snapshot_mutex = dr_mutex_create();
+
+	tls_slot = thread_context_register(sizeof(per_thread_data_t));
+
+}
+
+/* the output file - opened when the first block is seen, or at exit by a run which never saw one,
+   so there always is a profile. With snapshots the output file name gets a .snap suffix and holds
+   the snapshot log (-merge turns it into a profile) */
+static void open_output(void)
+{
+	char filename[MAX_STRING_LENGTH];
+	uint len;
+
+	len = populate_conv_filename(filename, client_arg.output_folder, ins_pass_name, client_arg.extra_info);
+	if (client_arg.snapshots){
+		dr_snprintf(filename + len, MAX_STRING_LENGTH - len, ".snap");
+		filename[MAX_STRING_LENGTH - 1] = '\0';
+	}
 
 	if (dr_file_exists(filename)){
 		dr_delete_file(filename);
 	}
 
-	out_file = dr_open_file(filename, DR_FILE_WRITE_OVERWRITE);
+	if (client_arg.snapshots){
+		snapshot_file = dr_open_file(filename, DR_FILE_WRITE_OVERWRITE);
+		DR_ASSERT_MSG(snapshot_file != INVALID_FILE, "cannot open the snapshot log");
+		snapshot_writer = writer_create_memory(0);
+		next_snapshot = dr_get_milliseconds() + client_arg.snapshot_interval;
+	}
+	else{
+		out_file = dr_open_file(filename, DR_FILE_WRITE_OVERWRITE);
+	}
 
+}
 
-	if (client_arg->filter_mode != FILTER_NONE){
-		strncpy(filename, client_arg->filter_filename, MAX_STRING_LENGTH);
+/* output file and filter - set up when the first block is seen */
+void bbinfo_lazy_init(void)
+{
 
-		if (!dr_file_exists(filename)){
-			DR_ASSERT_MSG(false, "input file missing\n");
-		}
+	open_output();
+	filter_head = filter_load(client_arg.filter_filename, client_arg.filter_mode);
 
-		in_file = dr_open_file(filename, DR_FILE_READ);
-		md_read_from_file(filter_head, in_file, true);
-		dr_close_file(in_file);
+}
 
-	}
+/* filter used by the pass - the dispatcher changes the mode on nudges */
+void bbinfo_get_filter(module_t ** list, uint ** mode){
 
-	if (log_mode){
-		populate_conv_filename(logfilename, logdir, name, NULL);
-		logfile = dr_open_file(logfilename, DR_FILE_WRITE_OVERWRITE);
-	}
-	strncpy(ins_pass_name, name, MAX_STRING_LENGTH);
+	*list = filter_head;
+	*mode = &client_arg.filter_mode;
 
-	//string pointers
-	string_pointers = (char **)dr_global_alloc(sizeof(char *)*MAX_STRING_POINTERS);
+}
 
-	stats_mutex = dr_mutex_create();
+void bbinfo_lazy_exit(void){
 
-	tls_index = drmgr_register_tls_field();
+	filter_release(filter_head);
 
 }
 
+/* NUDGE_PASS_SNAPSHOT - appends the counts since the last snapshot to the snapshot log */
+void bbinfo_snapshot(void){
+
+	if (snapshot_file == INVALID_FILE){
+		dr_fprintf(STDERR, "%s - no snapshot log; start the pass with snapshot=<ms>\n", ins_pass_name);
+		return;
+	}
+
+	take_snapshot();
+
+}
+
+/* the profile is written here rather than in bbinfo_lazy_exit, which does not run when the pass
+   never saw a block */
 void bbinfo_exit_event(void){
 
-	int i = 0;
+	if (out_file == INVALID_FILE && snapshot_file == INVALID_FILE){
+		open_output();
+	}
 
-	md_sort_bb_list_in_module(info_head);
-	md_print_to_file(call_target_head, logfile, false);
-	populate_call_target_information();
-	md_print_to_file(info_head, out_file, true);
-	md_delete_list(filter_head, true);
-	md_delete_list(info_head, true);
-	md_delete_list(call_target_head, false);
+	if (log_mode){
+		md_print_to_file(call_target_head, logfile, false);
+	}
 
-	for (i = 0; i<string_pointer_index; i++){
-		dr_global_free(string_pointers[i], sizeof(char)*MAX_STRING_LENGTH);
+	/* only what was counted after the last snapshot is left to write */
+	if (client_arg.snapshots){
+		take_snapshot();
+		writer_destroy(snapshot_writer);
+		dr_close_file(snapshot_file);
+		snapshot_file = INVALID_FILE;
+	}
+	else{
+		md_sort_bb_list_in_module(info_head);
+		populate_call_target_information();
+		if (client_arg.binary_output){
+			md_print_binary_to_file(info_head, out_file, true);
+		}
+		else{
+			md_print_to_file(info_head, out_file, true);
+		}
+		dr_close_file(out_file);
+		out_file = INVALID_FILE;
 	}
 
-	dr_global_free(string_pointers, sizeof(char *)*MAX_STRING_POINTERS);
+	md_delete_list(info_head, true);
+	md_delete_list(call_target_head, false);
 
-	drmgr_unregister_tls_field(tls_index);
 	dr_mutex_destroy(stats_mutex);
-	dr_close_file(out_file);
+	dr_mutex_destroy(snapshot_mutex);
 	if (log_mode){
 		dr_close_file(logfile);
 	}
 
-	dr_global_free(client_arg, sizeof(client_arg_t));
 	drmgr_exit();
 
 
@@ -218,16 +288,15 @@ void bbinfo_exit_event(void){
 void
 bbinfo_thread_init(void *drcontext){
 
-	per_thread_data_t * data = (per_thread_data_t *)dr_thread_alloc(drcontext, sizeof(per_thread_data_t));
+	per_thread_data_t * data = (per_thread_data_t *)thread_context_get_slot(drcontext, tls_slot);
 
 	DEBUG_PRINT("%s - initializing thread %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
 	/* initialize */
-	strncpy(data->module_name, "__init", MAX_STRING_LENGTH);
+	data->module_name = "__init";
 	data->is_call_ins = false;
 
 	/* store this in thread local storage */
-	drmgr_set_tls_field(drcontext, tls_index, data);
 
 	DEBUG_PRINT("%s - initializing thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
@@ -236,10 +305,9 @@ bbinfo_thread_init(void *drcontext){
 void
 bbinfo_thread_exit(void *drcontext){
 
-	per_thread_data_t * data = (per_thread_data_t *)drmgr_get_tls_field(drcontext, tls_index);
+	per_thread_data_t * data = (per_thread_data_t *)thread_context_get_slot(drcontext, tls_slot);
 
 	/* clean up memory */
-	dr_thread_free(drcontext, data, sizeof(per_thread_data_t));
 
 	DEBUG_PRINT("%s - exiting thread done %d\n", ins_pass_name, dr_get_thread_id(drcontext));
 
@@ -248,30 +316,46 @@ bbinfo_thread_exit(void *drcontext){
 static void populate_call_target_information(){
 
 	module_t * local_head = info_head;
-	int i = 0;
+	uint i = 0;
 	bbinfo_t * bb;
+	bbinfo_t * target;
 
 	while (local_head != NULL){
-		for (i = 1; i <= local_head->bbs[0].start_addr; i++){
-			bb = md_lookup_bb_in_module(call_target_head, local_head->module, local_head->bbs[i].start_addr);
-			if (bb != NULL){
-				local_head->bbs[i].is_call_target = true;
-			}
-			else{
-				local_head->bbs[i].is_call_target = false;
-			}
+		for (i = 0; i < md_get_bb_count(local_head); i++){
+			bb = md_get_bb(local_head, i);
+			target = md_lookup_bb_in_module(call_target_head, local_head->module, bb->start_addr);
+			bb->is_call_target = (target != NULL);
 		}
 		local_head = local_head->next;
 	}
 }
 
+/* the counts are copied out and zeroed under stats_mutex; the file is written after it is released
+   so the other threads' clean calls do not wait on the disk */
+static void take_snapshot(){
+
+	dr_mutex_lock(snapshot_mutex);
+
+	dr_mutex_lock(stats_mutex);
+	populate_call_target_information();
+	md_print_snapshot_to_writer(info_head, snapshot_writer);
+	next_snapshot = dr_get_milliseconds() + client_arg.snapshot_interval;
+	dr_mutex_unlock(stats_mutex);
+
+	writer_write_to_file(snapshot_writer, snapshot_file);
+
+	dr_mutex_unlock(snapshot_mutex);
+
+}
+
 static void print_readable_output(){
 
 	module_t * local_head = info_head->next;
-	int size = 0;
+	bbinfo_t * bb;
+	edge_t * edge;
 	uint i = 0, j = 0;
 	bool printed = 0;
-
+	writer_t * writer = writer_create(out_file, 0);
 
 	md_sort_bb_list_in_module(info_head);
 
@@ -280,32 +364,36 @@ static void print_readable_output(){
 
 		printed = 0;
 
-		dr_fprintf(out_file, "%s\n", local_head->module);
-		size = local_head->bbs[0].start_addr;
-		for (i = 1; i <= size; i++){
-			dr_fprintf(out_file, "%x - %u - ", local_head->bbs[i].start_addr, local_head->bbs[i].freq);
+		writer_printf(writer, "%s\n", local_head->module);
+		for (i = 0; i < md_get_bb_count(local_head); i++){
+			bb = md_get_sorted_bb(local_head, i);
+			writer_printf(writer, "%x - %u - ", bb->start_addr, bb->freq);
 
-			for (j = 1; j <= local_head->bbs[i].from_bbs[0].start_addr; j++){
-				dr_fprintf(out_file, "%x(%u) ", local_head->bbs[i].from_bbs[j].start_addr, local_head->bbs[i].from_bbs[j].freq);
+			for (j = 0; j < md_get_edge_count(&bb->from_bbs); j++){
+				edge = md_get_edge(&bb->from_bbs, j);
+				writer_printf(writer, "%x(%u) ", edge->addr, edge->freq);
 			}
 
-			dr_fprintf(out_file, "|| ");
+			writer_printf(writer, "|| ");
 
 
-			for (j = 1; j <= local_head->bbs[i].called_from[0].bb_addr; j++){
-				dr_fprintf(out_file, "%x - %x(%u) ", local_head->bbs[i].called_from[j].bb_addr,
-					local_head->bbs[i].called_from[j].call_point_addr,
-					local_head->bbs[i].called_from[j].freq);
+			for (j = 0; j < md_get_edge_count(&bb->called_from); j++){
+				edge = md_get_edge(&bb->called_from, j);
+				writer_printf(writer, "%x - %x(%u) ", edge->addr,
+					edge->call_point_addr,
+					edge->freq);
 			}
 
-			dr_fprintf(out_file, ": func : %x", local_head->bbs[i].func->start_addr);
-			dr_fprintf(out_file, "\n");
+			writer_printf(writer, ": func : %x", bb->func->start_addr);
+			writer_printf(writer, "\n");
 
 		}
 		local_head = local_head->next;
 
 	}
 
+	writer_destroy(writer);
+
 }
 
 
@@ -317,12 +405,9 @@ static void bbinfo_population(void* bb, int offset, const char * module, uint is
 
 	//get the drcontext
 	void * drcontext;
-	int i;
 	bbinfo_t* bbinfo;
 	per_thread_data_t *data;
-
-	bool have_bb = false;
-	bool have_call = false;
+	bool snapshot_due = false;
 
 	//first acquire the lock before modifying this global structure
 	dr_mutex_lock(stats_mutex);
@@ -330,54 +415,45 @@ static void bbinfo_population(void* bb, int offset, const char * module, uint is
 	drcontext = dr_get_current_drcontext();
 
 	//get the tls field
-	data = (per_thread_data_t *)drmgr_get_tls_field(drcontext, tls_index);
+	data = (per_thread_data_t *)thread_context_get_slot(drcontext, tls_slot);
 
 	bbinfo = (bbinfo_t*)bb;
 	data->bbinfo = bbinfo;
 	bbinfo->freq++;
 	//bbinfo->func = get_current_function(drcontext);
-	bbinfo->func_addr = get_current_function_all(drcontext);
+	bbinfo->func_addr = dispatch_product(drcontext, PRODUCT_CURRENT_FUNCTION);
 
 	// we are sure that the bbs are from the filtered out modules
 	// updating from bbs
-	for (i = 1; i <= bbinfo->from_bbs[0].start_addr; i++){
-		if (data->prev_bb_start_addr == bbinfo->from_bbs[i].start_addr){
-			bbinfo->from_bbs[i].freq++;
-			have_bb = true;
-			break;
-		}
-	}
-	if (!have_bb && (bbinfo->from_bbs[0].start_addr < MAX_TARGETS - 1)){
-		bbinfo->from_bbs[++(bbinfo->from_bbs[0].start_addr)].start_addr = data->prev_bb_start_addr;
-		bbinfo->from_bbs[(bbinfo->from_bbs[0].start_addr)].freq = 1;
-	}
+	md_record_edge(&bbinfo->from_bbs, data->prev_bb_start_addr, 0);
 
 	//updating call target information
 	if (data->is_call_ins){
-		for (i = 1; i <= bbinfo->called_from[0].bb_addr; i++){
-			if (data->prev_bb_start_addr == bbinfo->called_from[i].bb_addr){
-				bbinfo->called_from[i].freq++;
-				have_call = true;
-				break;
-			}
-		}
-		if (!have_call && (bbinfo->called_from[0].bb_addr < MAX_TARGETS - 1)){
-			bbinfo->called_from[++(bbinfo->called_from[0].bb_addr)].bb_addr = data->prev_bb_start_addr;
-			bbinfo->called_from[(bbinfo->called_from[0].bb_addr)].call_point_addr = data->call_ins_addr;
-			bbinfo->called_from[(bbinfo->called_from[0].bb_addr)].freq = 1;
-		}
+		md_record_edge(&bbinfo->called_from, data->prev_bb_start_addr, data->call_ins_addr);
 	}
 
 	//update information
 
 	data->prev_bb_start_addr = (uint)offset;
-	strncpy(data->module_name, module, MAX_STRING_LENGTH);
+	data->module_name = module;
 	data->is_call_ins = is_call;
 	data->call_ins_addr = call_addr;
 
+	/* timed snapshots are taken by whichever thread notices they are due - it claims the snapshot by
+	   moving the deadline, and takes it once stats_mutex is released */
+	if (client_arg.snapshot_interval != 0 && (++executions & (SNAPSHOT_CHECK_PERIOD - 1)) == 0 &&
+		snapshot_file != INVALID_FILE && dr_get_milliseconds() >= next_snapshot){
+		next_snapshot = dr_get_milliseconds() + client_arg.snapshot_interval;
+		snapshot_due = true;
+	}
+
 	//unlock the lock
 	dr_mutex_unlock(stats_mutex);
 
+	if (snapshot_due){
+		take_snapshot();
+	}
+
 
 }
 
@@ -399,7 +475,7 @@ OUT void **user_data)
 static void
 register_bb(void * bbinfo){
 
-	per_thread_data_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+	per_thread_data_t * data = thread_context_get_slot(dr_get_current_drcontext(), tls_slot);
 	data->bbinfo = (bbinfo_t *)bbinfo;
 
 }
@@ -407,95 +483,83 @@ register_bb(void * bbinfo){
 static void
 called_to_population(app_pc instr_addr, app_pc target_addr){
 
-	per_thread_data_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
-	module_data_t * module = dr_lookup_module(instr_addr);
-	module_data_t * target_module = dr_lookup_module(target_addr);
+	per_thread_data_t * data = thread_context_get_slot(dr_get_current_drcontext(), tls_slot);
+	loaded_module_t module;
+	loaded_module_t target_module;
 
-	int i = 0;
-	int num_calls = 0;
 	uint offset = 0;
 
-	bool found = false;
-
 	//DR_ASSERT(module != NULL);
 	//DR_ASSERT(target_module != NULL);
 
 	//dr_printf("at call - %x\n", data->bbinfo);
 
-	if ((module != NULL) && (target_module != NULL)){
-		if (strcmp(module->full_path, target_module->full_path) == 0){
+	if (module_registry_lookup(instr_addr, &module) && module_registry_lookup(target_addr, &target_module)){
+		if (module.name_id == target_module.name_id){
 
-			offset = target_addr - target_module->start;
+			offset = target_addr - target_module.start;
 
-			num_calls = data->bbinfo->called_to[0].bb_addr;
-			for (i = 1; i <= num_calls; i++){
-				if (data->bbinfo->called_to[i].bb_addr == offset){
-					found = true;
-					data->bbinfo->called_to[i].freq++;
-					break;
-				}
-			}
+			md_record_edge(&data->bbinfo->called_to, offset, instr_addr - module.start);
 
-			if (!found){
+		}
 
-				if (data->bbinfo->called_to[0].bb_addr < MAX_TARGETS - 1){
-					data->bbinfo->called_to[0].bb_addr++;
-					data->bbinfo->called_to[data->bbinfo->called_to[0].bb_addr].bb_addr = offset;
-					offset = instr_addr - module->start;
-					data->bbinfo->called_to[data->bbinfo->called_to[0].bb_addr].call_point_addr = offset;
-					data->bbinfo->called_to[data->bbinfo->called_to[0].bb_addr].freq = 1;
-				}
-			}
+	}
 
-		}
+}
+
+/* lookups need no lock - only adding takes stats_mutex */
+static bool
+is_call_target(loaded_module_t * module, uint offset){
 
+	module_t * md = md_lookup_module_id(call_target_head, module->name_id);
+
+	return (md != NULL) && md_contains_bb(md, offset);
+
+}
+
+/* records a call target once - called with stats_mutex held */
+static void
+add_call_target(loaded_module_t * module, uint offset){
+
+	if (!is_call_target(module, offset)){
+		md_add_bb_to_module(call_target_head, module->name, offset, 0, false);
 	}
 
-	dr_free_module_data(module);
-	dr_free_module_data(target_module);
 }
 
 static void
 call_target_info(app_pc instr_addr, app_pc target_addr){
 
-	module_data_t * module_data = dr_lookup_module(target_addr);
+	loaded_module_t module;
 	uint offset;
-	bbinfo_t * bb;
 
-	if (module_data != NULL){
-		offset = target_addr - module_data->start;
+	if (module_registry_lookup(target_addr, &module)){
+		offset = target_addr - module.start;
 		dr_mutex_lock(stats_mutex);
-		bb = md_lookup_bb_in_module(call_target_head, module_data->full_path, offset);
-		if (bb == NULL){
-			md_add_bb_to_module(call_target_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, false);
-		}
+		add_call_target(&module, offset);
 		called_to_population(instr_addr, target_addr);
 		dr_mutex_unlock(stats_mutex);
 	}
 
-	dr_free_module_data(module_data);
-
 
 }
 
 void call_target_info_wo_called_to(app_pc instr_addr, app_pc target_addr){
 
-	module_data_t * module_data = dr_lookup_module(target_addr);
-	per_thread_data_t * data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+	loaded_module_t module;
+	per_thread_data_t * data = thread_context_get_slot(dr_get_current_drcontext(), tls_slot);
 	uint offset;
-	bbinfo_t * bb;
 
-	if (module_data != NULL){
-		offset = target_addr - module_data->start;
-		dr_mutex_lock(stats_mutex);
-		bb = md_lookup_bb_in_module(call_target_head, module_data->full_path, offset);
-		if (bb == NULL){
-			md_add_bb_to_module(call_target_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, false);
+	if (module_registry_lookup(target_addr, &module)){
+		offset = target_addr - module.start;
+		/* most calls go to known targets - those do not take the lock */
+		if (!is_call_target(&module, offset)){
+			dr_mutex_lock(stats_mutex);
+			add_call_target(&module, offset);
+			dr_mutex_unlock(stats_mutex);
 		}
-		dr_mutex_unlock(stats_mutex);
 		data->last_call_addr = offset;
 	}
-	dr_free_module_data(module_data);
 }
 
 dr_emit_flags_t
@@ -504,11 +568,12 @@ instr_t *instr_current, bool for_trace, bool translating,
 void *user_data)
 {
 
+	bb_context_t * ctx = (bb_context_t *)user_data;
 	instr_t *instr;
-	instr_t * first = instrlist_first(bb);
-	instr_t  *last = instrlist_last(bb);
-	module_data_t * module_data;
-	char * module_name;
+	instr_t * first = ctx->first;
+	instr_t  *last = ctx->last;
+	const char * module_name;
+	module_t * md;
 	bbinfo_t * bbinfo;
 	int offset;
 
@@ -528,99 +593,38 @@ void *user_data)
 	opnd_t opnd2;
 
 
-	/* get the first non meta instruction */
-	for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)){
-		if (instr_ok_to_mangle(instr)){
-			first = instr;
-			break;
-		}
-	}
 	instr = NULL;
 
 	if (instr_current != first && instr_current != last)
 		return DR_EMIT_DEFAULT;
 
-	//get the module data and if module + addr is present then add frequency counting
-	module_data = dr_lookup_module(instr_get_app_pc(first));
-
 	//dynamically generated code - module information not available
-	if (module_data == NULL){
+	if (ctx->module_start == NULL){
 		return DR_EMIT_DEFAULT;
 	}
 
 
-	module_name = (char *)dr_global_alloc(sizeof(char)*MAX_STRING_LENGTH);
-	strncpy(module_name, module_data->full_path, MAX_STRING_LENGTH);
+	/* interned - can be handed to the clean call as it is */
+	module_name = ctx->module_name;
 
-	offset = (int)instr_get_app_pc(first) - (int)module_data->start;
-	bbinfo = md_lookup_bb_in_module(info_head, module_data->full_path, offset);
+	offset = ctx->offset;
+	md = md_lookup_module_id(info_head, ctx->module_id);
+	bbinfo = (md != NULL) ? md_lookup_bb(md, offset) : NULL;
 
 
 	/* populate and filter the bbs if true go ahead and do instrumentation */
-	/* range filtering is not supported as we changing the data structure in place */
-	if (client_arg->filter_mode == FILTER_MODULE){
-		if (filter_module_level_from_list(filter_head, first)){
-			//addr or the module is not present from what we read from file
-			if (bbinfo == NULL){
-				bbinfo = md_add_bb_to_module(info_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, true);
-			}
-			DR_ASSERT(bbinfo != NULL);
-		}
-		else{
-			filtered = false;
-		}
-
-	}
-	else if (client_arg->filter_mode == FILTER_BB){
+	if (ctx->filtered){
 		//addr or the module is not present from what we read from file
-		if (filter_bb_level_from_list(filter_head, first)){
-			if (bbinfo == NULL){
-				bbinfo = md_add_bb_to_module(info_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, true);
-			}
-			DR_ASSERT(bbinfo != NULL);
-		}
-		else{
-			filtered = false;
-		}
-
-	}
-	else if (client_arg->filter_mode == FILTER_NONE){
+		/* clean calls write snapshots of the list - adding is serialized with them */
 		if (bbinfo == NULL){
-			bbinfo = md_add_bb_to_module(info_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, true);
+			dr_mutex_lock(stats_mutex);
+			bbinfo = md_add_bb_to_module(info_head, module_name, offset, 0, true);
+			dr_mutex_unlock(stats_mutex);
 		}
 		DR_ASSERT(bbinfo != NULL);
 	}
-	else if (client_arg->filter_mode == FILTER_NEG_MODULE){
-		if (filter_from_module_name(filter_head, module_name, client_arg->filter_mode)){
-			if (bbinfo == NULL){
-				bbinfo = md_add_bb_to_module(info_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, true);
-			}
-			DR_ASSERT(bbinfo != NULL);
-		}
-		else{
-			filtered = false;
-		}
-	}
-	else if (client_arg->filter_mode == FILTER_FUNCTION){
-		if (filter_from_list(filter_head, first, client_arg->filter_mode)){
-			if (bbinfo == NULL){
-				bbinfo = md_add_bb_to_module(info_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, true);
-			}
-		}
-		else{
-			filtered = false;
-		}
-	}
-	else if (client_arg->filter_mode == FILTER_NUDGE){
-		if (filter_from_list(filter_head, first, client_arg->filter_mode)){
-			//dr_printf("profile came- %s %d\n", module_data->full_path, offset);
-			if (bbinfo == NULL){
-				bbinfo = md_add_bb_to_module(info_head, module_data->full_path, offset, MAX_BBS_PER_MODULE, true);
-			}
-		}
-		else{
-			filtered = false;
-		}
+	else{
+		filtered = false;
 	}
 
 	/* if the instr is filtered; only if instr == first; as this will be in the diff file */
@@ -635,40 +639,42 @@ void *user_data)
 
 		DR_ASSERT(bbinfo != NULL);
 
-		/* optimize this to only run if module is not found */
-		md_lookup_module(info_head, module_name)->start_addr = module_data->start;
-
-
 		//check whether this bb has a call at the end or a ret at the end
-		instr = instrlist_last(bb);
+		instr = last;
 		is_call = instr_is_call(instr);
+		call_addr = 0;
 		if (is_call){
-			call_addr = (int)instr_get_app_pc(instr) - (int)module_data->start;
+			call_addr = (int)instr_get_app_pc(instr) - (int)ctx->module_start;
 		}
 		is_ret = instr_is_return(instr);
+		bb_size = instr_get_app_pc(last) - instr_get_app_pc(first) + instr_length(drcontext, last);
 
-
+		/* snapshots read these under stats_mutex */
+		dr_mutex_lock(stats_mutex);
+		/* optimize this to only run if module is not found */
+		md_lookup_module_id(info_head, ctx->module_id)->start_addr = (uint64)ctx->module_start;
 		bbinfo->is_call = is_call;
 		bbinfo->is_ret = is_ret;
-		bbinfo->size = instr_get_app_pc(instrlist_last(bb)) - instr_get_app_pc(first) + instr_length(drcontext, instrlist_last(bb));
-
-		dr_mutex_lock(stats_mutex);
-		string_pointers[string_pointer_index++] = module_name;
+		bbinfo->size = bb_size;
 		dr_mutex_unlock(stats_mutex);
 
-		dr_insert_clean_call(drcontext, bb, first, (void *)bbinfo_population, false, 5,
-			OPND_CREATE_INTPTR(bbinfo),
-			OPND_CREATE_INT32(offset),
-			OPND_CREATE_INTPTR(module_name),
-			OPND_CREATE_INT32(is_call),
-			OPND_CREATE_INT32(call_addr));
+		/* the clean call is inserted once per block - at the first instruction */
+		if (instr_current == first){
+			dr_insert_clean_call(drcontext, bb, first, (void *)bbinfo_population, false, 5,
+				OPND_CREATE_INTPTR(bbinfo),
+				OPND_CREATE_INT32(offset),
+				OPND_CREATE_INTPTR(module_name),
+				OPND_CREATE_INT32(is_call),
+				OPND_CREATE_INT32(call_addr));
+		}
 	}
 
-	dr_free_module_data(module_data);
-	dr_global_free(module_name, sizeof(char)*MAX_STRING_LENGTH);
-
 	if (!filtered){
 
+		if (instr_current != last){
+			return DR_EMIT_DEFAULT;
+		}
+
 		if (instr_is_call_direct(last)){
 
 			srcs = instr_num_srcs(last);
@@ -0,0 +1,114 @@
+#include "dr_api.h"
+#include "drmgr.h"
+#include "include/thread_context.h"
+#include <string.h>
+
+/* the block is set up before and torn down after every other thread callback */
+#define THREAD_CONTEXT_PRIORITY 10000
+
+#define ALIGN_UP(x, alignment) (((x) + (alignment) - 1) & ~((alignment) - 1))
+
+static size_t block_size = 0;
+static bool threads_started = false;
+
+/* raw tls slot holding the block base - read by the inserted code */
+static reg_id_t tls_seg;
+static uint tls_offs;
+/* the same pointer for C code which is handed a drcontext */
+static int tls_index;
+
+static drmgr_priority_t thread_init_priority = {
+	sizeof(thread_init_priority), /* size of struct */
+	"thread_context_init",        /* name of our operation */
+	NULL,                         /* optional name of operation we should precede */
+	NULL,                         /* optional name of operation we should follow */
+	-THREAD_CONTEXT_PRIORITY };
+
+static drmgr_priority_t thread_exit_priority = {
+	sizeof(thread_exit_priority), /* size of struct */
+	"thread_context_exit",        /* name of our operation */
+	NULL,                         /* optional name of operation we should precede */
+	NULL,                         /* optional name of operation we should follow */
+	THREAD_CONTEXT_PRIORITY };
+
+static void event_thread_init(void * drcontext);
+static void event_thread_exit(void * drcontext);
+
+void thread_context_init(){
+
+	DR_ASSERT_MSG(dr_raw_tls_calloc(&tls_seg, &tls_offs, 1, 0), "cannot allocate the raw tls slot");
+
+	tls_index = drmgr_register_tls_field();
+	DR_ASSERT(tls_index != -1);
+
+	drmgr_register_thread_init_event_ex(event_thread_init, &thread_init_priority);
+	drmgr_register_thread_exit_event_ex(event_thread_exit, &thread_exit_priority);
+
+}
+
+void thread_context_exit(){
+
+	drmgr_unregister_thread_init_event(event_thread_init);
+	drmgr_unregister_thread_exit_event(event_thread_exit);
+	drmgr_unregister_tls_field(tls_index);
+	dr_raw_tls_cfree(tls_offs, 1);
+
+}
+
+uint thread_context_register(size_t size){
+
+	uint offset = (uint)block_size;
+
+	/* blocks of running threads cannot grow */
+	DR_ASSERT_MSG(!threads_started, "thread context slots have to be registered before threads start");
+
+	block_size = ALIGN_UP(block_size + size, THREAD_SLOT_ALIGNMENT);
+
+	return offset;
+
+}
+
+void * thread_context_get(void * drcontext){
+	return drmgr_get_tls_field(drcontext, tls_index);
+}
+
+void * thread_context_get_slot(void * drcontext, uint offset){
+	return (char *)drmgr_get_tls_field(drcontext, tls_index) + offset;
+}
+
+void thread_context_insert_load(void * drcontext, instrlist_t * ilist, instr_t * where, reg_id_t reg){
+
+	instrlist_meta_preinsert(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg),
+		opnd_create_far_base_disp(tls_seg, DR_REG_NULL, DR_REG_NULL, 0, tls_offs, OPSZ_PTR)));
+
+}
+
+/* [padding][raw allocation pointer][block] - the block starts on a cache line */
+static size_t allocation_size(){
+	return block_size + THREAD_CONTEXT_ALIGNMENT + sizeof(void *);
+}
+
+static void event_thread_init(void * drcontext){
+
+	char * raw;
+	char * block;
+
+	threads_started = true;
+
+	raw = (char *)dr_thread_alloc(drcontext, allocation_size());
+	block = (char *)ALIGN_UP((ptr_uint_t)(raw + sizeof(void *)), THREAD_CONTEXT_ALIGNMENT);
+	((void **)block)[-1] = raw;
+	memset(block, 0, block_size);
+
+	drmgr_set_tls_field(drcontext, tls_index, block);
+	*(void **)(dr_get_dr_segment_base(tls_seg) + tls_offs) = block;
+
+}
+
+static void event_thread_exit(void * drcontext){
+
+	char * block = (char *)drmgr_get_tls_field(drcontext, tls_index);
+
+	dr_thread_free(drcontext, ((void **)block)[-1], allocation_size());
+
+}
@@ -1,100 +1,102 @@
 #include "dr_api.h"
+#include <string.h>
 #include "include/utilities.h"
-#include "include/funcwrap.h"
+#include "include/module_registry.h"
 
 /* filtering when to instrument */
-bool filter_bb_level_from_list (module_t * head, instr_t * instr){
 
+/* common filtering given the module name id and the offset within the module */
+static bool filter_bb_level_from_offset(module_t * head, uint name_id, uint offset){
 
-	module_data_t * module_data;
-	int offset;
-	bbinfo_t * bbinfo;
-	app_pc pc;
+	module_t * mdinfo = md_lookup_module_id(head, name_id);
 
-	pc = instr_get_app_pc(instr);
+	return (mdinfo != NULL) && md_contains_bb(mdinfo, offset);
 
-	if(pc == 0) return false;
+}
 
-	module_data = dr_lookup_module(pc);
+/* consecutive bbs are the start and the end of a range */
+static bool filter_range_from_offset(module_t * head, uint name_id, uint offset){
 
-	if(module_data == NULL){
-		return false;
-	}
+	module_t * mdinfo = md_lookup_module_id(head, name_id);
+
+	return (mdinfo != NULL) && md_in_range(mdinfo, offset);
 
+}
 
-	offset = (int)instr_get_app_pc(instr) - (int)module_data->start;
-	bbinfo = md_lookup_bb_in_module(head,module_data->full_path,offset);
+static bool filter_from_offset(module_t * head, uint name_id, uint offset, uint mode){
 
-	dr_free_module_data(module_data);
+	if(mode == FILTER_BB){
+		return filter_bb_level_from_offset(head, name_id, offset);
+	}
+	else if(mode == FILTER_MODULE){
+		return (md_lookup_module_id(head, name_id) != NULL);
+	}
+	else if(mode == FILTER_RANGE){
+		return filter_range_from_offset(head, name_id, offset);
+	}
+	else if(mode == FILTER_NONE){
+		return true;
+	}
+	else if (mode == FILTER_NEG_MODULE){
+		return (md_lookup_module_id(head, name_id) == NULL);
+	}
+	else if (mode == FILTER_FUNCTION || mode == FILTER_NUDGE){
+		/* checked by the guard when the block runs - the building thread does not decide */
+		return true;
+	}
 
-	return (bbinfo != NULL);
+	return true;
 
 }
 
-bool filter_module_level_from_list (module_t * head, instr_t * instr){
+bool filter_bb_level_from_list (module_t * head, instr_t * instr){
 
-	module_data_t * module_data;
-	module_t * mdinfo;
+	loaded_module_t module;
 	app_pc pc;
 
 	pc = instr_get_app_pc(instr);
 
 	if(pc == 0) return false;
 
-	module_data = dr_lookup_module(pc);
-
-	if(module_data == NULL){
+	if(!module_registry_lookup(pc, &module)){
 		return false;
 	}
 
-	mdinfo = md_lookup_module(head, module_data->full_path);
-
-	dr_free_module_data(module_data);
-
-	return (mdinfo != NULL);
+	return filter_bb_level_from_offset(head, module.name_id, (uint)(pc - module.start));
 
 }
 
-bool filter_range_from_list (module_t * head, instr_t * instr){
+bool filter_module_level_from_list (module_t * head, instr_t * instr){
 
-	module_data_t * module_data;
-	int offset;
-	module_t * mdinfo;
-	int size;
-	int i;
+	loaded_module_t module;
 	app_pc pc;
 
 	pc = instr_get_app_pc(instr);
 
 	if(pc == 0) return false;
 
-	module_data = dr_lookup_module(pc);
-
-	if(module_data == NULL){
+	if(!module_registry_lookup(pc, &module)){
 		return false;
 	}
 
-	offset = (int)instr_get_app_pc(instr) - (int)module_data->start;
+	return (md_lookup_module_id(head, module.name_id) != NULL);
+
+}
 
-	mdinfo = md_lookup_module(head, module_data->full_path);
+bool filter_range_from_list (module_t * head, instr_t * instr){
 
-	dr_free_module_data(module_data);
+	loaded_module_t module;
+	app_pc pc;
 
-	if(mdinfo == NULL){
-		return false;
-	}
+	pc = instr_get_app_pc(instr);
 
-	/* now check for the range */
-	size = mdinfo->bbs[0].start_addr;
+	if(pc == 0) return false;
 
-	for(i = 1; i<size; i+=2){
-		if((offset >= mdinfo->bbs[i].start_addr) && (offset <= mdinfo->bbs[i+1].start_addr)){
-			//dr_printf("%d %d\n",size,offset);
-			return true;
-		}
+	if(!module_registry_lookup(pc, &module)){
+		return false;
 	}
 
-	return false;
+	return filter_range_from_offset(head, module.name_id, (uint)(pc - module.start));
 }
 
 bool neg_filter_module(module_t * head, instr_t * instr){
@@ -119,7 +121,7 @@ bool filter_from_list(module_t * head, instr_t * instr, uint mode){
 		return neg_filter_module(head, instr);
 	}
 	else if (mode == FILTER_FUNCTION){
-		return should_filter_func();
+		return dispatch_product(dr_get_current_drcontext(), PRODUCT_FUNCTION_FILTER);
 	}
 	else if (mode == FILTER_NUDGE){
 		return nudge_instrument;
@@ -129,14 +131,360 @@ bool filter_from_list(module_t * head, instr_t * instr, uint mode){
 
 }
 
-bool filter_from_module_name(module_t * head, char * name, uint mode){
+/* same as filter_from_list, but for the block described by the dispatcher's context - no module lookups */
+bool filter_bb_from_context(module_t * head, bb_context_t * ctx, uint mode){
 
-	if (mode == FILTER_NEG_MODULE){
-		return (md_lookup_module(head, name) == NULL);
+	if (ctx->module_start == NULL){
+		/* not inside a module - only unfiltered modes let these through */
+		return (mode == FILTER_NONE) || (mode == FILTER_NEG_MODULE) ||
+			(mode == FILTER_FUNCTION) || (mode == FILTER_NUDGE);
+	}
+
+	return filter_from_offset(head, ctx->module_id, ctx->offset, mode);
+
+}
+
+bool filter_is_static(uint mode){
+	return (mode == FILTER_BB) || (mode == FILTER_MODULE) || (mode == FILTER_RANGE) ||
+		(mode == FILTER_NONE) || (mode == FILTER_NEG_MODULE) || (mode == FILTER_FUNCTION) ||
+		(mode == FILTER_NUDGE);
+}
+
+uint filter_dynamic_bits(uint mode){
+	if (mode == FILTER_FUNCTION){
+		return ACTIVE_FUNCTION;
+	}
+	return (mode == FILTER_NUDGE) ? ACTIVE_NUDGE : 0;
+}
+
+bool filter_is_block_level(uint mode){
+	return (mode != FILTER_BB) && (mode != FILTER_RANGE);
+}
+
+/* instruction level filtering for an instruction of the block described by ctx - instructions of
+   the block's module use its offset; the others (trace blocks spanning modules) are looked up */
+bool filter_instr_from_context(module_t * head, bb_context_t * ctx, instr_t * instr, uint mode){
+
+	app_pc pc = instr_get_app_pc(instr);
+
+	if (pc == 0) return false;
+
+	if (pc < ctx->module_start || pc >= ctx->module_end){
+		return filter_from_list(head, instr, mode);
+	}
+
+	return filter_from_offset(head, ctx->module_id, (uint)(pc - ctx->module_start), mode);
+
+}
+
+/* filter programs - see utilities.h */
+
+static const struct {
+	const char * name;
+	uint mode;
+	uint active;		/* ACTIVE_ bit of a dynamic term */
+} filter_terms[] = {
+	{ "bb", FILTER_BB, 0 },
+	{ "module", FILTER_MODULE, 0 },
+	{ "range", FILTER_RANGE, 0 },
+	{ "negmodule", FILTER_NEG_MODULE, 0 },
+	{ "none", FILTER_NONE, 0 },
+	{ "function", FILTER_FUNCTION, ACTIVE_FUNCTION },
+	{ "thread", FILTER_THREAD, ACTIVE_THREAD },
+	{ "nudge", FILTER_NUDGE, ACTIVE_NUDGE }
+};
+
+#define NUM_FILTER_TERM_NAMES	(sizeof(filter_terms) / sizeof(filter_terms[0]))
+
+bool filter_program_compile(filter_program_t * program, const char * expr, module_t * head){
+
+	char term[MAX_STRING_LENGTH];
+	const char * end;
+	char * file;
+	filter_term_t * compiled;
+	size_t len;
+	uint i;
+
+	memset(program, 0, sizeof(filter_program_t));
+
+	while (*expr != '\0'){
+
+		end = strchr(expr, '+');
+		len = (end != NULL) ? (size_t)(end - expr) : strlen(expr);
+		if (len == 0 || len >= MAX_STRING_LENGTH || program->num_terms == MAX_FILTER_TERMS){
+			dr_fprintf(STDERR, "filter program - bad term in \"%s\"\n", expr);
+			filter_program_release(program);
+			return false;
+		}
+		memcpy(term, expr, len);
+		term[len] = '\0';
+		expr += len + (end != NULL);
+
+		/* the file may hold a drive letter - only the first ':' ends the name */
+		file = strchr(term, ':');
+		if (file != NULL){
+			*file++ = '\0';
+		}
+
+		for (i = 0; i < NUM_FILTER_TERM_NAMES && strcmp(filter_terms[i].name, term) != 0; i++);
+		if (i == NUM_FILTER_TERM_NAMES){
+			dr_fprintf(STDERR, "filter program - unknown term %s\n", term);
+			filter_program_release(program);
+			return false;
+		}
+
+		compiled = &program->terms[program->num_terms++];
+		compiled->mode = filter_terms[i].mode;
+		compiled->head = NULL;
+		compiled->owned = false;
+		program->dynamic |= filter_terms[i].active;
+		if (filter_terms[i].active == 0 && compiled->mode != FILTER_NONE){
+			compiled->owned = (file != NULL);
+			compiled->head = (file != NULL) ? filter_load(file, compiled->mode) : head;
+			program->instr_level |= !filter_is_block_level(compiled->mode);
+		}
+
+	}
+
+	return true;
+
+}
+
+void filter_program_release(filter_program_t * program){
+
+	uint i;
+
+	for (i = 0; i < program->num_terms; i++){
+		if (program->terms[i].owned){
+			filter_release(program->terms[i].head);
+		}
+	}
+	program->num_terms = 0;
+	program->dynamic = 0;
+	program->instr_level = false;
+
+}
+
+bool filter_program_bb(filter_program_t * program, bb_context_t * ctx){
+
+	uint i;
+
+	for (i = 0; i < program->num_terms; i++){
+		if (program->terms[i].head != NULL &&
+			!filter_bb_from_context(program->terms[i].head, ctx, program->terms[i].mode)){
+			return false;
+		}
+	}
+
+	return true;
+
+}
+
+bool filter_program_instr(filter_program_t * program, bb_context_t * ctx, instr_t * instr){
+
+	uint i;
+	filter_term_t * term;
+
+	for (i = 0; i < program->num_terms; i++){
+		term = &program->terms[i];
+		if (term->head == NULL){
+			continue;
+		}
+		if (filter_is_block_level(term->mode) ? !filter_bb_from_context(term->head, ctx, term->mode) :
+			!filter_instr_from_context(term->head, ctx, instr, term->mode)){
+			return false;
+		}
+	}
+
+	return true;
+
+}
+
+/* filter sets shared between passes -
+a filter file is parsed once no matter how many passes name it, and the parsed list is shared read
+only. The parsed list only serves as a filter, so it is read without the profile's bb information
+and the set is found by the file name alone. Sets are loaded from the passes' lazy init and filter
+program compiles, which run on application threads (module load, block building, nudges), and are
+released at exit. The cache itself is not locked - the dispatcher's init_mutex serializes every
+load, so any new caller must hold it too */
+
+typedef struct _filter_set_t {
+
+	char filename[MAX_STRING_LENGTH];	/* empty for the set of passes which do not filter */
+	module_t * head;
+	uint refcount;
+	struct _filter_set_t * next;
+
+} filter_set_t;
+
+static filter_set_t * filter_sets = NULL;
+
+module_t * filter_load(const char * filename, uint mode){
+
+	filter_set_t * set;
+	file_t in_file;
+
+	if (mode == FILTER_NONE || filename == NULL){
+		filename = "";
+	}
+
+	for (set = filter_sets; set != NULL; set = set->next){
+		if (strcmp(set->filename, filename) == 0){
+			set->refcount++;
+			return set->head;
+		}
+	}
+
+	set = (filter_set_t *)dr_global_alloc(sizeof(filter_set_t));
+	strncpy(set->filename, filename, MAX_STRING_LENGTH);
+	set->filename[MAX_STRING_LENGTH - 1] = '\0';
+	set->head = md_initialize();
+	set->refcount = 1;
+
+	if (filename[0] != '\0'){
+		in_file = dr_open_file(filename, DR_FILE_READ);
+		if (in_file == INVALID_FILE){
+			dr_fprintf(STDERR, "cannot open the filter file %s\n", filename);
+			DR_ASSERT_MSG(false, "filter file missing");
+		}
+		md_read_from_file(set->head, in_file, false);
+		dr_close_file(in_file);
+		DEBUG_PRINT("filter file %s loaded\n", filename);
+	}
+
+	set->next = filter_sets;
+	filter_sets = set;
+
+	return set->head;
+
+}
+
+void filter_release(module_t * head){
+
+	filter_set_t * set;
+	filter_set_t * prev = NULL;
+
+	for (set = filter_sets; set != NULL; prev = set, set = set->next){
+		if (set->head == head){
+			break;
+		}
+	}
+
+	DR_ASSERT_MSG(set != NULL, "releasing a filter set which was not loaded");
+
+	if (--set->refcount > 0){
+		return;
+	}
+
+	if (prev == NULL){
+		filter_sets = set->next;
+	}
+	else{
+		prev->next = set->next;
+	}
+
+	md_delete_list(set->head, false);
+	dr_global_free(set, sizeof(filter_set_t));
+
+}
+
+bool filter_has_file(module_t * head){
+
+	filter_set_t * set;
+
+	for (set = filter_sets; set != NULL; set = set->next){
+		if (set->head == head){
+			return set->filename[0] != '\0';
+		}
+	}
+
+	return false;
+
+}
+
+/* converts a bb file between the text protocol and the binary format - binary files are written as
+text (the profile protocol if they carry bb records, the filter protocol otherwise), text files are
+read as filters and written as binary */
+bool filter_convert(const char * in_filename, const char * out_filename){
+
+	file_t in_file;
+	file_t out_file;
+	module_t * head;
+	bool binary;
+	bool extra_info = false;
+
+	in_file = dr_open_file(in_filename, DR_FILE_READ);
+	if (in_file == INVALID_FILE){
+		dr_fprintf(STDERR, "cannot open the bb file %s\n", in_filename);
+		return false;
+	}
+	out_file = dr_open_file(out_filename, DR_FILE_WRITE_OVERWRITE);
+	if (out_file == INVALID_FILE){
+		dr_fprintf(STDERR, "cannot open the bb file %s\n", out_filename);
+		dr_close_file(in_file);
+		return false;
+	}
+
+	binary = md_file_is_binary(in_file, &extra_info);
+	head = md_initialize();
+	md_read_from_file(head, in_file, extra_info);
+
+	if (!binary){
+		md_print_binary_to_file(head, out_file, false);
+	}
+	else if (extra_info){
+		md_sort_bb_list_in_module(head);
+		md_print_to_file(head, out_file, true);
 	}
 	else{
-		return (md_lookup_module(head, name) != NULL);
+		md_print_filter_to_file(head, out_file);
+	}
+
+	md_delete_list(head, extra_info);
+	dr_close_file(out_file);
+	dr_close_file(in_file);
+
+	return true;
+
+}
+
+/* adds up the snapshots of a profile snapshot log into one profile */
+bool profile_merge(const char * log_filename, const char * out_filename, bool binary){
+
+	file_t log_file;
+	file_t out_file;
+	module_t * head;
+	uint snapshots;
+
+	log_file = dr_open_file(log_filename, DR_FILE_READ);
+	if (log_file == INVALID_FILE){
+		dr_fprintf(STDERR, "cannot open the snapshot log %s\n", log_filename);
+		return false;
 	}
+	out_file = dr_open_file(out_filename, DR_FILE_WRITE_OVERWRITE);
+	if (out_file == INVALID_FILE){
+		dr_fprintf(STDERR, "cannot open the bb file %s\n", out_filename);
+		dr_close_file(log_file);
+		return false;
+	}
+
+	head = md_initialize();
+	snapshots = md_read_snapshots_from_file(head, log_file);
+	DEBUG_PRINT("merged %u snapshots of %s\n", snapshots, log_filename);
+
+	if (binary){
+		md_print_binary_to_file(head, out_file, true);
+	}
+	else{
+		md_sort_bb_list_in_module(head);
+		md_print_to_file(head, out_file, true);
+	}
+
+	md_delete_list(head, true);
+	dr_close_file(out_file);
+	dr_close_file(log_file);
+
+	return true;
 
 }
 
@@ -145,10 +493,10 @@ bool filter_from_module_name(module_t * head, char * name, uint mode){
 
 bool get_offset_from_module(app_pc instr_addr,uint * offset){
 
-	module_data_t * data = dr_lookup_module(instr_addr);
+	loaded_module_t module;
 
-	if (data != NULL){
-		*offset = instr_addr - data->start;
+	if (module_registry_lookup(instr_addr, &module)){
+		*offset = instr_addr - module.start;
 		return true;
 	}
 	else{
@@ -0,0 +1,132 @@
+#include "dr_api.h"
+#include "include/writer.h"
+#include <string.h>
+#include <stdarg.h>
+
+/* an unusable file does not stop the instrumented application - the output is only lost */
+static void write_out(writer_t * writer, file_t file, const void * data, size_t size){
+
+	if (file == INVALID_FILE || writer->failed){
+		return;
+	}
+
+	if (dr_write_file(file, data, size) != (ssize_t)size){
+		dr_fprintf(STDERR, "writer - write failed, the rest of the output is dropped\n");
+		writer->failed = true;
+	}
+
+}
+
+writer_t * writer_create(file_t file, size_t size){
+
+	writer_t * writer = (writer_t *)dr_global_alloc(sizeof(writer_t));
+
+	if (size < 2 * WRITER_MAX_RECORD){
+		size = WRITER_DEFAULT_SIZE;
+	}
+
+	writer->file = file;
+	writer->size = size;
+	writer->used = 0;
+	writer->failed = false;
+	writer->in_memory = false;
+	writer->buf = (char *)dr_global_alloc(size);
+
+	return writer;
+
+}
+
+writer_t * writer_create_memory(size_t size){
+
+	writer_t * writer = writer_create(INVALID_FILE, size);
+
+	writer->in_memory = true;
+
+	return writer;
+
+}
+
+/* makes room for size more bytes - a memory writer doubles its buffer, others flush */
+static void make_room(writer_t * writer, size_t size){
+
+	size_t new_size;
+	char * buf;
+
+	if (writer->size - writer->used >= size){
+		return;
+	}
+
+	if (!writer->in_memory){
+		writer_flush(writer);
+		return;
+	}
+
+	for (new_size = writer->size * 2; new_size - writer->used < size; new_size *= 2);
+	buf = (char *)dr_global_alloc(new_size);
+	memcpy(buf, writer->buf, writer->used);
+	dr_global_free(writer->buf, writer->size);
+	writer->buf = buf;
+	writer->size = new_size;
+
+}
+
+void writer_destroy(writer_t * writer){
+
+	writer_flush(writer);
+	dr_global_free(writer->buf, writer->size);
+	dr_global_free(writer, sizeof(writer_t));
+
+}
+
+void writer_flush(writer_t * writer){
+
+	if (writer->used > 0 && !writer->in_memory){
+		write_out(writer, writer->file, writer->buf, writer->used);
+		writer->used = 0;
+	}
+
+}
+
+void writer_write_to_file(writer_t * writer, file_t file){
+
+	DR_ASSERT(writer->in_memory);
+
+	if (writer->used > 0){
+		write_out(writer, file, writer->buf, writer->used);
+		writer->used = 0;
+	}
+
+}
+
+void writer_printf(writer_t * writer, const char * fmt, ...){
+
+	va_list ap;
+	int written;
+
+	/* a record always fits once there is WRITER_MAX_RECORD room */
+	make_room(writer, WRITER_MAX_RECORD);
+
+	va_start(ap, fmt);
+	written = dr_vsnprintf(writer->buf + writer->used, WRITER_MAX_RECORD, fmt, ap);
+	va_end(ap);
+
+	DR_ASSERT_MSG(written >= 0 && written < WRITER_MAX_RECORD, "writer record too long");
+	writer->used += written;
+
+}
+
+void writer_write(writer_t * writer, const void * data, size_t size){
+
+	/* large blocks go to the file directly */
+	if (!writer->in_memory && size >= writer->size / 2){
+		writer_flush(writer);
+		write_out(writer, writer->file, data, size);
+		return;
+	}
+
+	make_room(writer, size);
+
+	memcpy(writer->buf + writer->used, data, size);
+	writer->used += size;
+
+}